@@ -0,0 +1,578 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define BUFSIZE 512
+#define IOSIZE (256 * 1024) // bytes por cada read/write del canal de datos
+#define MAX_SIZES 16        // tamaños de archivo distintos que admite -s
+
+/*
+ Generador de carga para servidor: abre varias sesiones concurrentes (un proceso
+ por sesión), cada una inicia sesión y ejecuta una mezcla de RETR y STOR sobre
+ archivos sintéticos, y al final informa la latencia de cada comando (p50/p99),
+ los inicios de sesión por segundo y el caudal total.
+ */
+
+// Configuración
+struct sockaddr_in server_addr;
+char *user = "anonymous", *pass = "";
+int sessions = 10;      // sesiones concurrentes
+int logins = 10;        // inicios de sesión de cada sesión en la fase de login
+int ops = 20;           // RETR/STOR de cada sesión en la fase de transferencias
+int retr_pct = 50;      // porcentaje de RETR (el resto son STOR)
+long sizes[MAX_SIZES] = { 64 * 1024 };
+int nsizes = 1;
+bool passive = false;   // canal de datos con PASV en lugar de PORT
+
+/*
+ Resultados, en memoria compartida con los procesos de cada sesión. Cada sesión
+ escribe solo en su porción de los arreglos de latencias (en segundos, -1 sin muestra).
+ */
+struct results {
+    double *login;      // sessions * logins
+    double *retr;       // sessions * ops
+    double *stor;       // sessions * ops
+    long *bytes;        // bytes transferidos por sesión
+    int *errors;        // comandos fallidos por sesión
+};
+
+struct results res;
+
+// Respuestas recibidas de la conexión de control aún no leídas (ver read_line)
+char in[BUFSIZE];
+int in_len;
+
+
+/*
+ Función: now
+
+ Instante actual en segundos, de un reloj monótono.
+ */
+
+double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ Función: parse_size
+
+ Convierte un tamaño como "4096", "64k", "1m" o "1g" en bytes. Devuelve -1 si no es válido.
+ */
+
+long parse_size(char *string) {
+    char *end;
+    long value = strtol(string, &end, 10);
+
+    if (end == string || value < 0) return -1;
+    switch (*end) {
+    case 'k': case 'K': value <<= 10; end++; break;
+    case 'm': case 'M': value <<= 20; end++; break;
+    case 'g': case 'G': value <<= 30; end++; break;
+    }
+    return *end == '\0' ? value : -1;
+}
+
+
+/*
+ Función: read_line
+
+ Lee una línea de respuesta del servidor (terminada en "\n") sobre el socket sd,
+ guardando en in lo recibido de más para la próxima llamada, como en cliente.c.
+ Cada proceso tiene una sola conexión de control abierta a la vez.
+ Devuelve la longitud de la línea, o -1 si se cerró la conexión.
+ */
+
+int read_line(int sd, char *line) {
+    char *eol;
+    int recv_s, line_len;
+
+    while ((eol = memchr(in, '\n', in_len)) == NULL) {
+        if (in_len == BUFSIZE) {
+            eol = in + BUFSIZE - 1;
+            break;
+        }
+        recv_s = recv(sd, in + in_len, BUFSIZE - in_len, 0);
+        if (recv_s <= 0) return -1;
+        in_len += recv_s;
+    }
+
+    line_len = eol - in;
+    memcpy(line, in, line_len);
+    line[line_len] = '\0';
+    if (line_len > 0 && line[line_len - 1] == '\r') line[--line_len] = '\0';
+
+    in_len -= eol - in + 1;
+    memmove(in, eol + 1, in_len);
+    return line_len;
+}
+
+
+/*
+ Función: reply
+
+ Recibe una respuesta completa (incluidas las de varias líneas "NNN-") y
+ devuelve su código, o -1 si se cerró la conexión. Si text no es NULL
+ copia allí el texto de la última línea.
+ */
+
+int reply(int sd, char *text) {
+    char line[BUFSIZE];
+    int code = -1;
+    char sep;
+
+    do {
+        if (read_line(sd, line) < 0) return -1;
+        sep = ' ';
+        if (sscanf(line, "%d%c", &code, &sep) < 1) sep = '-';
+    } while (sep == '-');
+
+    if (text) strcpy(text, line);
+    return code;
+}
+
+
+/*
+ Función: command
+
+ Envía al servidor el comando formateado, terminado en "\r\n".
+ */
+
+bool command(int sd, char *format, ...) {
+    char buffer[BUFSIZE];
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(buffer, BUFSIZE - 2, format, args);
+    va_end(args);
+    if (len > BUFSIZE - 3) len = BUFSIZE - 3;
+    strcpy(buffer + len, "\r\n");
+    return send(sd, buffer, len + 2, MSG_NOSIGNAL) == len + 2;
+}
+
+
+/*
+ Función: session_open
+
+ Se conecta al servidor e inicia sesión con el usuario configurado.
+ Devuelve el socket de control, o -1 si falló.
+ */
+
+int session_open(void) {
+    int sd, optval = 1;
+
+    in_len = 0;
+    sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sd < 0) return -1;
+    if (connect(sd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
+        close(sd);
+        return -1;
+    }
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+    if (reply(sd, NULL) != 220 ||
+        !command(sd, "USER %s", user) || reply(sd, NULL) != 331 ||
+        !command(sd, "PASS %s", pass) || reply(sd, NULL) != 230) {
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+
+/*
+ Función: session_close
+
+ Termina la sesión con QUIT y cierra el socket de control.
+ */
+
+void session_close(int sd) {
+    if (command(sd, "QUIT")) reply(sd, NULL);
+    close(sd);
+}
+
+
+/*
+ Función: data_open
+
+ Prepara el canal de datos antes de RETR o STOR: con PASV se conecta al puerto
+ que indica el servidor; si no, escucha en un puerto libre y lo anuncia con PORT.
+ Devuelve el socket (de escucha o ya conectado), o -1 si falló.
+ */
+
+int data_open(int sd) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    char text[BUFSIZE], *params;
+    unsigned char *ip;
+    int dsd, h[4], p[2], port;
+
+    dsd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (dsd < 0) return -1;
+
+    if (passive) {
+        if (!command(sd, "PASV") || reply(sd, text) != 227 || (params = strchr(text, '(')) == NULL ||
+            sscanf(params, "(%d,%d,%d,%d,%d,%d)", &h[0], &h[1], &h[2], &h[3], &p[0], &p[1]) != 6)
+            goto fail;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(h[0] << 24 | h[1] << 16 | h[2] << 8 | h[3]);
+        addr.sin_port = htons(p[0] << 8 | p[1]);
+        if (connect(dsd, (struct sockaddr *) &addr, sizeof(addr)) < 0) goto fail;
+        return dsd;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(dsd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(dsd, 1) < 0 ||
+        getsockname(dsd, (struct sockaddr *) &addr, &addr_len) < 0)
+        goto fail;
+    port = ntohs(addr.sin_port);
+
+    addr_len = sizeof(addr);
+    if (getsockname(sd, (struct sockaddr *) &addr, &addr_len) < 0) goto fail;
+    ip = (unsigned char *) &addr.sin_addr.s_addr;
+    if (!command(sd, "PORT %d,%d,%d,%d,%d,%d", ip[0], ip[1], ip[2], ip[3], port >> 8, port & 0xff) ||
+        reply(sd, NULL) != 200)
+        goto fail;
+    return dsd;
+
+fail:
+    close(dsd);
+    return -1;
+}
+
+
+/*
+ Función: data_accept
+
+ Obtiene la conexión de datos una vez aceptado RETR o STOR (ver data_open).
+ */
+
+int data_accept(int dsd) {
+    int dsda;
+
+    if (passive) return dsd;
+    dsda = accept4(dsd, NULL, NULL, SOCK_CLOEXEC);
+    close(dsd);
+    return dsda;
+}
+
+
+/*
+ Función: retr
+
+ Descarga name y descarta los datos. Devuelve los bytes recibidos, o -1 si
+ el comando falló o el archivo no llegó completo.
+ */
+
+long retr(int sd, char *name, char *buffer) {
+    char text[BUFSIZE];
+    long size = -1, got = 0;
+    ssize_t n;
+    int dsd;
+
+    if ((dsd = data_open(sd)) < 0) return -1;
+    if (!command(sd, "RETR %s", name) || reply(sd, text) != 299) {
+        close(dsd);
+        return -1;
+    }
+    sscanf(text, "299 File %*s size %ld bytes", &size);
+    if ((dsd = data_accept(dsd)) < 0) return -1;
+
+    while ((n = read(dsd, buffer, IOSIZE)) > 0) got += n;
+    close(dsd);
+
+    if (reply(sd, NULL) != 226 || got != size) return -1;
+    return got;
+}
+
+
+/*
+ Función: stor
+
+ Sube size bytes sintéticos (el contenido de buffer, repetido) con el nombre name.
+ Devuelve los bytes enviados, o -1 si el comando falló.
+ */
+
+long stor(int sd, char *name, long size, char *buffer) {
+    long left = size;
+    ssize_t n;
+    int dsd;
+
+    if ((dsd = data_open(sd)) < 0) return -1;
+    if (!command(sd, "STOR %s//%ld", name, size) || reply(sd, NULL) != 150) {
+        close(dsd);
+        return -1;
+    }
+    if ((dsd = data_accept(dsd)) < 0) return -1;
+
+    while (left > 0) {
+        n = send(dsd, buffer, left < IOSIZE ? left : IOSIZE, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        left -= n;
+    }
+    close(dsd);
+
+    if (reply(sd, NULL) != 226 || left > 0) return -1;
+    return size;
+}
+
+
+/*
+ Función: setup
+
+ Sube los archivos sintéticos que luego se descargan con RETR, uno por tamaño.
+ */
+
+void setup(char *buffer) {
+    char name[BUFSIZE];
+    int sd, i;
+
+    if ((sd = session_open()) < 0) errx(1, "Cannot log in as %s", user);
+    for (i = 0; i < nsizes; i++) {
+        snprintf(name, sizeof(name), "bench_%ld.dat", sizes[i]);
+        if (stor(sd, name, sizes[i], buffer) < 0) errx(1, "Cannot upload %s", name);
+    }
+    session_close(sd);
+}
+
+
+/*
+ Función: login_worker
+
+ Fase de login de la sesión id: inicia y cierra sesión logins veces seguidas,
+ midiendo cada inicio (desde connect hasta la respuesta 230).
+ */
+
+void login_worker(int id) {
+    double t0;
+    int i, sd;
+
+    for (i = 0; i < logins; i++) {
+        t0 = now();
+        sd = session_open();
+        if (sd < 0) {
+            res.errors[id]++;
+            continue;
+        }
+        res.login[id * logins + i] = now() - t0;
+        session_close(sd);
+    }
+}
+
+
+/*
+ Función: xfer_worker
+
+ Fase de transferencias de la sesión id: por una única conexión de control
+ ejecuta ops comandos RETR o STOR (según retr_pct), recorriendo los tamaños
+ configurados, y mide cada uno desde el envío del comando hasta el 226.
+ */
+
+void xfer_worker(int id, char *buffer) {
+    char name[BUFSIZE];
+    double t0;
+    long n, size;
+    int i, sd;
+
+    if ((sd = session_open()) < 0) {
+        res.errors[id] += ops;
+        return;
+    }
+    srand(id + 1);
+
+    for (i = 0; i < ops; i++) {
+        size = sizes[i % nsizes];
+        t0 = now();
+        if (rand() % 100 < retr_pct) {
+            snprintf(name, sizeof(name), "bench_%ld.dat", size);
+            n = retr(sd, name, buffer);
+            if (n >= 0) res.retr[id * ops + i] = now() - t0;
+        } else {
+            snprintf(name, sizeof(name), "bench_up_%d.dat", id);
+            n = stor(sd, name, size, buffer);
+            if (n >= 0) res.stor[id * ops + i] = now() - t0;
+        }
+        if (n < 0) res.errors[id]++;
+        else res.bytes[id] += n;
+    }
+
+    // Borrar lo subido no es posible (no hay DELE): se deja el último archivo
+    session_close(sd);
+}
+
+
+/*
+ Función: run_phase
+
+ Crea un proceso por sesión para ejecutar la fase indicada y espera a todos.
+ Devuelve la duración de la fase en segundos.
+ */
+
+double run_phase(bool transfers, char *buffer) {
+    double t0 = now();
+    pid_t pid;
+    int i;
+
+    for (i = 0; i < sessions; i++) {
+        pid = fork();
+        if (pid == 0) {
+            if (transfers) xfer_worker(i, buffer);
+            else login_worker(i);
+            exit(0);
+        }
+        if (pid < 0) err(1, "Cannot create process");
+    }
+    while (wait(NULL) > 0 || errno == EINTR);
+    return now() - t0;
+}
+
+
+/*
+ Función: compare
+
+ Orden ascendente de muestras para qsort.
+ */
+
+int compare(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+
+/*
+ Función: report
+
+ Imprime la cantidad de muestras válidas de samples (de count) y sus
+ percentiles 50 y 99 en milisegundos. Devuelve la cantidad de muestras.
+ */
+
+int report(char *label, double *samples, int count) {
+    int i, n = 0;
+
+    // Compactar las muestras válidas al principio y ordenarlas
+    for (i = 0; i < count; i++) {
+        if (samples[i] >= 0) samples[n++] = samples[i];
+    }
+    if (n == 0) {
+        printf("%-6s      0 ops\n", label);
+        return 0;
+    }
+    qsort(samples, n, sizeof(*samples), compare);
+    printf("%-6s %6d ops  p50 %8.3f ms  p99 %8.3f ms  max %8.3f ms\n", label, n,
+           samples[n / 2] * 1e3, samples[(int) (n * 0.99)] * 1e3, samples[n - 1] * 1e3);
+    return n;
+}
+
+
+/*
+ Función: shared
+
+ Reserva count elementos de tamaño size en memoria compartida con los hijos.
+ */
+
+void *shared(size_t count, size_t size) {
+    void *p = mmap(NULL, count * size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) err(1, "Cannot allocate results");
+    return p;
+}
+
+
+/**
+ * Run with
+ *         ./bench [-c sesiones] [-l logins] [-n ops] [-r %retr] [-s tamaño[,tamaño...]]
+ *                 [-u usuario] [-w contraseña] [-P] <IP_SERVIDOR> <PUERTO>
+ **/
+int main(int argc, char *argv[]) {
+    double login_secs, xfer_secs;
+    long total = 0;
+    int opt, i, errors = 0, done;
+    char *buffer, *token;
+
+    while ((opt = getopt(argc, argv, "c:l:n:r:s:u:w:P")) != -1) {
+        switch (opt) {
+        case 'c': sessions = atoi(optarg); break;
+        case 'l': logins = atoi(optarg); break;
+        case 'n': ops = atoi(optarg); break;
+        case 'r': retr_pct = atoi(optarg); break;
+        case 'u': user = optarg; break;
+        case 'w': pass = optarg; break;
+        case 'P': passive = true; break;
+        case 's':
+            for (nsizes = 0, token = strtok(optarg, ","); token; token = strtok(NULL, ",")) {
+                if (nsizes == MAX_SIZES || (sizes[nsizes++] = parse_size(token)) < 0)
+                    errx(1, "Invalid size %s", token);
+            }
+            break;
+        default:
+            errx(1, "usage: %s [-c sessions] [-l logins] [-n ops] [-r retr%%] [-s size,...] "
+                    "[-u user] [-w pass] [-P] ip port", argv[0]);
+        }
+    }
+    if (argc - optind != 2) errx(1, "Server IP and port expected as arguments");
+    if (sessions < 1 || logins < 0 || ops < 0 || nsizes < 1 || retr_pct < 0 || retr_pct > 100)
+        errx(1, "Invalid arguments");
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[optind + 1]));
+    if (inet_pton(AF_INET, argv[optind], &server_addr.sin_addr) != 1) errx(1, "Invalid IP");
+
+    // Datos sintéticos, compartidos por todas las transferencias
+    if ((buffer = malloc(IOSIZE)) == NULL) err(1, "Cannot allocate buffer");
+    for (i = 0; i < IOSIZE; i++) buffer[i] = "srvFtp bench\n"[i % 13];
+
+    res.login = shared((size_t) sessions * (logins ? logins : 1), sizeof(double));
+    res.retr = shared((size_t) sessions * (ops ? ops : 1), sizeof(double));
+    res.stor = shared((size_t) sessions * (ops ? ops : 1), sizeof(double));
+    res.bytes = shared(sessions, sizeof(long));
+    res.errors = shared(sessions, sizeof(int));
+    for (i = 0; i < sessions * (logins ? logins : 1); i++) res.login[i] = -1;
+    for (i = 0; i < sessions * (ops ? ops : 1); i++) res.retr[i] = res.stor[i] = -1;
+
+    printf("%d sesiones, %d logins y %d transferencias por sesión (%d%% RETR, %s), tamaños:",
+           sessions, logins, ops, retr_pct, passive ? "PASV" : "PORT");
+    for (i = 0; i < nsizes; i++) printf(" %ld", sizes[i]);
+    printf("\n");
+    fflush(stdout);
+
+    if (ops > 0) setup(buffer);
+    login_secs = run_phase(false, buffer);
+    xfer_secs = run_phase(true, buffer);
+
+    // Resultados
+    done = report("login", res.login, sessions * logins);
+    if (logins > 0) printf("       %.1f logins/s\n", done / login_secs);
+    report("RETR", res.retr, sessions * ops);
+    report("STOR", res.stor, sessions * ops);
+    for (i = 0; i < sessions; i++) {
+        total += res.bytes[i];
+        errors += res.errors[i];
+    }
+    printf("total  %.1f MB en %.3f s (%.1f MB/s), %d errores\n", total / 1e6, xfer_secs,
+           total / xfer_secs / 1e6, errors);
+
+    free(buffer);
+    return errors ? 2 : 0;
+}
@@ -2,43 +2,138 @@
 #include <stdlib.h>
 
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <err.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include<ctype.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <time.h>
+#include <zlib.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <sys/mman.h>
 
 #define BUFSIZE 512
+#define SEGBUFSIZE (256 * 1024) // buffer de recepción de cada segmento de get -j
+#define MIN_SEGMENT (1024 * 1024) // tamaño mínimo de un segmento de get -j
+#define ZBUFSIZE (64 * 1024) // buffers de compresión de MODE Z
+#define ZCHECK (256 * 1024) // bytes comprimidos antes de evaluar la ganancia de MODE Z
+#define BLOCK_EOF 64 // descriptor de MODE B: último bloque del archivo
+#define BLOCK_MARK 16 // descriptor de MODE B: marcador de reinicio (no son datos)
+#define PIPELINE 32 // comandos RETR de mget enviados sin esperar respuesta
+#define EXIT_FAILED 2 // código de salida: falló alguna operación del script
+#define EXIT_USAGE 3 // código de salida: argumentos, script o credenciales inválidos
+#define EXIT_LOGIN 8 // código de salida: el servidor rechazó el usuario o la contraseña
+#define SKIPPED (-2) // resultado de reget/reput: el archivo ya estaba completo y no se transfirió
+
+// Resultado de una sesión de mget o mput
+struct batch_result {
+    long files, bytes, failed;
+    long skipped;  // reget/reput que no transfirieron nada (solo en el resumen del script)
+};
+
+// Resultado de un comando de la sesión interactiva o del script
+enum cmd_result { CMD_OK, CMD_FAILED, CMD_QUIT };
+
+// Datos de la sesión, para que get -j abra más conexiones con el mismo usuario
+struct sockaddr_in server_addr;
+char login_user[BUFSIZE], login_pass[BUFSIZE];
+bool quiet = false; // no mostrar las respuestas del servidor
+bool passive = false; // canal de datos en modo pasivo (PASV)
+char mode = 'S'; // modo de transferencia: S (stream), Z (comprimido) o B (bloques)
+int block_sd = -1; // conexión de datos que MODE B conserva entre archivos
+int zlevel = Z_DEFAULT_COMPRESSION; // nivel de compresión de MODE Z
+bool script = false; // modo batch (-b): sin preguntas, una línea de resultado por transferencia
+struct batch_result totals; // transferencias del script, para el resumen final
+
+
+/*
+Función: read_line
+
+Lee una línea de respuesta del servidor (terminada en "\n") sobre el socket sd.
+Las respuestas pueden llegar varias juntas en un mismo recv() o partidas en varios,
+por eso se guardan en un búfer propio lo recibido de más para la próxima llamada.
+Devuelve la longitud de la línea (sin el fin de línea), o -1 si se cerró la conexión.
+*/
+
+int read_line(int sd, char *line) {
+    static char buffer[BUFSIZE];
+    static int len = 0, owner = -1;
+    char *eol;
+    int recv_s, line_len;
+
+    // Lo pendiente de otra conexión no pertenece a esta
+    if (sd != owner) {
+        owner = sd;
+        len = 0;
+    }
+
+    while ((eol = memchr(buffer, '\n', len)) == NULL) {
+        // Línea demasiado larga: se entrega truncada
+        if (len == BUFSIZE) {
+            eol = buffer + BUFSIZE - 1;
+            break;
+        }
+        recv_s = recv(sd, buffer + len, BUFSIZE - len, 0);
+        if (recv_s < 0) {
+            warn("error receiving data");
+            return -1;
+        }
+        if (recv_s == 0) return -1;
+        len += recv_s;
+    }
+
+    line_len = eol - buffer;
+    memcpy(line, buffer, line_len);
+    line[line_len] = '\0';
+    if (line_len > 0 && line[line_len - 1] == '\r') line[--line_len] = '\0';
+
+    len -= eol - buffer + 1;
+    memmove(buffer, eol + 1, len);
+    return line_len;
+}
 
 
 /*
 Función: recv_msg
 
-Esta función recibe un mensaje del servidor FTP y verifica el código de respuesta. 
-Toma el descriptor de socket sd para la conexión FTP, 
-el código de respuesta esperado code y 
-un puntero a un búfer de texto opcional text para almacenar el mensaje recibido. 
-Utiliza la función recv() para recibir datos del servidor, analiza el código de respuesta 
-y el mensaje recibido y los muestra por pantalla. 
+Esta función recibe un mensaje del servidor FTP y verifica el código de respuesta.
+Toma el descriptor de socket sd para la conexión FTP,
+el código de respuesta esperado code y
+un puntero a un búfer de texto opcional text para almacenar el mensaje recibido.
+Lee la respuesta línea a línea con read_line (una respuesta de varias líneas
+"NNN-..." termina en la línea "NNN ..."), analiza el código de respuesta
+y el mensaje recibido y los muestra por pantalla.
 Devuelve true si el código de respuesta coincide con el esperado, de lo contrario devuelve false.
  */
 
 bool recv_msg(int sd, int code, char *text) {
     char buffer[BUFSIZE], message[BUFSIZE];
-    int recv_s, recv_code;
-
-    // Recibe una respuesta
-    recv_s = recv(sd, buffer, BUFSIZE, 0);
-
-    // Verifica si hay errores
-    if (recv_s < 0) warn("error receiving data");
-    if (recv_s == 0) errx(1, "connection closed by host");
+    int recv_code;
+    char sep;
+
+    do {
+        // Recibe una línea de la respuesta y verifica si hay errores
+        if (read_line(sd, buffer) < 0) errx(1, "connection closed by host");
+
+        // Analizando el código y el mensaje recibido de la respuesta
+        message[0] = '\0';
+        sep = ' ';
+        if (sscanf(buffer, "%d%c%[^\r\n]", &recv_code, &sep, message) < 1) {
+            printf("%s\n", buffer);
+            sep = '-';
+            continue;
+        }
+        if (!quiet) printf("%d %s\n", recv_code, message);
+    } while (sep == '-');
 
-    // Analizando el código y el mensaje recibido de la respuesta
-    sscanf(buffer, "%d %[^\r\n]\r\n", &recv_code, message);
-    printf("%d %s\n", recv_code, message);
     // Copia opcional de parámetros
     if(text) strcpy(text, message);
     // Test booleano para "code"
@@ -74,63 +169,103 @@ void send_msg(int sd, char *operation, char *param) {
 /*
 Función: read_input
 
-Esta función realiza una lectura simple desde el teclado. 
-Lee una línea de entrada del usuario (stdin) utilizando fgets() y 
-luego elimina el carácter de salto de línea ("\n") utilizando strtok().
+Esta función realiza una lectura simple desde el teclado o el script.
+Lee una línea de in (stdin o el script de -b) en input (de BUFSIZE bytes)
+utilizando fgets() y luego elimina el carácter de salto de línea ("\n").
+Devuelve input, o NULL si no hay más entrada.
 */
 
-char * read_input() {
-    char *input = malloc(BUFSIZE);
-    if (fgets(input, BUFSIZE, stdin)) {
-        return strtok(input, "\n");
-    }
-    return NULL;
+char * read_input(char *input, FILE *in) {
+    if (fgets(input, BUFSIZE, in) == NULL) return NULL;
+    input[strcspn(input, "\n")] = '\0';
+    return input;
 }
 
 
 /*
 Función: authenticate
 Esta función se encarga del proceso de inicio de sesión en el servidor FTP 
-desde el lado del cliente. Solicita al usuario un nombre de usuario y contraseña, 
+desde el lado del cliente. Usa el usuario y la contraseña recibidos
+(de los argumentos o de netrc) y solicita al usuario los que falten (NULL),
 envía los comandos USER y PASS al servidor y 
 espera las respuestas correspondientes. 
 Si las respuestas son exitosas (códigos 331 y 230), el proceso de inicio de sesión se considera válido.
 */
 
-void authenticate(int sd) {
-    char *input, desc[100];
-    int code;
+void authenticate(int sd, char *user, char *pass) {
+    char line[BUFSIZE], *input = user, desc[BUFSIZE];
 
     // Pregunta al usuario
-    printf("username: ");
-    input = read_input();
+    if (input == NULL) {
+        printf("username: ");
+        input = read_input(line, stdin);
+    }
 
     // Envía el comando al servidor
     send_msg(sd, "USER", input);
-    
-    // Libera memoria
-    free(input);
+    snprintf(login_user, BUFSIZE, "%s", input ? input : "");
 
     // Espera a recibir contraseña requerida y verifica si hay errores
     if (!recv_msg(sd, 331, desc))
         errx(1, "unexpected response from server");
 
     // Pide la contraseña
-    printf("passwd: ");
-    input = read_input();
+    input = pass;
+    if (input == NULL) {
+        printf("passwd: ");
+        input = read_input(line, stdin);
+    }
 
      // Envía el comando al servidor
     send_msg(sd, "PASS", input);
-
-    // Libera memoria
-    free(input);
+    snprintf(login_pass, BUFSIZE, "%s", input ? input : "");
 
     // Espera a recibir respuesta y verifica si hay errores
     if (!recv_msg(sd, 230, desc))
-        errx(1, "unexpected response from server");
+        errx(EXIT_LOGIN, "login incorrect");
 
 }
 
+
+/*
+Función: netrc_find
+
+Busca en el archivo path, con el formato de ~/.netrc ("machine host login
+usuario password contraseña", o "default login ... password ..."), las
+credenciales del servidor host. Si user ya trae un usuario solo sirve una
+entrada con ese login. Deja el usuario y la contraseña en user y pass
+(de BUFSIZE bytes). Devuelve true si las encontró.
+*/
+
+bool netrc_find(char *path, char *host, char *user, char *pass) {
+    char tok[BUFSIZE], login[BUFSIZE] = "", password[BUFSIZE] = "";
+    bool match = false, found = false, end;
+    FILE *file;
+
+    if ((file = fopen(path, "r")) == NULL) return false;
+    while (true) {
+        end = fscanf(file, "%511s", tok) != 1;
+        if (end || strcmp(tok, "machine") == 0 || strcmp(tok, "default") == 0) {
+            // Termina la entrada anterior: sirve si es de host y del usuario pedido
+            found = match && password[0] && login[0] && (user[0] == '\0' || strcmp(user, login) == 0);
+            if (end || found) break;
+            match = strcmp(tok, "default") == 0 || (fscanf(file, "%511s", tok) == 1 && strcmp(tok, host) == 0);
+            login[0] = password[0] = '\0';
+        } else if (strcmp(tok, "login") == 0 && fscanf(file, "%511s", tok) == 1) {
+            strcpy(login, tok);
+        } else if (strcmp(tok, "password") == 0 && fscanf(file, "%511s", tok) == 1) {
+            strcpy(password, tok);
+        }
+    }
+    fclose(file);
+
+    if (found) {
+        strcpy(user, login);
+        strcpy(pass, password);
+    }
+    return found;
+}
+
 /*
 Función: port
 
@@ -142,11 +277,11 @@ Espera una respuesta exitosa (código 200) del servidor.
 */
 
 bool port(int sd, char *ip, int port) {
-    char desc[BUFSIZE];
-    int code;
+    char desc[BUFSIZE], *dot;
 
-    // Envía el comando PORT al servidor
+    // Envía el comando PORT al servidor con el formato h1,h2,h3,h4,p1,p2
     sprintf(desc, "%s,%d,%d", ip, port/256, port%256);
+    while ((dot = strchr(desc, '.')) != NULL) *dot = ',';
     send_msg(sd, "PORT", desc);
 
     // Espera por la respuesta y la procesa. Verifica si hay errores
@@ -157,6 +292,344 @@ bool port(int sd, char *ip, int port) {
 }
 
 
+/*
+Función: pasv
+
+Envía el comando PASV y obtiene de la respuesta 227
+"Entering Passive Mode (h1,h2,h3,h4,p1,p2)" la dirección y el puerto
+en los que el servidor espera la conexión de datos.
+Devuelve true si el servidor aceptó el modo pasivo.
+*/
+
+bool pasv(int sd, struct sockaddr_in *addr) {
+    char desc[BUFSIZE], *params;
+    int h[4], p[2];
+
+    send_msg(sd, "PASV", NULL);
+    if (!recv_msg(sd, 227, desc)) return false;
+
+    params = strchr(desc, '(');
+    if (params == NULL || sscanf(params, "(%d,%d,%d,%d,%d,%d)", &h[0], &h[1], &h[2], &h[3], &p[0], &p[1]) != 6) {
+        warnx("Invalid PASV answer");
+        return false;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(h[0] << 24 | h[1] << 16 | h[2] << 8 | h[3]);
+    addr->sin_port = htons(p[0] << 8 | p[1]);
+    return true;
+}
+
+
+/*
+Función: data_open
+
+Prepara el canal de datos antes de enviar RETR o STOR.
+En modo activo escucha en un puerto libre elegido por el sistema (sin
+colisiones, a diferencia de un puerto al azar) y lo anuncia con PORT;
+en modo pasivo pide PASV y se conecta al puerto que indica el servidor.
+En MODE B reutiliza la conexión de la transferencia anterior, si la hay.
+Devuelve el socket (de escucha o ya conectado), o -1 si no pudo prepararse.
+*/
+
+int data_open(int sd) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    char ip[INET_ADDRSTRLEN];
+    int dsd;
+
+    if (block_sd >= 0) return block_sd;
+
+    dsd = socket(AF_INET, SOCK_STREAM, 0);
+    if (dsd < 0) {
+        warn("Cannot create socket");
+        return -1;
+    }
+
+    if (passive) {
+        if (!pasv(sd, &addr) || connect(dsd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            warn("Cannot open data channel");
+            close(dsd);
+            return -1;
+        }
+        return dsd;
+    }
+
+    // Escuchar el canal de datos en un puerto libre elegido por el sistema
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = 0;
+    if (bind(dsd, (struct sockaddr *) &addr, sizeof(addr)) < 0) errx(4,"Cannot bind");
+    if (listen(dsd,1) < 0) errx(5, "Listen data channel error");
+    getsockname(dsd, (struct sockaddr *) &addr, &addr_len);
+    int puerto = ntohs(addr.sin_port);
+
+    // Anunciar la dirección local de la conexión de control
+    addr_len = sizeof(addr);
+    getsockname(sd, (struct sockaddr *) &addr, &addr_len);
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    port(sd, ip, puerto);
+    return dsd;
+}
+
+
+/*
+Función: data_accept
+
+Obtiene la conexión de datos una vez que el servidor aceptó RETR o STOR.
+En modo activo acepta la conexión del servidor y cierra el socket de escucha;
+en modo pasivo (o si es la conexión que conserva MODE B) ya está establecida.
+*/
+
+int data_accept(int dsd) {
+    int dsda;
+
+    if (passive || dsd == block_sd) return dsd;
+
+    dsda = accept(dsd, NULL, NULL);
+    if (dsda < 0) errx(6, "Accept data channel error");
+    close(dsd);
+    return dsda;
+}
+
+
+/*
+Función: data_close
+
+Termina de usar la conexión de datos dsd. En MODE B, si la transferencia
+terminó bien (keep), se conserva para la próxima.
+*/
+
+void data_close(int dsd, bool keep) {
+    if (mode == 'B' && keep) {
+        block_sd = dsd;
+        return;
+    }
+    close(dsd);
+    if (dsd == block_sd) block_sd = -1;
+}
+
+
+/*
+Función: remote_size
+
+Consulta con el comando SIZE el tamaño de un archivo del servidor.
+Devuelve el tamaño en bytes, o -1 si el archivo no existe en el servidor.
+*/
+
+long remote_size(int sd, char *file_name) {
+    char desc[BUFSIZE];
+
+    send_msg(sd, "SIZE", file_name);
+    if (!recv_msg(sd, 213, desc)) return -1;
+    return atol(desc);
+}
+
+
+/*
+Función: rest
+
+Envía el comando REST para que la próxima transferencia comience en el byte offset.
+Devuelve true si el servidor lo aceptó (código 350).
+*/
+
+bool rest(int sd, long offset) {
+    char desc[BUFSIZE];
+
+    sprintf(desc, "%ld", offset);
+    send_msg(sd, "REST", desc);
+    return recv_msg(sd, 350, NULL);
+}
+
+
+/*
+Función: same_prefix
+
+Compara los primeros len bytes de la copia local file con los del archivo
+file_name del servidor, con el CRC-32 que devuelve XCRC. Así reget y reput
+no completan un archivo con el final de otro distinto. Deja file al
+principio. Devuelve true si coinciden.
+*/
+
+bool same_prefix(int sd, char *file_name, FILE *file, long len) {
+    char buffer[ZBUFSIZE], desc[BUFSIZE];
+    uLong crc = crc32(0, NULL, 0);
+    long left = len;
+    size_t n;
+
+    rewind(file);
+    while (left > 0 && (n = fread(buffer, 1, left < ZBUFSIZE ? left : ZBUFSIZE, file)) > 0) {
+        crc = crc32(crc, (Bytef *) buffer, n);
+        left -= n;
+    }
+    rewind(file);
+    if (left > 0) return false;
+
+    snprintf(desc, sizeof(desc), "%s 0 %ld", file_name, len - 1);
+    send_msg(sd, "XCRC", desc);
+    if (!recv_msg(sd, 250, desc)) return false;
+    return strtoul(desc, NULL, 16) == crc;
+}
+
+
+/*
+Función: compressed_type
+
+Indica si el nombre de path corresponde a un formato que ya viene comprimido,
+que put envía en MODE Z sin volver a comprimir.
+*/
+
+bool compressed_type(char *path) {
+    char *types[] = { "gz", "tgz", "bz2", "xz", "zst", "lz4", "zip", "7z", "rar", "jpg", "jpeg",
+                      "png", "gif", "webp", "mp3", "mp4", "mkv", "avi", "mov", "ogg", "flac", NULL };
+    char *ext = strrchr(path, '.');
+    int i;
+
+    if (ext == NULL || strchr(ext, '/')) return false;
+    for (i = 0; types[i]; i++) {
+        if (strcasecmp(ext + 1, types[i]) == 0) return true;
+    }
+    return false;
+}
+
+
+/*
+Función: recv_inflate
+
+Recibe por dsd un archivo comprimido con deflate (MODE Z), lo descomprime y
+lo escribe en file. Devuelve la cantidad de bytes recibidos por la red, o -1
+si el flujo llegó incompleto o dañado.
+*/
+
+long recv_inflate(int dsd, FILE *file) {
+    static char in[ZBUFSIZE], out[ZBUFSIZE];
+    z_stream zs;
+    long wire = 0, n;
+    int r = Z_OK;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) return -1;
+    while (r != Z_STREAM_END) {
+        if (zs.avail_in == 0) {
+            n = read(dsd, in, ZBUFSIZE);
+            if (n <= 0) {
+                if (n < 0) warn("receive error");
+                break;
+            }
+            wire += n;
+            zs.next_in = (Bytef *) in;
+            zs.avail_in = n;
+        }
+        zs.next_out = (Bytef *) out;
+        zs.avail_out = ZBUFSIZE;
+        r = inflate(&zs, Z_NO_FLUSH);
+        if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) break;
+        fwrite(out, 1, ZBUFSIZE - zs.avail_out, file);
+    }
+    inflateEnd(&zs);
+    return r == Z_STREAM_END ? wire : -1;
+}
+
+
+/*
+Función: send_deflate
+
+Comprime file con deflate al nivel level y lo envía por dsd (MODE Z). Si tras
+ZCHECK bytes la compresión no ahorra al menos un 10%, el resto se envía en
+bloques sin comprimir. Devuelve la cantidad de bytes enviados, o -1 ante un error.
+*/
+
+long send_deflate(int dsd, FILE *file, int level) {
+    static char in[ZBUFSIZE], out[ZBUFSIZE];
+    z_stream zs;
+    long wire = 0, n;
+    int r = Z_OK, flush = Z_NO_FLUSH;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit(&zs, level) != Z_OK) return -1;
+    while (r != Z_STREAM_END) {
+        if (zs.avail_in == 0 && flush == Z_NO_FLUSH) {
+            n = fread(in, 1, ZBUFSIZE, file);
+            if (n < ZBUFSIZE) flush = Z_FINISH;
+            zs.next_in = (Bytef *) in;
+            zs.avail_in = n;
+        }
+        zs.next_out = (Bytef *) out;
+        zs.avail_out = ZBUFSIZE;
+        if (level != 0 && zs.total_in >= ZCHECK && zs.total_out * 10 > zs.total_in * 9 &&
+            deflateParams(&zs, 0, Z_DEFAULT_STRATEGY) == Z_OK)
+            level = 0;
+        r = deflate(&zs, flush);
+        n = ZBUFSIZE - zs.avail_out;
+        if (n > 0 && write(dsd, out, n) != n) {
+            warn("Error sending data");
+            r = Z_STREAM_ERROR;
+            break;
+        }
+        wire += n;
+    }
+    deflateEnd(&zs);
+    return r == Z_STREAM_END ? wire : -1;
+}
+
+
+/*
+Función: recv_blocks
+
+Recibe por dsd un archivo en MODE B: bloques con una cabecera de 3 bytes
+(descriptor y cantidad de bytes) seguida de los datos, que se escriben en
+file. Lee exactamente hasta el bloque final, porque la conexión sigue
+abierta para el próximo archivo. Devuelve false si la conexión se cortó antes.
+*/
+
+bool recv_blocks(int dsd, FILE *file) {
+    static char buffer[ZBUFSIZE];
+    unsigned char hdr[3];
+    long left, n;
+    int got;
+
+    while (true) {
+        for (got = 0; got < 3; got += n) {
+            n = read(dsd, hdr + got, 3 - got);
+            if (n <= 0) return false;
+        }
+        for (left = hdr[1] << 8 | hdr[2]; left > 0; left -= n) {
+            n = read(dsd, buffer, left < ZBUFSIZE ? left : ZBUFSIZE);
+            if (n <= 0) return false;
+            // Los marcadores de reinicio no forman parte del archivo
+            if (!(hdr[0] & BLOCK_MARK)) fwrite(buffer, 1, n, file);
+        }
+        if (hdr[0] & BLOCK_EOF) return true;
+    }
+}
+
+
+/*
+Función: send_blocks
+
+Envía file por dsd en MODE B, en bloques de hasta 65535 bytes; el último
+lleva el descriptor BLOCK_EOF. Devuelve false ante un error de envío.
+*/
+
+bool send_blocks(int dsd, FILE *file) {
+    static unsigned char buffer[3 + 65535];
+    long n;
+
+    do {
+        n = fread(buffer + 3, 1, 65535, file);
+        buffer[0] = n < 65535 ? BLOCK_EOF : 0;
+        buffer[1] = n >> 8;
+        buffer[2] = n & 0xff;
+        if (write(dsd, buffer, n + 3) != n + 3) {
+            warn("Error sending data");
+            return false;
+        }
+    } while (n == 65535);
+    return true;
+}
+
+
 /*
 Función: get
 
@@ -164,92 +637,123 @@ sd: descriptor de socket de la conexión de control
 file_name: nombre del archivo a obtener del servidor 
 
 Esta función se encarga de descargar un archivo desde el servidor FTP. 
-Utiliza el comando PORT para establecer una conexión de datos y configurar 
-un socket para escuchar conexiones entrantes. 
+Establece la conexión de datos con data_open (PORT o PASV, según el modo). 
 Luego, envía el comando RETR al servidor con el nombre del archivo que se desea descargar. 
 Recibe los datos del archivo a través del canal de datos y los escribe en un archivo local. 
 Finalmente, cierra los sockets y el archivo y espera la confirmación del servidor.
+Con resume (reget), si ya existe una copia local que coincide con el comienzo
+del archivo del servidor (una descarga interrumpida, ver same_prefix), se
+pide con REST solo el resto y se agrega al final de la copia; si no
+coincide, se descarga completo.
+En MODE Z los datos llegan comprimidos y se descomprimen con recv_inflate;
+en MODE B llegan en bloques por la conexión que se conserva (recv_blocks).
+Devuelve los bytes del archivo recibidos, SKIPPED si la copia local ya
+estaba completa, o -1 si la descarga falló.
 */
 
-void get(int sd, char *file_name) {
+long get(int sd, char *file_name, bool resume) {
    char buffer[BUFSIZE];
-    long f_size, recv_s, r_size = BUFSIZE;
+    long f_size, recv_s, r_size = BUFSIZE, offset = 0, r_total, wire, received;
+    struct stat st;
     FILE *file;
     // Toma de canal de datos
     int dsd, dsda;
-    struct sockaddr_in addr, addr2;
-    socklen_t addr_len = sizeof(addr);
-    socklen_t addr2_len = sizeof(addr2);
-    int puerto;
-    char *ip;
-    ip = (char*)malloc(13*sizeof(char));
-
-
-    // Obtener la dirección IP local y el número de puerto asociados al descriptor de socke
-    getsockname(sd, (struct sockaddr *) &addr, &addr_len);
-    ip = inet_ntoa(addr.sin_addr);
-
-    // Se genera aleatoriamente un número de puerto entre 1024 y 65535, y se asigna a la variable
-    puerto = rand()%60000+1024;
+    bool ok = true, saved = true;
+
+    // reget: si hay una copia local parcial del mismo archivo, retomar la descarga desde su final
+    if (resume && stat(file_name, &st) == 0 && st.st_size > 0) {
+        r_total = remote_size(sd, file_name);
+        if (r_total >= st.st_size && (file = fopen(file_name, "r")) != NULL) {
+            if (same_prefix(sd, file_name, file, st.st_size)) offset = st.st_size;
+            fclose(file);
+        }
+        if (offset == 0 && r_total >= 0) {
+            if (!quiet) printf("%s no coincide con la copia local, se descarga completo\n", file_name);
+        } else if (offset == r_total) {
+            if (!quiet) printf("%s ya está completo\n", file_name);
+            return SKIPPED;
+        }
+    }
 
-    if(!port(sd, ip, puerto)) {
-       printf("Invalid server answer\n");
-       return;
+    // Preparar el canal de datos (default idem port)
+    if ((dsd = data_open(sd)) < 0) {
+       warnx("Invalid server answer");
+       return -1;
     }
 
-    // Escuchar el canal de datos (default idem port)
-    dsd = socket(AF_INET, SOCK_STREAM, 0);
-    if (dsd < 0) errx(2, "Cannot create socket");
-    addr2.sin_family = AF_INET;
-    addr2.sin_addr.s_addr = INADDR_ANY;
-    addr2.sin_port = htons(puerto);
-        if (bind(dsd, (struct sockaddr *) &addr2, sizeof(addr2)) < 0) errx(4,"Cannot bind");
-        if (listen(dsd,1) < 0) errx(5, "Listen data channel error");
+    if (offset > 0) {
+        if (!rest(sd, offset)) offset = 0;
+        else if (!quiet) printf("Retomando %s desde el byte %ld\n", file_name, offset);
+    }
 
     // Envía el comando RETR al servidor con el nombre del archivo que se desea descargar
     send_msg(sd, "RETR", file_name);
     // Chequea la respuesta
     if(!recv_msg(sd, 299, buffer)) {
-       close(dsd);
-       return;
+       if (dsd != block_sd) close(dsd);
+       return -1;
     }
 
     // Acepta nueva conexión
-    dsda = accept(dsd, (struct sockaddr*)&addr2, &addr2_len);
-    if (dsda < 0) {
-       errx(6, "Accept data channel error");
-    }
+    dsda = data_accept(dsd);
 
     // Analiza el tamaño del archivo de la respuesta recibida
     // "File %s size %ld bytes"
     sscanf(buffer, "File %*s size %ld bytes", &f_size);
+    f_size -= offset;
+
+    // Abre el archivo para escribirlo (al retomar, sin truncarlo y desde offset);
+    // si no se puede, los datos se descartan para no desincronizar la sesión
+    file = fopen(file_name, offset > 0 ? "r+" : "w");
+    if (file == NULL) {
+        warn("Cannot open %s", file_name);
+        file = fopen("/dev/null", "w");
+        saved = false;
+    }
+    fseek(file, offset, SEEK_SET);
+
+    // En MODE Z se recibe hasta el fin del flujo comprimido, y en MODE B hasta el bloque final
+    if (mode == 'Z') {
+        wire = recv_inflate(dsda, file);
+        if (wire < 0) warnx("Invalid compressed data");
+        else if (!quiet) printf("%ld bytes, %ld transferidos\n", f_size, wire);
+        ok = wire >= 0;
+        f_size = 0;
+    } else if (mode == 'B') {
+        ok = recv_blocks(dsda, file);
+        if (!ok) warnx("Block stream truncated");
+        f_size = 0;
+    }
 
-    // Abre el archivo para escribirlo
-    file = fopen(file_name, "w");
-
-    // Recibe el archivo
-    while(true) {
+    // Recibe el archivo hasta completar su tamaño o hasta que el servidor cierre el canal de datos
+    while(f_size > 0) {
        if (f_size < BUFSIZE) r_size = f_size;
        recv_s = read(dsda, buffer, r_size);
-       if(recv_s < 0) warn("receive error");
-       fwrite(buffer, 1, r_size, file);
-       if (f_size < BUFSIZE) break;
-       f_size = f_size - BUFSIZE;
+       if(recv_s < 0) {
+          warn("receive error");
+          break;
+       }
+       if(recv_s == 0) break;
+       fwrite(buffer, 1, recv_s, file);
+       f_size = f_size - recv_s;
     }
+    if (f_size > 0) ok = false;
 
-    // Cierra el canal de datos
-    close(dsda);
+    // Cierra el canal de datos (en MODE B queda abierto para la próxima transferencia)
+    data_close(dsda, ok);
 
     // Cierra el archivo
-    fclose(file);
-
-    // Recibe el okey por parte del servidor
-    if(!recv_msg(sd, 226, NULL)) warn("Abnormally RETR terminated");
-
-    // Cierra el socket 
-    close(dsd);
+    received = ftell(file) - offset;
+    if (fclose(file) != 0) saved = false;
+
+    // Recibe el okey por parte del servidor; si no llega, tampoco sirve la conexión de MODE B
+    if(!recv_msg(sd, 226, NULL)) {
+        warn("Abnormally RETR terminated");
+        if (block_sd >= 0) data_close(block_sd, false);
+        ok = false;
+    }
 
-    return;
+    return ok && saved ? received : -1;
 
 }
 
@@ -259,95 +763,319 @@ void get(int sd, char *file_name) {
 
  Esta función se encarga de enviar un archivo al servidor FTP. 
  Verifica si el archivo existe y obtiene su tamaño. 
- Al igual que en la función get, establece una conexión de datos utilizando 
- el comando PORT y configurar un socket para escuchar conexiones entrantes. 
+ Al igual que en la función get, establece la conexión de datos con data_open. 
  Envía el comando STOR al servidor junto con el nombre del archivo y su tamaño. 
  Acepta una conexión entrante, lee el archivo y envía los datos al servidor a través del canal de datos. 
  Cierra los sockets y archivos utilizados y espera la confirmación del servidor.
+ Con resume (reput), si el servidor ya tiene una copia que coincide con el
+ comienzo del archivo local (una subida interrumpida, ver same_prefix), se
+ envía con REST solo lo que falta; si no coincide, se sube completo.
+ En MODE Z el archivo se envía comprimido con send_deflate, salvo que ya
+ venga comprimido (ver compressed_type); en MODE B, en bloques por la
+ conexión que se conserva (send_blocks).
+ Devuelve los bytes del archivo enviados, SKIPPED si el servidor ya tenía
+ el archivo completo, o -1 si la subida falló.
  */
 
-void put(int sd, char *file_name) {
+long put(int sd, char *file_name, bool resume) {
     char buffer[BUFSIZE];
-    long f_size;
+    long f_size, offset = 0, r_size;
     FILE *file;
     // Toma de canal de datos
     int dsd, dsda;
-    struct sockaddr_in addr, addr2;
-    socklen_t addr_len = sizeof(addr);
-    socklen_t addr2_len = sizeof(addr2);
-    int puerto, bread;
-    char *ip;
-    char *file_data, *file_size;
-    file_data = (char*)malloc(50*sizeof(char));
-    file_size = (char*)malloc(25*sizeof(char));
+    int bread;
+    bool ok = true;
+    char file_data[BUFSIZE];
 
     // Chequea si el archivo existe abriéndolo en modo lectura
     file = fopen(file_name, "r");
     if (file == NULL){
-        printf("El archivo no existe.\n");
-        return;
+        warnx("%s: el archivo no existe", file_name);
+        return -1;
     }
 
     //Tamaño del archivo
     fseek(file, 0L, SEEK_END);
     f_size = ftell(file);
     rewind(file);
-    sprintf(file_size, "//%ld",f_size);
 
+    // reput: si el servidor tiene una copia parcial del mismo archivo, retomar la subida desde su final
+    r_size = resume ? remote_size(sd, file_name) : -1;
+    if (r_size > 0 && r_size <= f_size && same_prefix(sd, file_name, file, r_size)) offset = r_size;
+    if (offset == 0 && r_size > 0) {
+        if (!quiet) printf("%s no coincide con la copia del servidor, se sube completo\n", file_name);
+    } else if (offset == f_size && f_size > 0) {
+        if (!quiet) printf("%s ya está completo en el servidor\n", file_name);
+        fclose(file);
+        return SKIPPED;
+    }
+
+    // Lo que ya viene comprimido no se vuelve a comprimir en MODE Z
+    int level = compressed_type(file_name) ? 0 : zlevel;
 
-    ip = (char*)malloc(13*sizeof(char));
-    getsockname(sd, (struct sockaddr *) &addr, &addr_len);
-    ip = inet_ntoa(addr.sin_addr);
-    puerto = rand()%60000+1024;
 
-    if(!port(sd, ip, puerto)) {
-       printf("Invalid server answer\n");
-       return;
+    // Prepara el canal de datos
+    if ((dsd = data_open(sd)) < 0) {
+       warnx("Invalid server answer");
+       fclose(file);
+       return -1;
     }
 
-    // Escucha el canal de datos
-    dsd = socket(AF_INET, SOCK_STREAM, 0);
-    if (dsd < 0) errx(1, "Cannot create socket");
-    addr2.sin_family = AF_INET;
-    addr2.sin_addr.s_addr = INADDR_ANY;
-    addr2.sin_port = htons(puerto);
-    if (bind(dsd, (struct sockaddr *) &addr2, sizeof(addr2)) < 0) errx(4,"Cannot bind");
-    if (listen(dsd,1) < 0) errx(5, "Listen data channel error");
+    if (offset > 0) {
+        if (rest(sd, offset)) {
+            if (!quiet) printf("Retomando %s desde el byte %ld\n", file_name, offset);
+            fseek(file, offset, SEEK_SET);
+        } else {
+            offset = 0;
+        }
+    }
 
-    file_data=strcat(file_name,file_size);
+    // "nombre//tamaño", sin modificar file_name (mput lo sigue usando)
+    snprintf(file_data, sizeof(file_data), "%s//%ld", file_name, f_size);
     // Envia el comando STOR al servidor 
     send_msg(sd, "STOR", file_data);
     // Verifica la respuesta
     if(!recv_msg(sd, 150, buffer)) {
-       close(dsd);
-       return;
+       if (dsd != block_sd) close(dsd);
+       fclose(file);
+       return -1;
     }
 
     // Acepta nuevas conexiones
-    dsda = accept(dsd, (struct sockaddr*)&addr2, &addr2_len);
-    if (dsda < 0) {
-       errx(6, "Accept data channel error");
+    dsda = data_accept(dsd);
+
+    // En MODE Z el archivo viaja comprimido, y en MODE B en bloques
+    if (mode == 'Z') {
+        long wire = send_deflate(dsda, file, level);
+        if (wire >= 0 && !quiet) printf("%ld bytes, %ld transferidos\n", f_size - offset, wire);
+        ok = wire >= 0;
+    } else if (mode == 'B') {
+        ok = send_blocks(dsda, file);
     }
 
     // Envía el archivo
-    while(!feof(file)) {
+    while(mode == 'S' && ok && !feof(file)) {
         bread = fread(buffer, 1, BUFSIZE, file);
-        if (write(dsda, buffer, bread) < 0) warn("Error sending data");
+        if (write(dsda, buffer, bread) < 0) {
+            warn("Error sending data");
+            ok = false;
+        }
     }
 
-    // Cierra el canal de datos
-    close(dsda);
+    // Cierra el canal de datos (en MODE B queda abierto para la próxima transferencia)
+    data_close(dsda, ok);
 
     // Cierra el archivo 
     fclose(file);
 
     // Recibe OK del servidor 
-    if(!recv_msg(sd, 226, NULL)) warn("Abnormally RETR terminated");
+    if(!recv_msg(sd, 226, NULL)) {
+        warn("Abnormally RETR terminated");
+        if (block_sd >= 0) data_close(block_sd, false);
+        ok = false;
+    }
 
-    // Cierra el socket
-    close(dsd);
+    return ok ? f_size - offset : -1;
+}
+
+
+/*
+Función: set_mode
+
+Cambia el modo de transferencia del servidor a m (S, Z o B). Al dejar
+MODE B se cierra la conexión de datos que se conservaba.
+Devuelve true si el servidor aceptó el modo.
+*/
+
+bool set_mode(int sd, char m) {
+    char param[2] = { m, '\0' };
+
+    send_msg(sd, "MODE", param);
+    if (!recv_msg(sd, 200, NULL)) return false;
+    if (m != 'B' && block_sd >= 0) data_close(block_sd, false);
+    mode = m;
+    return true;
+}
+
+
+/*
+Función: mode_z
+
+Activa o desactiva MODE Z en el servidor. Con level (0 a 9) lo activa con
+ese nivel de compresión, que se aplica en ambos sentidos.
+Devuelve true si el servidor aceptó el cambio.
+*/
+
+bool mode_z(int sd, char *level) {
+    char desc[BUFSIZE];
+
+    if (level != NULL) {
+        sprintf(desc, "MODE Z LEVEL %d", atoi(level));
+        send_msg(sd, "OPTS", desc);
+        if (!recv_msg(sd, 200, NULL)) return false;
+        zlevel = atoi(level);
+        if (mode == 'Z') return true;
+    }
+    if (!set_mode(sd, mode == 'Z' ? 'S' : 'Z')) return false;
+    if (!quiet) printf("Compresión %s\n", mode == 'Z' ? "activada" : "desactivada");
+    return true;
+}
+
+
+/*
+Función: open_session
+
+Abre una nueva conexión de control con el servidor de esta sesión y
+se autentica con el mismo usuario y contraseña, sin preguntar nada.
+Devuelve el descriptor de la conexión, o -1 si no pudo establecerse.
+*/
+
+int open_session(void) {
+    int sd, optval = 1;
+
+    sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0) return -1;
+    if (connect(sd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
+        close(sd);
+        return -1;
+    }
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+    if (!recv_msg(sd, 220, NULL)) goto fail;
+    send_msg(sd, "USER", login_user);
+    if (!recv_msg(sd, 331, NULL)) goto fail;
+    send_msg(sd, "PASS", login_pass);
+    if (!recv_msg(sd, 230, NULL)) goto fail;
+    return sd;
+
+fail:
+    close(sd);
+    return -1;
+}
+
+
+/*
+Función: get_segment
+
+Descarga los bytes [start, end] de file_name por una conexión de control
+y de datos propias, pidiendo el rango con RANG, y los escribe con pwrite
+en su posición del archivo local fd.
+Devuelve true si el segmento llegó completo.
+*/
+
+bool get_segment(char *file_name, int fd, long start, long end) {
+    char desc[BUFSIZE], *buffer;
+    long left = end - start + 1, offset = start;
+    int sd, dsd, dsda;
+    ssize_t recv_s;
+    bool ok = false;
+
+    if ((sd = open_session()) < 0) return false;
+
+    // Preparar el canal de datos de este segmento
+    if ((dsd = data_open(sd)) < 0) goto out;
+
+    // Pedir solo el rango de este segmento
+    sprintf(desc, "%ld %ld", start, end);
+    send_msg(sd, "RANG", desc);
+    if (!recv_msg(sd, 350, NULL)) goto out;
+    send_msg(sd, "RETR", file_name);
+    if (!recv_msg(sd, 299, NULL)) goto out;
+
+    dsda = data_accept(dsd);
+    dsd = -1;
+
+    // Recibe el segmento y lo escribe en su lugar del archivo
+    buffer = malloc(SEGBUFSIZE);
+    while (buffer && left > 0) {
+        recv_s = read(dsda, buffer, left < SEGBUFSIZE ? left : SEGBUFSIZE);
+        if (recv_s <= 0) break;
+        if (pwrite(fd, buffer, recv_s, offset) != recv_s) {
+            warn("Error writing %s", file_name);
+            break;
+        }
+        offset += recv_s;
+        left -= recv_s;
+    }
+    free(buffer);
+    close(dsda);
+
+    ok = recv_msg(sd, 226, NULL) && left == 0;
+
+out:
+    send_msg(sd, "QUIT", NULL);
+    recv_msg(sd, 221, NULL);
+    if (dsd >= 0) close(dsd);
+    close(sd);
+    return ok;
+}
+
+
+/*
+Función: pget
+
+Descarga segmentada en paralelo (get -j jobs archivo): divide el archivo en
+jobs segmentos de igual tamaño y los descarga a la vez, cada uno en un proceso
+hijo con su propia conexión, sobre un archivo local ya reservado con su tamaño final.
+Varias conexiones TCP llenan mejor un enlace de alta latencia que una sola.
+Los archivos chicos se descargan con get.
+Devuelve los bytes descargados, o -1 si algún segmento falló.
+*/
+
+long pget(int sd, char *file_name, int jobs) {
+    long f_size, seg, start, end;
+    struct timespec t0, t1;
+    int fd, i, status, failed = 0;
+    double secs;
+    pid_t pid;
+
+    f_size = remote_size(sd, file_name);
+    if (f_size < 0) return -1;
+    if (jobs < 2 || f_size < (long) jobs * MIN_SEGMENT) return get(sd, file_name, false);
+
+    // Reservar el archivo completo para que cada segmento escriba en su lugar
+    fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        warn("Cannot open %s", file_name);
+        return -1;
+    }
+    posix_fallocate(fd, 0, f_size);
+    if (ftruncate(fd, f_size) < 0) warn("Cannot resize %s", file_name);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    fflush(stdout);
+    seg = (f_size + jobs - 1) / jobs;
+    for (i = 0; i < jobs; i++) {
+        start = i * seg;
+        end = (start + seg < f_size ? start + seg : f_size) - 1;
+        if (start > end) break;
+
+        pid = fork();
+        if (pid == 0) {
+            // Cada segmento usa su propia sesión, en modo stream
+            quiet = true;
+            mode = 'S';
+            block_sd = -1;
+            exit(get_segment(file_name, fd, start, end) ? 0 : 1);
+        }
+        if (pid < 0) {
+            warn("Cannot create process");
+            failed++;
+        }
+    }
 
-    return;
+    // Esperar a todos los segmentos
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    close(fd);
+
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if (failed) warnx("%s: %d segmentos fallaron", file_name, failed);
+    else if (!quiet) printf("%s: %ld bytes en %.3f s (%.1f MB/s, %d conexiones)\n",
+                            file_name, f_size, secs, f_size / secs / 1e6, jobs);
+    return failed ? -1 : f_size;
 }
 
 
@@ -370,37 +1098,513 @@ void quit(int sd) {
 
 
 /*
-Función: operate
+Función: recv_list
+
+Pide un listado con op (NLST o LIST) del directorio dir (NULL: el actual)
+y lo escribe en out. Devuelve false si el servidor no lo envió completo.
+*/
+
+bool recv_list(int sd, char *op, char *dir, FILE *out) {
+    char buffer[BUFSIZE];
+    bool ok = true;
+    long recv_s;
+    int dsd;
+
+    if ((dsd = data_open(sd)) < 0) return false;
+    send_msg(sd, op, dir);
+    if (!recv_msg(sd, 150, NULL)) {
+        if (dsd != block_sd) close(dsd);
+        return false;
+    }
+    dsd = data_accept(dsd);
+    if (mode == 'Z') ok = recv_inflate(dsd, out) >= 0;
+    else if (mode == 'B') ok = recv_blocks(dsd, out);
+    else while ((recv_s = read(dsd, buffer, BUFSIZE)) > 0) fwrite(buffer, 1, recv_s, out);
+    data_close(dsd, ok);
+    if (!recv_msg(sd, 226, NULL)) {
+        if (block_sd >= 0) data_close(block_sd, false);
+        return false;
+    }
+    return ok;
+}
+
+
+/*
+Función: remote_list
+
+Pide con NLST los archivos del directorio de pattern y devuelve los que
+coinciden con el patrón (comodines de fnmatch), en un arreglo de cadenas
+reservadas con malloc; en count deja la cantidad. Devuelve NULL si falla.
+*/
+
+char **remote_list(int sd, char *pattern, int *count) {
+    char line[BUFSIZE], dir[BUFSIZE] = "", *slash, **names = NULL, **tmp;
+    int n = 0, cap = 0;
+    FILE *list;
+
+    // El listado se pide al directorio del patrón
+    slash = strrchr(pattern, '/');
+    if (slash) snprintf(dir, sizeof(dir), "%.*s", (int) (slash - pattern), pattern);
+
+    if ((list = tmpfile()) == NULL) return NULL;
+    recv_list(sd, "NLST", dir[0] ? dir : NULL, list);
+
+    rewind(list);
+    while (fgets(line, BUFSIZE, list)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (fnmatch(pattern, line, FNM_PATHNAME) != 0) continue;
+        if (n == cap) {
+            cap = cap ? 2 * cap : 64;
+            if ((tmp = realloc(names, cap * sizeof(*names))) == NULL) break;
+            names = tmp;
+        }
+        names[n++] = strdup(line);
+    }
+    fclose(list);
+    *count = n;
+    return names;
+}
+
+
+/*
+Función: local_list
+
+Expande pattern con glob(3) y devuelve los archivos regulares que coinciden,
+como remote_list. Devuelve NULL si no hay ninguno.
+*/
+
+char **local_list(char *pattern, int *count) {
+    char **names;
+    struct stat st;
+    glob_t g;
+    size_t i;
+    int n = 0;
+
+    if (glob(pattern, 0, NULL, &g) != 0) return NULL;
+    names = malloc(g.gl_pathc * sizeof(*names));
+    for (i = 0; names && i < g.gl_pathc; i++) {
+        if (stat(g.gl_pathv[i], &st) == 0 && S_ISREG(st.st_mode))
+            names[n++] = strdup(g.gl_pathv[i]);
+    }
+    globfree(&g);
+    *count = n;
+    return names;
+}
+
+
+/*
+Función: mget_run
+
+Descarga los archivos names[first], names[first + step], ... por la sesión
+sd, que debe estar en MODE B. Los RETR se envían por adelantado (hasta
+PIPELINE sin respuesta, en un solo envío), así el servidor encadena cada
+archivo con el siguiente sin esperar al cliente; las respuestas y los datos
+llegan en el mismo orden. Cada archivo se guarda con su nombre sin directorio.
+*/
+
+void mget_run(int sd, char **names, int n, int first, int step, struct batch_result *res) {
+    static char cmds[PIPELINE * (BUFSIZE + 8)];
+    char buffer[BUFSIZE], *base, *size;
+    int sent = first, done = first, dsd, len;
+    FILE *file;
+    bool ok, saved;
+
+    if (first >= n) return;
+    if ((dsd = data_open(sd)) < 0) {
+        res->failed += (n - first + step - 1) / step;
+        return;
+    }
+
+    while (done < n) {
+        // Completar la ventana de comandos en curso
+        for (len = 0; sent < n && (sent - done) / step < PIPELINE; sent += step)
+            len += snprintf(cmds + len, sizeof(cmds) - len, "RETR %s\r\n", names[sent]);
+        if (len > 0 && send(sd, cmds, len, 0) < 0) err(1, "error sending data");
+
+        base = strrchr(names[done], '/');
+        base = base ? base + 1 : names[done];
+        done += step;
+        // Un archivo rechazado (550) no envía datos: se pasa al siguiente
+        if (!recv_msg(sd, 299, buffer)) {
+            res->failed++;
+            continue;
+        }
+        if (block_sd < 0) dsd = data_accept(dsd);
+
+        // Si no se puede crear la copia igual hay que consumir los bloques
+        saved = (file = fopen(base, "w")) != NULL;
+        if (!saved) {
+            warn("Cannot open %s", base);
+            file = fopen("/dev/null", "w");
+        }
+        ok = recv_blocks(dsd, file);
+        fclose(file);
+        data_close(dsd, ok);
+        if (!recv_msg(sd, 226, NULL)) {
+            ok = false;
+            if (block_sd >= 0) data_close(block_sd, false);
+        }
+        if (ok && saved) {
+            size = strstr(buffer, " size ");
+            res->files++;
+            res->bytes += size ? atol(size + 6) : 0;
+        } else {
+            res->failed++;
+        }
+    }
+}
+
+
+/*
+Función: stor_send
+
+Envía STOR para el archivo local name, con su tamaño; en el servidor se
+guarda con el nombre sin directorio.
+*/
+
+void stor_send(int sd, char *name) {
+    char param[BUFSIZE], *base;
+    struct stat st;
+
+    base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    if (stat(name, &st) < 0) st.st_size = 0;
+    snprintf(param, sizeof(param), "%s//%ld", base, (long) st.st_size);
+    send_msg(sd, "STOR", param);
+}
+
+
+/*
+Función: mput_run
+
+Sube los archivos names[first], names[first + step], ... por la sesión sd,
+que debe estar en MODE B. Apenas el servidor acepta un archivo (150) se
+envía el STOR del siguiente, antes que los datos del actual, así la
+respuesta ya está en camino cuando termina la transferencia.
+*/
+
+void mput_run(int sd, char **names, int n, int first, int step, struct batch_result *res) {
+    int i, dsd;
+    FILE *file;
+    bool ok, sent;
+
+    if (first >= n) return;
+    if ((dsd = data_open(sd)) < 0) {
+        res->failed += (n - first + step - 1) / step;
+        return;
+    }
+
+    stor_send(sd, names[first]);
+    for (i = first; i < n; i += step) {
+        ok = recv_msg(sd, 150, NULL);
+        if (i + step < n) stor_send(sd, names[i + step]);
+        if (!ok) {
+            res->failed++;
+            continue;
+        }
+        if (block_sd < 0) dsd = data_accept(dsd);
+
+        // Si el archivo ya no se puede leer se envía vacío, para no desincronizar
+        sent = (file = fopen(names[i], "r")) != NULL;
+        if (!sent) {
+            warn("Cannot open %s", names[i]);
+            file = fopen("/dev/null", "r");
+        }
+        ok = send_blocks(dsd, file);
+        if (sent) res->bytes += ftell(file);
+        fclose(file);
+        data_close(dsd, ok);
+        if (!recv_msg(sd, 226, NULL)) {
+            ok = false;
+            if (block_sd >= 0) data_close(block_sd, false);
+        }
+        if (ok && sent) res->files++;
+        else res->failed++;
+    }
+}
+
+
+/*
+Función: report
+
+En modo batch, muestra el resultado de la operación op (get, put, reget,
+reput, mget o mput) sobre name en una línea "ok|skip|error op nombre bytes
+segundos MB/s", con los bytes transferidos en secs segundos. result es
+"ok", "skip" (reget/reput de un archivo ya completo) o "error".
+*/
+
+void report(char *result, char *op, char *name, long bytes, double secs) {
+    if (!script) return;
+    printf("%s %s %s %ld %.3f %.1f\n", result, op, name, bytes,
+           secs, secs > 0 ? bytes / secs / 1e6 : 0.0);
+}
+
+
+/*
+Función: batch
+
+Transfiere todos los archivos que coinciden con pattern: del servidor si es
+mget, locales si es mput. Con jobs > 1 los reparte entre varias sesiones,
+cada una con sus propios comandos en curso. Al final muestra un resumen.
+Devuelve true si se transfirieron todos.
+*/
+
+bool batch(int sd, char *pattern, int jobs, bool upload) {
+    struct batch_result *res, total = { 0 };
+    void (*run)(int, char **, int, int, int, struct batch_result *);
+    struct timespec t0, t1;
+    char **names, prev = mode;
+    bool was_quiet = quiet;
+    int n = 0, i, bsd;
+    double secs;
+    pid_t pid;
+
+    run = upload ? mput_run : mget_run;
+    names = upload ? local_list(pattern, &n) : remote_list(sd, pattern, &n);
+    if (n == 0) {
+        if (!quiet) printf("%s: no hay archivos\n", pattern);
+        free(names);
+        return true;
+    }
+    if (jobs < 1) jobs = 1;
+    if (jobs > n) jobs = n;
+
+    // Los resultados de cada sesión se comparten con el proceso principal
+    res = mmap(NULL, jobs * sizeof(*res), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (res == MAP_FAILED) {
+        warn("Cannot allocate results");
+        total.failed = n;
+        goto out;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    fflush(stdout);
+    quiet = true;
+    if (jobs == 1) {
+        // Por la sesión actual, en MODE B, y después se vuelve al modo anterior
+        if (mode == 'B' || set_mode(sd, 'B')) {
+            run(sd, names, n, 0, 1, res);
+            if (prev != 'B') set_mode(sd, prev);
+        } else {
+            res->failed = n;
+        }
+    } else {
+        for (i = 0; i < jobs; i++) {
+            pid = fork();
+            if (pid == 0) {
+                mode = 'S';
+                block_sd = -1;
+                bsd = open_session();
+                if (bsd < 0 || !set_mode(bsd, 'B')) {
+                    res[i].failed = (n - i + jobs - 1) / jobs;
+                    exit(1);
+                }
+                run(bsd, names, n, i, jobs, &res[i]);
+                quit(bsd);
+                exit(0);
+            }
+            if (pid < 0) {
+                warn("Cannot create process");
+                res[i].failed = (n - i + jobs - 1) / jobs;
+            }
+        }
+        while (wait(NULL) > 0);
+    }
+    quiet = was_quiet;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for (i = 0; i < jobs; i++) {
+        total.files += res[i].files;
+        total.bytes += res[i].bytes;
+        total.failed += res[i].failed;
+    }
+    munmap(res, jobs * sizeof(*res));
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if (script) {
+        report(total.failed == 0 ? "ok" : "error", upload ? "mput" : "mget", pattern, total.bytes, secs);
+    } else {
+        printf("%ld archivos, %ld bytes en %.3f s (%.1f MB/s, %d conexiones)",
+               total.files, total.bytes, secs, total.bytes / secs / 1e6, jobs);
+        if (total.failed) printf(", %ld fallaron", total.failed);
+        printf("\n");
+    }
+
+out:
+    totals.files += total.files;
+    totals.bytes += total.bytes;
+    totals.failed += total.failed;
+    for (i = 0; i < n; i++) free(names[i]);
+    free(names);
+    return total.failed == 0;
+}
+
+
+/*
+Función: transfer
+
+Ejecuta get (pget con jobs > 1), put, reget o reput (op) de file_name, suma
+el resultado al resumen del script y, en modo batch, lo muestra con report.
+*/
+
+enum cmd_result transfer(int sd, char *op, char *file_name, int jobs) {
+    struct timespec t0, t1;
+    bool resume = strncmp(op, "re", 2) == 0;
+    long bytes;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (op[resume ? 2 : 0] == 'p') bytes = put(sd, file_name, resume);
+    else if (jobs > 1) bytes = pget(sd, file_name, jobs);
+    else bytes = get(sd, file_name, resume);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (bytes == SKIPPED) {
+        totals.skipped++;
+    } else if (bytes < 0) {
+        totals.failed++;
+    } else {
+        totals.files++;
+        totals.bytes += bytes;
+    }
+    report(bytes == SKIPPED ? "skip" : bytes < 0 ? "error" : "ok", op, file_name, bytes < 0 ? 0 : bytes,
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    return bytes == -1 ? CMD_FAILED : CMD_OK;
+}
+
+
+/*
+Función: command
 sd: descriptor de socket de la conexión de control
 
-Esta función establece un bucle continuo en el que el usuario puede ingresar comandos. 
+Ejecuta un comando de la sesión interactiva o del script (input).
 Dependiendo del comando ingresado, se ejecuta la operación correspondiente 
-(por ejemplo, “get” para descargar un archivo) o se finaliza la conexión con el servidor (comando "quit").
+(por ejemplo, “get” para descargar un archivo, “reget” para retomar una descarga, “mget” para varios a la vez,
+“ls” para listar un directorio, “passive” para alternar el modo del canal de datos, “compress” para comprimirlo o “block” para
+reutilizarlo entre archivos) o se finaliza la conexión con el servidor (comando "quit").
+Devuelve CMD_QUIT tras "quit", CMD_FAILED si la operación falló y CMD_OK si no.
+*/
+
+enum cmd_result command(int sd, char *input) {
+    char *op, *param;
+
+    op = strtok(input, " ");
+    if (op == NULL) {
+        // línea vacía
+        return CMD_OK;
+    } else if (strcmp(op, "get") == 0) {
+        param = strtok(NULL, " ");
+        // get -j N archivo: descarga segmentada por N conexiones
+        if (param && strcmp(param, "-j") == 0) {
+            char *jobs = strtok(NULL, " ");
+            param = strtok(NULL, " ");
+            if (jobs && param) return transfer(sd, op, param, atoi(jobs));
+        } else if (param) {
+            return transfer(sd, op, param, 1);
+        }
+    } else if (strcmp(op, "put") == 0 || strcmp(op, "reget") == 0 || strcmp(op, "reput") == 0) {
+        // reget/reput archivo: retoma una transferencia interrumpida (ver get y put)
+        param = strtok(NULL, " ");
+        if (param) return transfer(sd, op, param, 1);
+    } else if (strcmp(op, "mget") == 0 || strcmp(op, "mput") == 0) {
+        // mget/mput [-j N] patrón: todos los archivos que coinciden
+        bool upload = op[1] == 'p';
+        int jobs = 1;
+        param = strtok(NULL, " ");
+        if (param && strcmp(param, "-j") == 0) {
+            char *n = strtok(NULL, " ");
+            jobs = n ? atoi(n) : 1;
+            param = strtok(NULL, " ");
+        }
+        if (param) return batch(sd, param, jobs, upload) ? CMD_OK : CMD_FAILED;
+    } else if (strcmp(op, "ls") == 0) {
+        // ls [directorio]: listado al estilo de "ls -l" (LIST)
+        bool ok = recv_list(sd, "LIST", strtok(NULL, " "), stdout);
+        fflush(stdout);
+        return ok ? CMD_OK : CMD_FAILED;
+    } else if (strcmp(op, "compress") == 0) {
+        // compress [nivel]: alterna MODE Z, o fija su nivel
+        return mode_z(sd, strtok(NULL, " ")) ? CMD_OK : CMD_FAILED;
+    } else if (strcmp(op, "block") == 0) {
+        // Alterna MODE B: una sola conexión de datos para todos los archivos
+        if (!set_mode(sd, mode == 'B' ? 'S' : 'B')) return CMD_FAILED;
+        if (!quiet) printf("Modo bloque %s\n", mode == 'B' ? "activado" : "desactivado");
+        return CMD_OK;
+    } else if (strcmp(op, "passive") == 0) {
+        // Alterna entre canal de datos activo (PORT) y pasivo (PASV)
+        passive = !passive;
+        if (!quiet) printf("Modo pasivo %s\n", passive ? "activado" : "desactivado");
+        return CMD_OK;
+    } else if (strcmp(op, "quit") == 0) {
+        quit(sd);
+        return CMD_QUIT;
+    } else if (script) {
+        warnx("unexpected command: %s", op);
+        return CMD_FAILED;
+    } else {
+        // Nuevas operaciones en el futuro
+        printf("TODO: unexpected command\n");
+        return CMD_FAILED;
+    }
+    // Falta el archivo o el patrón
+    if (script) warnx("%s: missing argument", op);
+    return CMD_FAILED;
+}
+
+
+/*
+Función: operate
+sd: descriptor de socket de la conexión de control
+
+Esta función establece un bucle continuo en el que el usuario puede ingresar comandos
+(ver command) hasta "quit". Al terminar la entrada (fin de archivo) también
+se finaliza la conexión con el servidor.
 */
 
 void operate(int sd) {
-    char *input, *op, *param;
+    char line[BUFSIZE];
 
     while (true) {
         printf("Operation: ");
-        input = read_input();
-        if (input == NULL)
-            continue; // evitar input vacío
-        op = strtok(input, " ");
-            if (strcmp(op, "get") == 0) {
-            param = strtok(NULL, " ");
-            get(sd, param);
-        } else if (strcmp(op, "quit") == 0) {
+        if (read_input(line, stdin) == NULL) {
+            printf("\n");
             quit(sd);
             break;
-            }
-            else {
-            // Nuevas operaciones en el futuro
-            printf("TODO: unexpected command\n");
-            }
-        free(input);
+        }
+        if (command(sd, line) == CMD_QUIT) break;
     }
-    free(input);
+}
+
+
+/*
+Función: run_script
+
+Modo batch (-b): ejecuta uno por uno los comandos de in, los mismos de la
+sesión interactiva (se ignoran las líneas vacías y las que empiezan con
+'#'), sin preguntas y sin mostrar las respuestas del servidor. Cada
+transferencia muestra una línea de resultado (ver report) y al final, tras
+"quit" o el fin del script, se muestra el total de archivos, bytes y caudal.
+Devuelve el código de salida: 0 si todo terminó bien, EXIT_FAILED si no.
+*/
+
+int run_script(int sd, FILE *in) {
+    enum cmd_result r = CMD_OK;
+    struct timespec t0, t1;
+    char line[BUFSIZE];
+    int failed = 0;
+    double secs;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (r != CMD_QUIT && read_input(line, in) != NULL) {
+        if (line[0] == '#') continue;
+        r = command(sd, line);
+        if (r == CMD_FAILED) failed++;
+    }
+    if (r != CMD_QUIT) quit(sd);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("total %ld archivos, %ld bytes en %.3f s (%.1f MB/s), %ld ya completos, %ld fallaron, %d comandos con error\n",
+           totals.files, totals.bytes, secs, totals.bytes / secs / 1e6, totals.skipped, totals.failed, failed);
+    return failed ? EXIT_FAILED : 0;
 }
 
 
@@ -414,12 +1618,13 @@ La función devuelve un valor booleano que indica si la dirección IP es válida
  */
 
 bool direccion_IP(char *string){
-    char *token;
+    char copy[INET_ADDRSTRLEN], *token;
     bool verificacion = true;
     int contador=0,i;
-    token = (char *) malloc(strlen(string)*sizeof(char));
-    strcpy(token, string);
-    token = strtok(token,".");
+    // Una dirección válida siempre cabe en copy
+    if (strlen(string) >= sizeof(copy)) return false;
+    strcpy(copy, string);
+    token = strtok(copy,".");
 
     while(token!=NULL){
         contador++;
@@ -432,7 +1637,6 @@ bool direccion_IP(char *string){
         token=strtok(NULL,".");
     }
     if(contador!=4) verificacion = false;
-    free(token);
 
     return verificacion;
 }
@@ -460,20 +1664,45 @@ bool direccion_puerto(char *string){
 
 /**
  * Run with
- *         ./myftp <SERVER_IP> <SERVER_PORT>
+ *         ./myftp [-u user] [-p password] [-n netrc] [-b script] <SERVER_IP> <SERVER_PORT>
  **/
 int main (int argc, char *argv[]) {
-    int sd;
+    char user[BUFSIZE] = "", pass[BUFSIZE] = "", path[BUFSIZE], *netrc = NULL, *script_path = NULL;
+    int sd, opt, status = 0;
     struct sockaddr_in addr;
-
+    FILE *in = stdin;
+
+    // Opciones: credenciales y script del modo batch
+    while ((opt = getopt(argc, argv, "u:p:n:b:")) != -1) {
+        if (opt == 'u') snprintf(user, sizeof(user), "%s", optarg);
+        else if (opt == 'p') snprintf(pass, sizeof(pass), "%s", optarg);
+        else if (opt == 'n') netrc = optarg;
+        else if (opt == 'b') script_path = optarg;
+        else errx(EXIT_USAGE, "usage: %s [-u user] [-p password] [-n netrc] [-b script|-] <SERVER_IP> <SERVER_PORT>", argv[0]);
+    }
     // Chequeo de argumentos
-        if(argc!=3){
-        errx(1, "Error in arguments number");
+        if(argc - optind != 2){
+        errx(EXIT_USAGE, "Error in arguments number");
     }
-    if(!direccion_IP(argv[1]))
-        errx(1, "Invalidad IP");
-    if(!direccion_puerto(argv[2]))
-        errx(1, "Invalidad Port");
+    if(!direccion_IP(argv[optind]))
+        errx(EXIT_USAGE, "Invalidad IP");
+    if(!direccion_puerto(argv[optind + 1]))
+        errx(EXIT_USAGE, "Invalidad Port");
+
+    // En modo batch nada se pregunta: el script y las credenciales deben estar disponibles
+    if (script_path) {
+        script = quiet = true;
+        if (strcmp(script_path, "-") != 0 && (in = fopen(script_path, "r")) == NULL)
+            err(EXIT_USAGE, "Cannot open %s", script_path);
+        if (netrc == NULL && getenv("HOME")) {
+            snprintf(path, sizeof(path), "%s/.netrc", getenv("HOME"));
+            netrc = path;
+        }
+    }
+    // La contraseña que falta se busca en netrc (-n, o ~/.netrc en modo batch)
+    if (pass[0] == '\0' && netrc) netrc_find(netrc, argv[optind], user, pass);
+    if (script && (user[0] == '\0' || pass[0] == '\0'))
+        errx(EXIT_USAGE, "No credentials for %s", argv[optind]);
 
 
     // Crea el socket y verifica si hay errores
@@ -483,25 +1712,32 @@ int main (int argc, char *argv[]) {
     
     // Setea los datos del socket  
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(atoi(argv[2]));
-    addr.sin_addr.s_addr = inet_addr(argv[1]);  
+    addr.sin_port = htons(atoi(argv[optind + 1]));
+    addr.sin_addr.s_addr = inet_addr(argv[optind]);  
 
     // Conecta y verifica si hay errores
     if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         err(1, "connect failed");
     }
+    server_addr = addr;
+
+    // Los comandos son cortos: enviarlos sin esperar al ACK del anterior (Nagle)
+    int optval = 1;
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
 
 
-    // Si recibe "hello" procede con "autenticate" y "operate" si no hay errores
+    // Si recibe "hello" procede con "autenticate" y "operate" (o el script) si no hay errores
     if (!recv_msg(sd, 220, NULL))
         errx(1, "unexpected response from server");
     else {
-        authenticate(sd);
-        operate(sd);
+        authenticate(sd, user[0] ? user : NULL, pass[0] ? pass : NULL);
+        if (script) status = run_script(sd, in);
+        else operate(sd);
     }
 
     // Cierra el socket 
     close(sd);
+    if (in != stdin) fclose(in);
 
-    return 0;
+    return status;
 }
\ No newline at end of file
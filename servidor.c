@@ -1,21 +1,94 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sched.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/xattr.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 #include <ctype.h>
+#include <time.h>
 #include <arpa/inet.h>
 
-#define _POSIX_C_SOURCE 200809L
-
 #define BUFSIZE 512 // tamaño máximo para recibir los datos del cliente
-#define CMDSIZE 4
+#define CMDSIZE 5
 #define PARSIZE 100
+#define INSIZE 2048 // comandos recibidos pendientes por sesión (potencia de 2)
+#define STAT_LINE 160 // longitud máxima de una línea de la respuesta de STAT, con "211-" y "\r\n"
+#define STAT_LINES (12 + CMD_COUNT) // líneas de STAT: encabezado, totales, una por comando y cierre
+#define OUTSIZE (BUFSIZE + STAT_LINES * STAT_LINE) // respuestas pendientes de envío por sesión (STAT entero)
+#define MAX_EVENTS 256 // eventos atendidos por cada llamada a epoll_wait
+#define XFER_BURST 64 // bloques que transfiere una sesión antes de ceder el turno
+#define XFER_CHUNK (1 << 20) // bytes como máximo por cada llamada a sendfile/splice
+#define XFER_BUFSIZE (64 * 1024) // buffer de la copia tradicional (read + write)
+#define READAHEAD_WINDOW (8 << 20) // bytes de RETR que se piden al disco por adelantado
+#define PASV_POOL 16 // sockets pasivos preparados de antemano (modo epoll)
+#define URING_ENTRIES 1024 // entradas de la cola de envío de io_uring
+#define URING_BUFS 256 // buffers registrados en io_uring para las transferencias
+#define URING_BUFSIZE (128 * 1024) // tamaño de cada buffer registrado
+#define MAX_WORKERS 128 // procesos con contadores de métricas propios
+#define HIST_BUCKETS 28 // latencias de hasta 2^27 us (~2 min), en potencias de 2
+#define STATSIZE (64 * 1024) // texto de las métricas del socket de estadísticas
+#define FCACHE_SIZE 64 // archivos abiertos en la caché de RETR
+#define FCACHE_BUCKETS 128 // baldes de la tabla de la caché (potencia de 2)
+#define DCACHE_SIZE 8 // directorios con índice en memoria para LIST, NLST y MLSD
+#define DIRENT_BUFSIZE (2 * 1024) // buffer de cada llamada a getdents64 (un paso de LIST)
+#define LIST_BATCH 64 // líneas de LIST, NLST o MLSD que se arman en cada paso
+#define ZCHECK (256 * 1024) // bytes comprimidos antes de evaluar la ganancia de MODE Z
+#define BLOCK_HDR 3 // cabecera de MODE B: descriptor y cantidad de bytes (16 bits)
+#define BLOCK_EOF 64 // descriptor de MODE B: último bloque del archivo
+#define BLOCK_MARK 16 // descriptor de MODE B: marcador de reinicio (no son datos)
+#define ARENA_BLOCK (64 * 1024) // tamaño mínimo de cada bloque de la arena de una sesión
+#define DIGEST_HEX 65 // resumen en hexadecimal, con el '\0' (SHA-256)
+#define RATE_TICK 10 // ms entre reintentos de las transferencias frenadas por el límite de ancho de banda
+#define RATE_QUANTUM 1024 // bytes como mínimo por paso de una transferencia con límite
+#define RATE_SLEEP 100000 // us como máximo de cada espera por el límite en modo fork
+#define USER_BUCKETS 256 // usuarios con límite de ancho de banda propio (potencia de 2)
+#define IDLE_TIMEOUT 300 // s sin actividad antes de cerrar una sesión (-T)
+#define LOGIN_TIMEOUT 30 // s desde la conexión para completar USER y PASS (-T)
+#define TIMEOUT_TICK 1 // s entre revisiones de las sesiones inactivas
+#define PEER_SLOTS 4096 // direcciones de cliente con sesiones contadas por proceso (potencia de 2)
+
+#define LISTEN_ENV "SRVFTP_LISTEN_FDS"  // sockets de escucha heredados al actualizar el binario
+#define USERS_DIR "."          // directorio del archivo de usuarios
+#define USERS_FILE "ftpusers"  // líneas "usuario:contraseña[:límite]"
+#define USERS_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+// Cambios que afectan al índice de un directorio (IN_MODIFY se omite: llega en
+// cada escritura, y el tamaño final se ve con IN_CLOSE_WRITE)
+#define DIR_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | \
+                    IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
 
 #define MSG_220 "220 srvFtp version 1.0\r\n"
 #define MSG_331 "331 Password required for %s\r\n"
@@ -26,408 +99,5513 @@
 #define MSG_299 "299 File %s size %ld bytes\r\n"
 #define MSG_226 "226 Transfer complete\r\n"
 #define MSG_150 "150 Opening BINARY mode data connection for %s (%ld bytes)\r\n"
+#define MSG_150_LIST "150 Opening BINARY mode data connection for file list\r\n"
 #define MSG_200 "200 PORT command successful\r\n"
+#define MSG_200_MODE "200 Mode set to %c\r\n"
+#define MSG_200_LEVEL "200 MODE Z LEVEL set to %d\r\n"
+#define MSG_211 "211%c%s\r\n"
+#define MSG_213 "213 %ld\r\n"
+#define MSG_213_HASH "213 %s %ld-%ld %s %s\r\n"
+#define MSG_200_HASH "200 %s%s\r\n"
+#define MSG_250_XCRC "250 %s\r\n"
+#define MSG_227 "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)\r\n"
+#define MSG_350 "350 Restarting at %ld\r\n"
+#define MSG_350_RANG "350 Restarting at %ld. Ending at %ld\r\n"
+#define MSG_425 "425 Can't open data connection\r\n"
+#define MSG_426 "426 Connection closed; transfer aborted\r\n"
+#define MSG_502 "502 Command not implemented\r\n"
+#define MSG_501 "501 Syntax error in parameters or arguments\r\n"
+#define MSG_503 "503 Bad sequence of commands\r\n"
+#define MSG_504 "504 Command not implemented for that parameter\r\n"
+#define MSG_554 "554 Invalid REST parameter\r\n"
+#define MSG_421_BUSY "421 Too many connections, try again later\r\n"
+#define MSG_421_TIMEOUT "421 Timeout: closing control connection\r\n"
+
+
+/*
+ Modos de servicio: un proceso por conexión (fork, el modo original),
+ un único proceso que atiende todas las sesiones con epoll, o varios
+ procesos epoll creados de antemano (prefork), cada uno con su propio
+ socket de escucha SO_REUSEPORT entre los que el kernel reparte las conexiones.
+ El modo uring es como epoll pero realiza la E/S con io_uring.
+ */
+enum srv_mode { MODE_FORK, MODE_EPOLL, MODE_PREFORK, MODE_URING };
+
+/*
+ Estados de una sesión de control. Tras el saludo la sesión espera USER,
+ luego PASS, y una vez autenticada alterna entre el bucle de comandos y
+ las transferencias de archivos hasta que se cierra.
+ */
+enum sess_state { ST_USER, ST_PASS, ST_CMD, ST_XFER, ST_CLOSE };
+
+// XFER_DIGEST: resumen de HASH o XCRC, que se calcula por tramos sin canal de datos
+enum xfer_kind { XFER_NONE, XFER_RETR, XFER_STOR, XFER_DIGEST };
+
+/*
+ Buffer circular de entrada del canal de control. head y tail avanzan sin
+ volver a cero y se reducen módulo INSIZE al indexar; scan recuerda hasta
+ dónde ya se buscó el fin de línea para no recorrer dos veces una línea partida.
+ */
+struct ring {
+    char data[INSIZE];
+    unsigned int head;   // primer byte sin consumir
+    unsigned int tail;   // siguiente posición libre
+    unsigned int scan;   // primer byte aún no examinado
+};
+
+/*
+ Comandos con métricas propias; el resto se cuenta como CMD_OTHER.
+ */
+enum cmd_id {
+    CMD_USER, CMD_PASS, CMD_RETR, CMD_STOR, CMD_PORT, CMD_PASV, CMD_REST,
+    CMD_RANG, CMD_SIZE, CMD_STAT, CMD_SITE, CMD_QUIT, CMD_OTHER, CMD_COUNT
+};
+
+char *cmd_names[CMD_COUNT] = {
+    "USER", "PASS", "RETR", "STOR", "PORT", "PASV", "REST",
+    "RANG", "SIZE", "STAT", "SITE", "QUIT", "other"
+};
+
+/*
+ Algoritmos de HASH: CRC-32 (el de XCRC), CRC32C y SHA-256. Cada uno guarda
+ su último resultado en un atributo extendido del archivo (ver digest_load).
+ */
+enum hash_alg { HASH_CRC32, HASH_CRC32C, HASH_SHA256, HASH_COUNT };
+
+char *hash_names[HASH_COUNT] = { "CRC32", "CRC32C", "SHA-256" };
+char *hash_xattrs[HASH_COUNT] = { "user.ftp.crc32", "user.ftp.crc32c", "user.ftp.sha256" };
+
+// Resumen en curso de un archivo o de una transferencia
+struct digest {
+    enum hash_alg alg;
+    uint32_t crc;
+    EVP_MD_CTX *md;      // SHA-256: el contexto de la sesión
+    struct stat st;      // archivo de RETR al empezar: si cambia, el resumen no se guarda
+};
+
+/*
+ Arena de una sesión: bloques de memoria que se reparten avanzando un
+ puntero y se liberan todos juntos antes de cada comando (arena_reset).
+ Los comandos toman de ella sus buffers de trabajo, y las transferencias
+ los suyos y los de zlib, sin malloc ni free.
+ */
+struct arena_block {
+    struct arena_block *next;
+    size_t size;         // bytes de data
+    size_t used;
+    char data[] __attribute__((aligned(16)));
+};
+
+struct arena {
+    struct arena_block *head, *tail;
+    struct arena_block *cur;   // bloque del que se está reservando
+};
+
+// Resultado de avanzar una transferencia un paso
+enum xfer_status { XFER_MORE, XFER_WAIT, XFER_DONE, XFER_FAIL };
+
+/*
+ Forma de copiar los datos de RETR: sendfile desde la caché de páginas para
+ archivos regulares, splice a través de un pipe para el resto, y la copia
+ tradicional con un buffer cuando ninguna de las dos es posible.
+ En modo uring, las transferencias de archivos regulares usan un buffer
+ registrado y las operaciones las realiza el kernel (ver uring_xfer_next).
+ COPY_ZLIB comprime (RETR) o descomprime (STOR) los datos en MODE Z y
+ COPY_BLOCK los divide en bloques con cabecera (MODE B); como transforman
+ los datos, siempre pasan por el espacio de usuario.
+ */
+enum xfer_method { COPY_SENDFILE, COPY_SPLICE, COPY_BUFFER, COPY_URING, COPY_ZLIB, COPY_BLOCK };
+
+struct xfer {
+    enum xfer_kind kind;
+    enum xfer_method method;
+    int fd;              // archivo local
+    bool seekable;       // archivo regular: se lee con pread desde offset
+    int dsd;             // socket por el que viajan los datos
+    off_t offset;        // posición del archivo en la que sigue la transferencia
+    long remaining;      // bytes que faltan transferir (-1: hasta fin de archivo)
+    bool connecting;     // connect no bloqueante en curso
+    bool accepting;      // esperando al cliente en el socket pasivo
+    uint32_t events;     // eventos registrados en epoll para dsd
+    int pipe[2];         // pipe intermedio de splice
+    size_t piped;        // bytes cargados en el pipe aún no enviados
+    bool src_wait;       // el archivo (pipe o dispositivo) todavía no tiene datos
+    uint32_t fd_events;  // eventos registrados en epoll para fd
+    char *buffer;        // buffer de la copia tradicional (XFER_BUFSIZE)
+    int pos, len;        // porción del buffer pendiente de escribir
+    char *ubuf;          // buffer registrado de io_uring (COPY_URING)
+    int ubusy;           // operaciones de io_uring en curso para la transferencia
+    enum xfer_status ustatus;  // estado de la transferencia por io_uring
+    struct file_entry *cached;  // entrada de la caché a la que pertenece fd
+    z_stream *zs;        // flujo de deflate (RETR) o inflate (STOR) de COPY_ZLIB
+    int zlevel;          // nivel de compresión de RETR (0: sin comprimir)
+    char *zbuf;          // datos comprimidos (RETR) o descomprimidos (STOR)
+    bool zeof;           // se leyó todo el archivo de origen
+    bool zdone;          // fin del flujo comprimido
+    unsigned char hdr[BLOCK_HDR];  // cabecera del bloque de MODE B que se está recibiendo
+    int hdr_pos;         // bytes de hdr ya recibidos
+    long block_left;     // bytes del bloque actual que faltan recibir
+    bool bdone;          // se transfirió el bloque final: la conexión puede reutilizarse
+    off_t prealloc;      // fin del espacio que STOR reservó con fallocate (0: nada)
+    struct digest *digest;  // resumen calculado durante la transferencia (OPTS HASH ... INLINE)
+    struct listing *list;   // LIST, NLST o MLSD: el listado que se escribe en fd (un pipe) mientras se envía
+    char *name;          // archivo de XFER_DIGEST, para la respuesta
+    off_t first;         // primer byte del rango de XFER_DIGEST
+    bool xcrc;           // XFER_DIGEST responde a XCRC (250) en lugar de HASH (213)
+    bool yielded;        // cedió el turno sin un descriptor que esperar: la retoma work_resume
+    long quantum;        // bytes como máximo por paso con límite de ancho de banda (0: sin límite)
+    bool throttled;      // sin crédito de ancho de banda: la retoma rate_wake
+    off_t ra_end;        // fin de la lectura anticipada ya pedida al kernel (RETR)
+    struct arena *arena; // arena de la sesión, de la que salen los buffers
+    long bytes;          // bytes transferidos (métricas)
+    uint64_t start;      // instante en que se recibió el comando (us)
+    enum cmd_id cmd;     // RETR o STOR, para las métricas
+};
+
+/*
+ Socket de datos pasivo: creado, asociado a un puerto y escuchando desde antes
+ de que un cliente lo pida. Una sesión lo reserva con PASV y lo devuelve al
+ pool en cuanto acepta la conexión de datos.
+ */
+struct pasv_slot {
+    int lsd;
+    int port;                // puerto en orden de host
+    struct session *owner;   // sesión que lo reservó (NULL: libre)
+    uint32_t events;         // eventos registrados en epoll para lsd
+};
+
+struct session {
+    int sd;
+    bool blocking;       // modo fork: sockets bloqueantes
+    enum sess_state state;
+    char user[PARSIZE];
+    struct sockaddr_in peer;       // dirección del cliente en el canal de control
+    struct sockaddr_in data_addr;
+    bool data_ready;     // se recibió un comando PORT o PASV
+    struct pasv_slot *pasv;        // socket pasivo reservado con PASV (NULL: modo activo)
+    off_t rest;          // desplazamiento pedido con REST para la próxima transferencia
+    off_t rest_end;      // último byte pedido con RANG (-1: hasta el final)
+    char mode;           // modo de transferencia: 'S' (stream), 'Z' (deflate) o 'B' (bloques)
+    int bdsd;            // conexión de datos que MODE B conserva entre transferencias (-1: ninguna)
+    int zlevel;          // nivel de compresión de MODE Z (OPTS MODE Z LEVEL)
+    enum hash_alg hash_alg;  // algoritmo de HASH (OPTS HASH)
+    bool hash_inline;    // calcular el resumen durante RETR y STOR (OPTS HASH ... INLINE)
+    EVP_MD_CTX *md;      // contexto de SHA-256, reutilizado por cada resumen de la sesión
+    struct bucket *ubucket;  // límite de ancho de banda del usuario (NULL: ninguno)
+    struct xfer xfer;
+    struct arena arena;  // memoria de trabajo del comando en curso y su transferencia
+    struct ring in;      // comandos recibidos aún sin procesar
+    uint64_t created;    // instante de la conexión (us), para el límite de inicio de sesión
+    uint64_t active;     // último avance visto en la sesión (us)
+    uint64_t progress;   // bytes recibidos y transferidos hasta active
+    bool timed_out;      // se despidió con 421 por inactividad
+    char out[OUTSIZE];   // respuestas aún no enviadas
+    int out_len;
+    uint32_t events;     // eventos registrados en epoll para sd
+    bool uring;          // modo uring: el canal de control se atiende con io_uring
+    bool uring_recv;     // recepción de comandos en curso
+    int uring_send;      // bytes de out cuyo envío está en curso
+    int uring_ops;       // operaciones de io_uring en curso (la sesión no puede liberarse)
+    struct session *prev, *next;
+};
+
+/*
+ Índice en memoria del archivo de usuarios: una tabla hash por nombre de usuario.
+ Todas las cadenas apuntan dentro de blob, la copia del archivo leída de una vez.
+ */
+struct user_entry {
+    char *name;
+    char *pass;
+    int64_t rate, burst;      // límite propio en bytes/s (-1: el de -U)
+    struct user_entry *next;  // siguiente entrada del mismo balde
+};
+
+struct user_table {
+    unsigned int mask;          // cantidad de baldes - 1 (potencia de 2)
+    struct user_entry **buckets;
+    struct user_entry *entries;
+    char *blob;
+};
+
+/*
+ Latencias de un comando: cantidad, suma, máximo e histograma logarítmico.
+ hist[i] cuenta las latencias de menos de 2^i us (y al menos 2^(i-1) us).
+ */
+struct cmd_metrics {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t hist[HIST_BUCKETS];
+};
+
+/*
+ Contadores de un proceso. Viven en memoria compartida para que cualquier
+ proceso pueda sumar los de todos; cada proceso del modo prefork escribe solo
+ en los suyos, y los hijos del modo fork comparten unos mismos. Se actualizan
+ con operaciones atómicas, sin bloqueos.
+ */
+struct metrics {
+    int64_t sessions_active;
+    uint64_t sessions_total;
+    uint64_t logins_ok;
+    uint64_t logins_failed;
+    uint64_t xfers_ok;
+    uint64_t xfers_failed;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t fcache_hits;
+    uint64_t fcache_misses;
+    uint64_t digest_hits;     // HASH/XCRC respondidos con el resumen guardado
+    uint64_t digest_misses;
+    uint64_t dcache_hits;     // listados servidos con el índice del directorio en memoria
+    uint64_t dcache_misses;
+    uint64_t rate_waits;      // pasos de transferencias frenados por el límite de ancho de banda
+    uint64_t heap_allocs;     // reservas de memoria dinámica (mem_alloc y similares)
+    uint64_t arena_allocs;    // reservas servidas por la arena de una sesión
+    uint64_t sessions_rejected;  // conexiones rechazadas con 421 por los límites de -C
+    uint64_t sessions_timeout;   // sesiones cerradas con 421 por inactividad (-T)
+    struct cmd_metrics cmds[CMD_COUNT];
+} __attribute__((aligned(64)));
+
+/*
+ Balde de créditos (token bucket) de un límite de ancho de banda: se llena a
+ razón de rate bytes por segundo hasta burst, y cada transferencia descuenta
+ lo que envía o recibe. Vive en memoria compartida para que el límite valga
+ entre procesos; se actualiza con operaciones atómicas, sin bloqueos.
+ */
+struct bucket {
+    int64_t tokens;      // crédito disponible en bytes (negativo: deuda)
+    uint64_t last;       // último instante en que se llenó (us)
+    int64_t rate;        // bytes por segundo (0: sin límite)
+    int64_t burst;       // crédito máximo acumulable
+};
+
+/*
+ Sesiones abiertas por una dirección de cliente. La entrada queda con su
+ dirección aunque la cuenta llegue a 0 (así una búsqueda no se corta a
+ mitad de camino) y se reutiliza para otra dirección.
+ */
+struct peer_count {
+    in_addr_t addr;      // dirección en orden de red (0: entrada nunca usada)
+    int count;
+};
+
+/*
+ Sesiones abiertas por un proceso, en total y por dirección de cliente (tabla
+ de direccionamiento abierto). Se suman las de todos los procesos para
+ admitir una conexión nueva.
+ */
+struct conn_counts {
+    int total;
+    struct peer_count peers[PEER_SLOTS];
+} __attribute__((aligned(64)));
+
+// Límite de un usuario; state: 0 libre, 1 ocupándose, 2 listo
+struct user_bucket {
+    int state;
+    char name[PARSIZE];
+    struct bucket b;
+};
+
+// Límite global (-L) y de cada usuario (-U o ftpusers), por dirección abierta
+struct rate_table {
+    struct bucket global;
+    struct user_bucket users[USER_BUCKETS];
+};
+
+/*
+ Archivo de la caché de RETR: descriptor abierto y metadatos de path. Las
+ transferencias en curso comparten fd (siempre leen indicando la posición).
+ Una entrada que sale de la caché mientras alguna la usa se cierra con la
+ última referencia.
+ */
+struct file_entry {
+    char *path;
+    int fd;
+    int wd;                          // vigilancia de inotify del archivo
+    int refs;                        // transferencias que usan fd
+    bool cached;                     // sigue en la caché
+    struct stat st;
+    struct file_entry *hnext;        // siguiente en el balde
+    struct file_entry *prev, *next;  // lista LRU, de la más a la menos usada
+};
+
+/*
+ Entrada del índice de un directorio: nombre y datos de stat. Un cambio
+ avisado por inotify solo la marca (dirty) y se vuelve a consultar al
+ listar; las que desaparecen quedan como lápidas (gone) hasta compactar.
+ */
+struct dir_item {
+    char *name;
+    int hnext;           // siguiente entrada del mismo balde (-1: ninguna)
+    bool dirty;          // está en pending
+    bool gone;           // el archivo ya no existe
+    mode_t mode;
+    nlink_t nlink;
+    off_t size;
+    struct timespec mtime;
+};
+
+/*
+ Índice de un directorio para LIST, NLST y MLSD: se arma una vez con
+ getdents64, por bloques mientras se envía el primer listado, y se mantiene
+ al día con los avisos de inotify, así listar un directorio enorme no
+ vuelve a leerlo ni a consultar cada archivo.
+ */
+struct dir_index {
+    char *path;
+    int wd;              // vigilancia de inotify (-1: fuera de la caché, se libera con el último dir_put)
+    int dfd;             // directorio que todavía se está leyendo (-1: índice completo)
+    int refs;            // listados en curso que lo usan
+    struct dir_item *items;
+    int count, cap;      // entradas usadas (lápidas incluidas) y reservadas
+    int gone;            // lápidas
+    int *buckets;        // tabla hash de nombres, con cap baldes
+    int *pending;        // entradas a consultar otra vez antes de listar
+    int npending, pcap;
+    struct dir_index *next;  // caché, del usado más recientemente al menos
+};
+
+// Formatos de listado: NLST, LIST y MLSD
+enum list_format { LIST_NAMES, LIST_LONG, LIST_MLSD };
+
+/*
+ Listado en curso de LIST, NLST o MLSD: sus líneas se arman por tramos
+ (ver list_step) y llegan a la transferencia por un pipe.
+ */
+struct listing {
+    struct dir_index *dir;
+    int fd;              // extremo de escritura del pipe (-1: listado completo)
+    int next;            // próxima entrada del índice a listar
+    enum list_format fmt;
+    time_t now;
+    char prefix[PATH_MAX];   // directorio pedido, delante de cada nombre de NLST
+    char *dirents;           // buffer de getdents64 mientras se lee el directorio
+    char buf[XFER_BUFSIZE];  // líneas todavía no escritas en el pipe
+    int pos, len;
+};
+
+struct user_table *users;  // tabla vigente
+int inotify_fd = -1;       // avisos de cambios en el sistema de archivos
+int users_wd = -1;         // vigilancia del directorio de USERS_FILE
+struct stat users_st;      // archivo cargado (para detectar cambios sin inotify)
+
+// Estado del motor epoll
+int epfd = -1;
+struct session **fdmap;  // sesión a la que pertenece cada descriptor
+int fdmap_size;
+struct session *sessions;  // sesiones activas
+
+// Caché de archivos de RETR
+struct file_entry *fcache[FCACHE_BUCKETS];
+struct file_entry *fcache_head, *fcache_tail;
+int fcache_count;
+
+// Caché de índices de directorio
+struct dir_index *dcache;
+int dcache_count;
+
+// Pool de sockets pasivos
+struct pasv_slot *pasv_pool;
+int pasv_count;             // sockets ya creados
+int pasv_max = PASV_POOL;   // capacidad del pool
+
+// Métricas
+struct metrics *metrics;   // MAX_WORKERS contadores en memoria compartida
+struct metrics *stats;     // contadores de este proceso
+int stats_sd = -1;         // socket Unix de estadísticas
+
+// Límites de ancho de banda
+struct rate_table *rates;  // en memoria compartida
+int64_t user_rate, user_burst;  // límite por defecto de cada usuario (-U)
+int rate_fd = -1;          // temporizador que retoma las transferencias frenadas
+int throttled;             // transferencias de este proceso esperando crédito
+
+// Sesiones con trabajo pendiente que no espera a ningún descriptor (XFER_DIGEST)
+int work_fd = -1;          // eventfd listo mientras haya sesiones que retomar
+int yielded;               // sesiones de este proceso que cedieron el turno
+
+// Admisión de conexiones y sesiones inactivas
+struct conn_counts *conn_table;  // MAX_WORKERS contadores en memoria compartida
+struct conn_counts *conns; // contadores de este proceso
+int conn_rows = 1;         // procesos que aceptan conexiones
+int max_sessions, max_per_ip;  // 0: sin límite (-C)
+int idle_timeout = IDLE_TIMEOUT, login_timeout = LOGIN_TIMEOUT;  // s, 0: sin límite (-T)
+int timeout_fd = -1;       // temporizador que revisa las sesiones inactivas
+struct session *alarm_session;  // sesión del proceso hijo del modo fork (SIGALRM)
+
+// MODE Z
+int zlevel_default = Z_DEFAULT_COMPRESSION;  // nivel inicial de cada sesión (-z)
+
+// Modo prefork
+volatile sig_atomic_t stopping;  // el proceso padre recibió SIGTERM o SIGINT
+bool worker;                     // proceso del modo prefork (el binario nuevo lo lanza el padre)
+
+// Actualización sin cortes: SIGUSR2 pasa los sockets de escucha a un binario nuevo
+volatile sig_atomic_t upgrading;  // se recibió SIGUSR2
+bool draining;             // ya no se aceptan conexiones: se termina con la última sesión
+sigset_t wait_mask;        // máscara de señales de las esperas, con SIGUSR2 habilitada
+char **exec_argv;          // argumentos con los que se lanza el binario nuevo
+int inherited[MAX_WORKERS];  // sockets de escucha recibidos del binario anterior (-1: ya usado)
+int ninherited;
+
+/*
+ Instancia de io_uring del modo uring, creada con las llamadas al sistema
+ directamente: colas de envío (SQ) y de completions (CQ) compartidas con el
+ kernel por mmap, y buffers registrados para las transferencias.
+ */
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local;         // cola de envío local, aún sin publicar
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    char *bufs;                // URING_BUFS buffers contiguos de URING_BUFSIZE
+    char **free_bufs;          // pila de buffers libres
+    int nfree;
+    struct sockaddr_in peer;   // dirección del cliente del ACCEPT en curso
+    socklen_t peer_len;
+};
+
+struct uring iou = { .fd = -1 };
+
+/*
+ Operación a la que corresponde cada completion: se guarda en los 3 bits
+ bajos de user_data, junto con el puntero a la sesión.
+ */
+enum uring_op { U_ACCEPT, U_EPOLL, U_RECV, U_SEND, U_READ, U_DSEND, U_DRECV, U_FWRITE };
+
+
+/*
+ Función: set_nonblocking
+
+ Activa O_NONBLOCK en el descriptor fd.
+ */
+
+void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        warn("Error setting O_NONBLOCK");
+}
+
+
+/*
+ Función: watch
+
+ Registra, modifica o elimina (ev == 0) el interés de epoll sobre fd.
+ current guarda los eventos registrados para evitar llamadas innecesarias.
+ */
+
+void watch(int fd, uint32_t ev, uint32_t *current) {
+    struct epoll_event event = { .events = ev, .data.fd = fd };
+    int op;
+
+    if (epfd < 0 || ev == *current) return;
+    if (*current == 0) op = EPOLL_CTL_ADD;
+    else if (ev == 0) op = EPOLL_CTL_DEL;
+    else op = EPOLL_CTL_MOD;
+
+    if (epoll_ctl(epfd, op, fd, &event) < 0) warn("epoll_ctl");
+    *current = ev;
+}
+
+
+/*
+ Función: metric_add
+
+ Suma n al contador counter sin bloqueos.
+ */
+
+void metric_add(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+
+/*
+ Función: mem_alloc
+
+ malloc que cuenta la reserva en las métricas (heap_allocs), para
+ verificar que el servidor en régimen no reserva memoria por comando.
+ */
+
+void *mem_alloc(size_t n) {
+    metric_add(&stats->heap_allocs, 1);
+    return malloc(n);
+}
+
+
+/*
+ Función: mem_calloc
+
+ calloc que cuenta la reserva (ver mem_alloc).
+ */
+
+void *mem_calloc(size_t n, size_t size) {
+    metric_add(&stats->heap_allocs, 1);
+    return calloc(n, size);
+}
+
+
+/*
+ Función: mem_realloc
+
+ realloc que cuenta la reserva (ver mem_alloc).
+ */
+
+void *mem_realloc(void *p, size_t n) {
+    metric_add(&stats->heap_allocs, 1);
+    return realloc(p, n);
+}
+
+
+/*
+ Función: mem_strdup
+
+ strdup que cuenta la reserva (ver mem_alloc).
+ */
+
+char *mem_strdup(const char *s) {
+    metric_add(&stats->heap_allocs, 1);
+    return strdup(s);
+}
+
+
+/*
+ Función: arena_alloc
+
+ Reserva n bytes (alineados a 16) de la arena a: avanza un puntero dentro
+ del bloque actual, o pasa a uno de los siguientes que tenga lugar. Solo
+ si ninguno alcanza se reserva un bloque nuevo, que queda en la arena,
+ así una sesión en régimen no vuelve a llamar a malloc.
+ Devuelve NULL si no hay memoria.
+ */
+
+void *arena_alloc(struct arena *a, size_t n) {
+    struct arena_block *b;
+    void *p;
+
+    n = (n + 15) & ~(size_t) 15;
+    for (b = a->cur; b && b->size - b->used < n; b = b->next);
+    if (b == NULL) {
+        if ((b = mem_alloc(sizeof(*b) + (n > ARENA_BLOCK ? n : ARENA_BLOCK))) == NULL) return NULL;
+        b->size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+        b->used = 0;
+        b->next = NULL;
+        if (a->tail) a->tail->next = b;
+        else a->head = b;
+        a->tail = b;
+    }
+    a->cur = b;
+    p = b->data + b->used;
+    b->used += n;
+    metric_add(&stats->arena_allocs, 1);
+    return p;
+}
+
+
+/*
+ Función: arena_reset
+
+ Libera de una vez todo lo reservado en la arena a, conservando sus bloques.
+ */
+
+void arena_reset(struct arena *a) {
+    struct arena_block *b;
+
+    for (b = a->head; b; b = b->next) b->used = 0;
+    a->cur = a->head;
+}
+
+
+/*
+ Función: arena_free
+
+ Devuelve al sistema los bloques de la arena a (al cerrar la sesión).
+ */
+
+void arena_free(struct arena *a) {
+    struct arena_block *b;
+
+    while ((b = a->head) != NULL) {
+        a->head = b->next;
+        free(b);
+    }
+    a->cur = a->tail = NULL;
+}
+
+
+/*
+ Función: arena_zalloc
+
+ Reserva de zlib para los flujos de MODE Z: sale de la arena de la sesión
+ (opaque) y se libera con ella, por lo que arena_zfree no hace nada.
+ */
+
+voidpf arena_zalloc(voidpf opaque, uInt items, uInt size) {
+    return arena_alloc(opaque, (size_t) items * size);
+}
+
+void arena_zfree(voidpf opaque, voidpf address) {
+    (void) opaque;
+    (void) address;
+}
+
+
+/*
+ Función: ring_read
+
+ Lee del descriptor fd todo lo que quepa en el espacio libre del buffer circular r,
+ que puede estar partido en dos tramos (hasta el final de data y desde el principio).
+ Devuelve lo mismo que read: bytes leídos, 0 en fin de archivo o -1 ante un error.
+ */
+
+ssize_t ring_read(struct ring *r, int fd) {
+    struct iovec iov[2];
+    unsigned int space = INSIZE - (r->tail - r->head);
+    unsigned int tail = r->tail & (INSIZE - 1);
+    int count = 1;
+    ssize_t n;
+
+    iov[0].iov_base = r->data + tail;
+    iov[0].iov_len = INSIZE - tail < space ? INSIZE - tail : space;
+    if (iov[0].iov_len < space) {
+        iov[1].iov_base = r->data;
+        iov[1].iov_len = space - iov[0].iov_len;
+        count = 2;
+    }
+
+    n = readv(fd, iov, count);
+    if (n > 0) r->tail += n;
+    return n;
+}
+
+
+/*
+ Función: ring_getline
+
+ Extrae del buffer circular r la próxima línea completa (hasta "\n", que no se copia)
+ y la deja en line, terminada en '\0'. max es el tamaño de line.
+ Devuelve 1 si extrajo una línea, 0 si todavía no llegó una línea completa
+ y -1 si la línea no entra en max (en ese caso se descarta).
+ */
+
+int ring_getline(struct ring *r, char *line, unsigned int max) {
+    unsigned int i, len, head = r->head & (INSIZE - 1), first;
+
+    for (i = r->scan; i != r->tail; i++) {
+        if (r->data[i & (INSIZE - 1)] == '\n') break;
+    }
+
+    if (i == r->tail) {
+        r->scan = i;
+        if (i - r->head < max) return 0;
+        r->head = r->scan = r->tail;
+        return -1;
+    }
+
+    len = i - r->head;
+    r->head = r->scan = i + 1;
+    if (len >= max) return -1;
+
+    // Copiar la línea, que puede dar la vuelta al final del buffer
+    first = INSIZE - head < len ? INSIZE - head : len;
+    memcpy(line, r->data + head, first);
+    memcpy(line + first, r->data, len - first);
+    line[len] = '\0';
+    return 1;
+}
 
 
 /*
  Función: recv_cmd
 
- Se encarga de recibir y analizar los comandos enviados por el cliente. 
- Toma el descriptor de socket sd en el que se recibirá el comando, 
- una cadena de caracteres  operation para almacenar el comando y 
- una cadena de caracteres param para almacenar los parámetros del comando (si los hay). 
- La función devuelve true si se recibió y procesó correctamente el comando, y false en caso contrario.
+ Se encarga de extraer y analizar el siguiente comando recibido del cliente.
+ Toma la sesión s cuyo buffer circular contiene los datos leídos del socket,
+ una cadena de caracteres operation para almacenar el comando y
+ una cadena de caracteres param para almacenar los parámetros del comando (si los hay).
+ Una misma lectura puede traer varios comandos (el cliente no espera cada respuesta)
+ o solo parte de uno: cada llamada consume exactamente una línea.
+ Devuelve 1 si se extrajo un comando válido, 0 si todavía no hay una línea completa
+ y -1 si la línea recibida no es un comando FTP válido.
  */
 
-bool recv_cmd(int sd, char *operation, char *param) {
+int recv_cmd(struct session *s, char *operation, char *param) {
     char buffer[BUFSIZE], *token;
-    int recv_s;
+    int r;
 
-    // Recibir el comando en el buffer y manejar errores
-    if ((recv_s = read(sd, buffer, BUFSIZE)) < 0) {
-        warnx("Error reading buffer"); 
-        return false;
-    }
-    // Si el buffer está vacío, se imprime mensaje de advertencia
-    if (recv_s == 0) {
-        warnx("Empty buffer");
-        return false;
+    // Tomar la próxima línea completa; una línea que no entra en el buffer es inválida
+    r = ring_getline(&s->in, buffer, BUFSIZE);
+    if (r == 0) return 0;
+    if (r < 0) {
+        warnx("command line too long");
+        return -1;
     }
 
     // Eliminar los caracteres de terminación del buffer
     buffer[strcspn(buffer, "\r\n")] = 0;
 
     // Analizar el buffer para extraer el comando y los parámetros
-    // Se verifica si se recibió correctamente el comando. 
-    // Si el comando no es válido, se imprime un mensaje de advertencia y se devuelve false.
+    operation[0] = param[0] = '\0';
     token = strtok(buffer, " ");
-    if (token == NULL || strlen(token) < 4) {
-        warn("not valid ftp command");
-        return false;
-    } else {
-        if (operation[0] == '\0') strcpy(operation, token);
-        if (strcmp(operation, token)) {
-            warn("abnormal client flow: did not send %s command", operation);
+    if (token == NULL || strlen(token) < 4 || strlen(token) >= CMDSIZE) {
+        warnx("not valid ftp command");
+        return -1;
+    }
+    strcpy(operation, token);
+    // El parámetro es el resto de la línea (puede contener espacios)
+    token = strtok(NULL, "");
+    if (token != NULL) snprintf(param, PARSIZE, "%s", token + strspn(token, " "));
+    return 1;
+}
+
+
+/*
+ Función: flush_ans
+
+ Envía al cliente las respuestas acumuladas en la sesión. En modo bloqueante
+ escribe todo; en modo epoll escribe lo que admita el socket y deja el resto
+ para el próximo EPOLLOUT. Devuelve false si ocurrió un error en el socket.
+ */
+
+bool flush_ans(struct session *s) {
+    int sent;
+
+    // En modo uring las respuestas se envían con io_uring (ver uring_session)
+    if (s->uring) return true;
+
+    while (s->out_len > 0) {
+        sent = write(s->sd, s->out, s->out_len);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            warn("Error sending message");
+            s->out_len = 0;
+            s->state = ST_CLOSE;
             return false;
         }
-        token = strtok(NULL, " ");
-        if (token != NULL) strcpy(param, token);
+        s->out_len -= sent;
+        memmove(s->out, s->out + sent, s->out_len);
     }
     return true;
 }
 
 
 /**
- Función: send_ans 
+ Función: send_ans
 
- Esta función se utiliza para enviar una respuesta al cliente a través del descriptor de socket especificado. 
- Toma el descriptor de socket sd en el que se enviará la respuesta, 
- una cadena de caracteres message que representa la respuesta formateada y 
- variables adicionales para formatear la cadena de caracteres. 
- La función devuelve true si se envió correctamente la respuesta, y false en caso contrario.
+ Esta función se utiliza para enviar una respuesta al cliente de la sesión s.
+ Toma la sesión en la que se enviará la respuesta,
+ una cadena de caracteres message que representa la respuesta formateada y
+ variables adicionales para formatear la cadena de caracteres.
+ La respuesta se encola en la sesión y se intenta enviar de inmediato.
+ La función devuelve true si se envió (o encoló) correctamente la respuesta, y false en caso contrario.
  */
 
-bool send_ans(int sd, char *message, ...) {
+bool send_ans(struct session *s, char *message, ...) {
     char buffer[BUFSIZE];
+    int len;
 
     va_list args;
     va_start(args, message);
 
-    vsprintf(buffer, message, args);
+    len = vsnprintf(buffer, BUFSIZE, message, args);
     va_end(args);
+    if (len >= BUFSIZE) len = BUFSIZE - 1;
+
+    // Hacer lugar en la cola de salida si fuera necesario
+    if (s->out_len + len > OUTSIZE && !flush_ans(s)) return false;
+    if (s->out_len + len > OUTSIZE) {
+        warnx("reply queue overflow");
+        return false;
+    }
+
+    // Encolar la respuesta preformateada y enviarla
+    memcpy(s->out + s->out_len, buffer, len);
+    s->out_len += len;
+    return flush_ans(s);
+}
+
+
+/*
+ Función: pasv_open
+
+ Crea el socket pasivo p: lo asocia a un puerto libre elegido por el sistema
+ y lo deja escuchando. Es no bloqueante en todos los modos, para poder
+ descartar conexiones viejas sin esperar (ver pasv_drain).
+ */
+
+bool pasv_open(struct pasv_slot *p) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
 
-    // Enviar la respuesta preformateada y verificar errores
-    if (write(sd, buffer, strlen(buffer)) < 0) {
-        warn("Error sending message");
+    p->owner = NULL;
+    p->events = 0;
+    p->lsd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (p->lsd < 0) {
+        warn("Cannot create passive socket");
         return false;
     }
 
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = 0;
+    if (bind(p->lsd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(p->lsd, 8) < 0 ||
+        getsockname(p->lsd, (struct sockaddr *) &addr, &addr_len) < 0) {
+        warn("Cannot open passive socket");
+        close(p->lsd);
+        p->lsd = -1;
+        return false;
+    }
+    p->port = ntohs(addr.sin_port);
     return true;
 }
 
 
 /*
- Función: retr
- 
- Esta función maneja el comando RETR (retrieve) para enviar un archivo al cliente. 
- Abre el archivo, Toma el descriptor de socket sd en el que se enviará el archivo y la ruta del 
- archivo a enviar (file_path)., envía su contenido al cliente y cierra el archivo.
-Se declaran: 
-    - un puntero a FILE para representar el archivo que se enviará al cliente.
-    - bread para almacenar la cantidad de bytes leídos del archivo, 
-    - fsize para almacenar el tamaño del archivo y 
-    - buffer para almacenar temporalmente los datos del archivo antes de enviarlos al cliente.
- */
-
-void retr(int sd, char *file_path) {
-    FILE *file;
-    int bread;
-    long fsize;
-    char buffer[BUFSIZE];
+ Función: pasv_init
 
-    // Verificar si el archivo existe abriéndolo en modo lectura; si no, informar error al cliente
-    file = fopen(file_path, "r");
-    if (file == NULL) {
-        warn("Error opening file");
-        send_ans(sd, MSG_550, file_path);
-        return;
+ Reserva el pool de sockets pasivos. Con prebind se crean todos de antemano
+ (modo epoll); si no, se crean a medida que las sesiones los piden, como en
+ el hijo del modo fork, que solo atiende a un cliente.
+ */
+
+bool pasv_init(bool prebind) {
+    if ((pasv_pool = mem_calloc(pasv_max, sizeof(*pasv_pool))) == NULL) {
+        warn("Error allocating passive sockets");
+        return false;
     }
+    while (prebind && pasv_count < pasv_max && pasv_open(&pasv_pool[pasv_count])) pasv_count++;
+    return true;
+}
 
-    // Enviar un mensaje de éxito con el tamaño del archivo
-    fseek(file, 0L, SEEK_END);
-    fsize = ftell(file);
-    fseek(file, 0L, SEEK_SET);
-    send_ans(sd, MSG_299, file_path, fsize);
-
-    // Importante retraso para evitar problemas con el tamaño del búfer
-    sleep(1);
-
-    // Se lee el archivo en bloques de tamaño BUFSIZE utilizando la función fread 
-    // y se envía cada bloque leído al cliente utilizando la función write si no ocurren problemas
-    while ((bread = fread(buffer, 1, BUFSIZE, file)) > 0) {
-        if (write(sd, buffer, bread) < 0) {
-            warn("Error sending file");
-            fclose(file);
-            return;
+
+/*
+ Función: pasv_drain
+
+ Descarta las conexiones que quedaron pendientes en el socket pasivo p
+ de un PASV anterior que no llegó a usarse.
+ */
+
+void pasv_drain(struct pasv_slot *p) {
+    int sd;
+
+    while ((sd = accept4(p->lsd, NULL, NULL, SOCK_CLOEXEC)) >= 0 || errno == ECONNABORTED || errno == EINTR) {
+        if (sd >= 0) close(sd);
+    }
+}
+
+
+/*
+ Función: pasv_lease
+
+ Reserva para la sesión s un socket pasivo libre del pool (o el que ya tenía
+ reservado) y lo deja sin conexiones pendientes.
+ Devuelve NULL si el pool está agotado.
+ */
+
+struct pasv_slot *pasv_lease(struct session *s) {
+    struct pasv_slot *p = s->pasv;
+    int i;
+
+    if (p == NULL) {
+        if (pasv_pool == NULL && !pasv_init(false)) return NULL;
+        for (i = 0; i < pasv_count && pasv_pool[i].owner; i++);
+        if (i == pasv_count) {
+            if (pasv_count == pasv_max || !pasv_open(&pasv_pool[i])) return NULL;
+            pasv_count++;
         }
+        p = &pasv_pool[i];
+        p->owner = s;
+        s->pasv = p;
     }
+    pasv_drain(p);
+    return p;
+}
+
+
+/*
+ Función: pasv_release
+
+ Devuelve al pool el socket pasivo reservado por la sesión s, si lo hay.
+ */
+
+void pasv_release(struct session *s) {
+    struct pasv_slot *p = s->pasv;
+
+    if (p == NULL) return;
+    watch(p->lsd, 0, &p->events);
+    if (fdmap) fdmap[p->lsd] = NULL;
+    p->owner = NULL;
+    s->pasv = NULL;
+}
+
+
+/*
+ Función: uring_enter
+
+ Publica las entradas preparadas en la cola de envío y las entrega al kernel.
+ Con wait espera además a que haya al menos una completion.
+ */
+
+void uring_enter(bool wait) {
+    unsigned pending;
+    int r;
+
+    __atomic_store_n(iou.sq_tail, iou.sq_local, __ATOMIC_RELEASE);
+    pending = iou.sq_local - __atomic_load_n(iou.sq_head, __ATOMIC_ACQUIRE);
+    if (pending == 0 && !wait) return;
+
+    // Al esperar se habilita SIGUSR2 (ver upgrade_init)
+    r = syscall(__NR_io_uring_enter, iou.fd, pending, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+                wait ? &wait_mask : NULL, _NSIG / 8);
+    // EBUSY/EAGAIN: la cola de completions está llena, se vacía antes de reintentar
+    if (r < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) err(1, "io_uring_enter");
+}
+
+
+/*
+ Función: uring_sqe
+
+ Devuelve una entrada libre (y en cero) de la cola de envío para la operación op
+ de la sesión s. Si la cola está llena, entrega antes las pendientes al kernel.
+ */
+
+struct io_uring_sqe *uring_sqe(struct session *s, enum uring_op op) {
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    while (iou.sq_local - __atomic_load_n(iou.sq_head, __ATOMIC_ACQUIRE) == iou.sq_entries) uring_enter(false);
+
+    idx = iou.sq_local & *iou.sq_mask;
+    sqe = &iou.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uintptr_t) s | op;
+    iou.sq_array[idx] = idx;
+    iou.sq_local++;
+    if (s) s->uring_ops++;
+    return sqe;
+}
+
+
+/*
+ Función: uring_init
+
+ Crea la instancia de io_uring (sin liburing: io_uring_setup y mmap de las
+ colas) y registra los buffers de las transferencias, para que el kernel
+ no tenga que fijar sus páginas en cada lectura o escritura.
+ Devuelve false si el sistema no admite io_uring.
+ */
+
+bool uring_init(void) {
+    struct io_uring_params p;
+    struct iovec *iov;
+    size_t sq_size, cq_size;
+    char *sq, *cq;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = 4 * URING_ENTRIES;
+    iou.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (iou.fd < 0) {
+        warn("io_uring_setup");
+        return false;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size) sq_size = cq_size;
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, iou.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) err(1, "mmap io_uring");
+    cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, iou.fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) err(1, "mmap io_uring");
+    }
+    iou.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, iou.fd, IORING_OFF_SQES);
+    if (iou.sqes == MAP_FAILED) err(1, "mmap io_uring");
+
+    iou.sq_head = (unsigned *) (sq + p.sq_off.head);
+    iou.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    iou.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    iou.sq_array = (unsigned *) (sq + p.sq_off.array);
+    iou.sq_entries = p.sq_entries;
+    iou.sq_local = *iou.sq_tail;
+    iou.cq_head = (unsigned *) (cq + p.cq_off.head);
+    iou.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    iou.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    iou.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    // Buffers registrados; sin ellos las transferencias usan el camino de epoll
+    iou.bufs = mmap(NULL, (size_t) URING_BUFS * URING_BUFSIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    iou.free_bufs = mem_calloc(URING_BUFS, sizeof(*iou.free_bufs));
+    iov = mem_calloc(URING_BUFS, sizeof(*iov));
+    if (iou.bufs == MAP_FAILED || iou.free_bufs == NULL || iov == NULL) err(1, "Error allocating io_uring buffers");
+    for (i = 0; i < URING_BUFS; i++) {
+        iov[i].iov_base = iou.bufs + (size_t) i * URING_BUFSIZE;
+        iov[i].iov_len = URING_BUFSIZE;
+    }
+    if (syscall(__NR_io_uring_register, iou.fd, IORING_REGISTER_BUFFERS, iov, URING_BUFS) < 0) {
+        warn("Cannot register io_uring buffers");
+    } else {
+        for (i = URING_BUFS - 1; i >= 0; i--) iou.free_bufs[iou.nfree++] = iov[i].iov_base;
+    }
+    free(iov);
+    return true;
+}
+
+
+/*
+ Función: user_hash
+
+ Función de hash FNV-1a para los nombres de usuario y las rutas de la caché.
+ */
+
+unsigned int user_hash(const char *name) {
+    unsigned int h = 2166136261u;
+
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+/*
+ Función: file_free
+
+ Cierra el archivo de la entrada e y la libera.
+ */
+
+void file_free(struct file_entry *e) {
+    close(e->fd);
+    free(e->path);
+    free(e);
+}
+
+
+/*
+ Función: file_detach
+
+ Saca la entrada e de la caché y deja de vigilar el archivo si ninguna otra
+ entrada lo hace (varias rutas al mismo archivo comparten la vigilancia).
+ */
+
+void file_detach(struct file_entry *e) {
+    struct file_entry **pp, *o;
+
+    for (pp = &fcache[user_hash(e->path) & (FCACHE_BUCKETS - 1)]; *pp != e; pp = &(*pp)->hnext);
+    *pp = e->hnext;
+    if (e->prev) e->prev->next = e->next;
+    else fcache_head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else fcache_tail = e->prev;
+    fcache_count--;
+    e->cached = false;
+
+    for (o = fcache_head; o && o->wd != e->wd; o = o->next);
+    if (o == NULL) inotify_rm_watch(inotify_fd, e->wd);
+    if (e->refs == 0) file_free(e);
+}
+
+
+/*
+ Función: file_release
+
+ Suelta una referencia a la entrada e, que se cierra si ya no está en la caché.
+ */
+
+void file_release(struct file_entry *e) {
+    if (--e->refs == 0 && !e->cached) file_free(e);
+}
+
+
+/*
+ Función: file_notify
+
+ Invalida las entradas del archivo vigilado con wd, que cambió, se movió o se
+ borró. Con wd < 0 (se perdieron avisos) se vacía toda la caché.
+ */
+
+void file_notify(int wd) {
+    struct file_entry *e, *next;
+
+    for (e = fcache_head; e; e = next) {
+        next = e->next;
+        if (wd < 0 || e->wd == wd) file_detach(e);
+    }
+}
+
+
+/*
+ Función: dir_find
+
+ Busca name en el índice d. Devuelve la posición de la entrada, o -1.
+ */
+
+int dir_find(struct dir_index *d, const char *name) {
+    int i;
+
+    if (d->cap == 0) return -1;
+    for (i = d->buckets[user_hash(name) & (d->cap - 1)]; i >= 0 && strcmp(d->items[i].name, name); i = d->items[i].hnext);
+    return i;
+}
+
+
+/*
+ Función: dir_rehash
+
+ Rearma la tabla hash del índice d con cap baldes (potencia de 2, no menos
+ que las entradas reservadas).
+ */
+
+bool dir_rehash(struct dir_index *d, int cap) {
+    int *buckets = d->buckets, i;
+    unsigned int h;
+
+    // Con la misma cantidad de baldes se reutiliza la tabla
+    if (cap != d->cap && (buckets = mem_alloc(cap * sizeof(*buckets))) == NULL) return false;
+    for (i = 0; i < cap; i++) buckets[i] = -1;
+    for (i = 0; i < d->count; i++) {
+        h = user_hash(d->items[i].name) & (cap - 1);
+        d->items[i].hnext = buckets[h];
+        buckets[h] = i;
+    }
+    if (buckets != d->buckets) {
+        free(d->buckets);
+        d->buckets = buckets;
+    }
+    return true;
+}
+
+
+/*
+ Función: dir_add
+
+ Agrega al índice d una entrada para name, todavía sin datos de stat.
+ Devuelve su posición, o -1 si no hay memoria.
+ */
+
+int dir_add(struct dir_index *d, const char *name) {
+    struct dir_item *items;
+    unsigned int h;
+    int cap;
+
+    if (d->count == d->cap) {
+        cap = d->cap ? 2 * d->cap : 1024;
+        if ((items = mem_realloc(d->items, cap * sizeof(*items))) == NULL) return -1;
+        d->items = items;
+        if (!dir_rehash(d, cap)) return -1;
+        d->cap = cap;
+    }
+    memset(&d->items[d->count], 0, sizeof(d->items[d->count]));
+    if ((d->items[d->count].name = mem_strdup(name)) == NULL) return -1;
+    h = user_hash(name) & (d->cap - 1);
+    d->items[d->count].hnext = d->buckets[h];
+    d->buckets[h] = d->count;
+    return d->count++;
+}
+
+
+/*
+ Función: dir_stat
+
+ Consulta los datos de la entrada i del índice d (dfd es el directorio).
+ Si el archivo ya no existe la entrada queda como lápida.
+ */
+
+void dir_stat(struct dir_index *d, int dfd, int i) {
+    struct dir_item *it = &d->items[i];
+    struct stat st;
+    bool gone;
+
+    gone = fstatat(dfd, it->name, &st, AT_SYMLINK_NOFOLLOW) < 0;
+    if (gone != it->gone) d->gone += gone ? 1 : -1;
+    it->gone = gone;
+    it->dirty = false;
+    if (gone) return;
+    it->mode = st.st_mode;
+    it->nlink = st.st_nlink;
+    it->size = st.st_size;
+    it->mtime = st.st_mtim;
+}
+
+
+/*
+ Función: dir_unwatch
+
+ Deja de vigilar el directorio del índice d, que ya salió de la caché,
+ salvo que otro índice de la caché use la misma vigilancia. Si es la del
+ archivo de usuarios (el mismo directorio) se le devuelven sus eventos.
+ */
+
+void dir_unwatch(struct dir_index *d) {
+    struct dir_index *o;
+
+    if (d->wd < 0) return;
+    for (o = dcache; o && (o == d || o->wd != d->wd); o = o->next);
+    if (o == NULL) {
+        if (d->wd == users_wd) inotify_add_watch(inotify_fd, USERS_DIR, USERS_EVENTS);
+        else inotify_rm_watch(inotify_fd, d->wd);
+    }
+    d->wd = -1;
+}
+
+
+/*
+ Función: dir_free
+
+ Libera el índice d, que no está en la caché ni lo usa ningún listado.
+ */
+
+void dir_free(struct dir_index *d) {
+    int i;
+
+    if (d->dfd >= 0) close(d->dfd);
+    for (i = 0; i < d->count; i++) free(d->items[i].name);
+    free(d->items);
+    free(d->buckets);
+    free(d->pending);
+    free(d->path);
+    free(d);
+}
+
+
+/*
+ Función: dir_drop
+
+ Saca de la caché el índice *pp. Si un listado todavía lo usa, lo libera
+ el último dir_put.
+ */
+
+void dir_drop(struct dir_index **pp) {
+    struct dir_index *d = *pp;
+
+    *pp = d->next;
+    dcache_count--;
+    dir_unwatch(d);
+    if (d->refs == 0) dir_free(d);
+}
+
+
+/*
+ Función: dir_notify
+
+ Registra el aviso de inotify (wd, mask, name) en los índices de directorio:
+ marca la entrada name para volver a consultarla al listar, o descarta el
+ índice si el directorio mismo se borró o se movió. Con wd < 0 (se
+ perdieron avisos) se descartan todos.
+ */
+
+void dir_notify(int wd, uint32_t mask, const char *name) {
+    struct dir_index **pp, *d;
+    int i, *pending;
+
+    for (pp = &dcache; (d = *pp) != NULL;) {
+        if (wd >= 0 && d->wd != wd) {
+            pp = &d->next;
+            continue;
+        }
+        i = -1;
+        if (wd >= 0 && !(mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))) {
+            if (name[0] == '\0') {
+                pp = &d->next;
+                continue;
+            }
+            // Un nombre nuevo queda como lápida hasta que se consulte
+            if ((i = dir_find(d, name)) < 0 && (i = dir_add(d, name)) >= 0) {
+                d->items[i].gone = true;
+                d->gone++;
+            }
+            if (i >= 0 && !d->items[i].dirty && d->npending == d->pcap) {
+                d->pcap = d->pcap ? 2 * d->pcap : 64;
+                if ((pending = mem_realloc(d->pending, d->pcap * sizeof(*pending))) == NULL) i = -1;
+                else d->pending = pending;
+            }
+        }
+        if (i < 0) {
+            dir_drop(pp);
+            continue;
+        }
+        if (!d->items[i].dirty) {
+            d->items[i].dirty = true;
+            d->pending[d->npending++] = i;
+        }
+        pp = &d->next;
+    }
+}
+
+
+/*
+ Función: dir_refresh
+
+ Vuelve a consultar las entradas del índice d marcadas por inotify. Cuando
+ las lápidas superan a la mitad de las entradas y ningún listado recorre
+ el índice, las quita.
+ */
+
+void dir_refresh(struct dir_index *d) {
+    int dfd, i, j;
+
+    if (d->npending > 0 && (dfd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+        for (i = 0; i < d->npending; i++) dir_stat(d, dfd, d->pending[i]);
+        close(dfd);
+    }
+    for (i = 0; i < d->npending; i++) d->items[d->pending[i]].dirty = false;
+    d->npending = 0;
+
+    if (d->refs > 0 || d->gone < 1024 || d->gone * 2 < d->count) return;
+    for (i = j = 0; i < d->count; i++) {
+        if (d->items[i].gone) free(d->items[i].name);
+        else d->items[j++] = d->items[i];
+    }
+    d->count = j;
+    d->gone = 0;
+    dir_rehash(d, d->cap);
+}
+
+
+/*
+ Función: dir_open
+
+ Crea el índice, todavía vacío, del directorio path y lo deja abierto para
+ que dir_scan lo lea. Con watch, antes de leerlo empieza a vigilarlo, así
+ no se pierde ningún cambio posterior. Devuelve NULL si el directorio no
+ se puede abrir.
+ */
+
+struct dir_index *dir_open(char *path, bool watch) {
+    struct dir_index *d;
+
+    if ((d = mem_calloc(1, sizeof(*d))) == NULL || (d->path = mem_strdup(path)) == NULL) {
+        free(d);
+        return NULL;
+    }
+    d->wd = -1;
+    if ((d->dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        dir_free(d);
+        return NULL;
+    }
+    if (watch) d->wd = inotify_add_watch(inotify_fd, path, IN_MASK_ADD | IN_ONLYDIR | DIR_EVENTS);
+    d->refs = 1;
+    return d;
+}
+
+
+/*
+ Función: dir_scan
+
+ Lee con getdents64 el siguiente bloque (hasta size bytes, en buf) del
+ directorio del índice d y consulta cada entrada nueva una sola vez; al
+ llegar al final cierra el directorio y el índice queda completo.
+ Devuelve false si el directorio no se pudo leer.
+ */
+
+bool dir_scan(struct dir_index *d, char *buf, size_t size) {
+    struct dirent64 *e;
+    long n;
+    char *p;
+    int i;
+
+    if ((n = syscall(SYS_getdents64, d->dfd, buf, size)) < 0) {
+        warn("Error reading directory %s", d->path);
+        return false;
+    }
+    if (n == 0) {
+        close(d->dfd);
+        d->dfd = -1;
+        return true;
+    }
+    for (p = buf; p < buf + n; p += e->d_reclen) {
+        e = (struct dirent64 *) p;
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        // Un aviso de inotify pudo haberla agregado antes de leerla
+        if ((i = dir_find(d, e->d_name)) < 0 && (i = dir_add(d, e->d_name)) < 0) return false;
+        dir_stat(d, d->dfd, i);
+    }
+    return true;
+}
+
+
+/*
+ Función: dir_put
+
+ Termina de usar el índice d. Si quedó a medio armar sale de la caché; el
+ que ya no está en ella se libera con su último listado.
+ */
+
+void dir_put(struct dir_index *d) {
+    struct dir_index **pp;
+
+    if (d->dfd >= 0) {
+        for (pp = &dcache; *pp && *pp != d; pp = &(*pp)->next);
+        if (*pp) dir_drop(pp);
+    }
+    if (--d->refs == 0 && d->wd < 0) dir_free(d);
+}
+
+
+/*
+ Función: block_close
+
+ Cierra la conexión de datos que MODE B conservaba en la sesión s.
+ */
+
+void block_close(struct session *s) {
+    if (s->bdsd < 0) return;
+    close(s->bdsd);
+    s->bdsd = -1;
+}
+
+
+/*
+ Función: crc32c_sw
+
+ CRC32C (polinomio de Castagnoli, reflejado) por software, de a 8 bytes
+ por vez con 8 tablas ("slicing-by-8"). crc es el valor interno, sin invertir.
+ */
+
+uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t n) {
+    static uint32_t t[8][256];
+    uint64_t w;
+    int i, j;
+
+    if (t[0][1] == 0) {
+        for (i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (j = 0; j < 8; j++) c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+            t[0][i] = c;
+        }
+        for (i = 0; i < 256; i++) {
+            for (j = 1; j < 8; j++) t[j][i] = (t[j - 1][i] >> 8) ^ t[0][t[j - 1][i] & 0xff];
+        }
+    }
+
+    for (; n > 0 && ((uintptr_t) p & 7); n--) crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    for (; n >= 8; n -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        w ^= crc;
+        crc = t[7][w & 0xff] ^ t[6][(w >> 8) & 0xff] ^ t[5][(w >> 16) & 0xff] ^ t[4][(w >> 24) & 0xff] ^
+              t[3][(w >> 32) & 0xff] ^ t[2][(w >> 40) & 0xff] ^ t[1][(w >> 48) & 0xff] ^ t[0][w >> 56];
+    }
+    for (; n > 0; n--) crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+
+#if defined(__x86_64__)
+/*
+ Función: crc32c_hw
+
+ CRC32C con la instrucción crc32 de SSE4.2, de a 8 bytes por vez.
+ */
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t n) {
+    uint64_t c = crc, w;
+
+    for (; n > 0 && ((uintptr_t) p & 7); n--) c = _mm_crc32_u8(c, *p++);
+    for (; n >= 8; n -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    for (; n > 0; n--) c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+#endif
+
+
+/*
+ Función: crc32c
+
+ Continúa el CRC32C crc (0 al empezar) con los n bytes de buf, con la
+ instrucción de SSE4.2 si el procesador la tiene y por software si no.
+ */
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t n) {
+#if defined(__x86_64__)
+    static int hw = -1;
+
+    if (hw < 0) hw = __builtin_cpu_supports("sse4.2");
+    if (hw) return ~crc32c_hw(~crc, buf, n);
+#endif
+    return ~crc32c_sw(~crc, buf, n);
+}
+
+
+/*
+ Función: digest_new
+
+ Prepara un resumen con el algoritmo alg para la sesión s. Sale de la
+ arena, que no se libera mientras dura la transferencia; SHA-256 usa el
+ contexto de la sesión, que se reserva la primera vez y luego solo se
+ reinicia. Devuelve NULL si no hay memoria.
+ */
+
+struct digest *digest_new(struct session *s, enum hash_alg alg) {
+    struct digest *d = arena_alloc(&s->arena, sizeof(*d));
+
+    if (d == NULL) return NULL;
+    memset(d, 0, sizeof(*d));
+    d->alg = alg;
+    if (alg != HASH_SHA256) return d;
+    if (s->md == NULL) {
+        metric_add(&stats->heap_allocs, 1);
+        if ((s->md = EVP_MD_CTX_new()) == NULL) return NULL;
+    }
+    if (!EVP_DigestInit_ex(s->md, EVP_sha256(), NULL)) return NULL;
+    d->md = s->md;
+    return d;
+}
+
+
+/*
+ Función: digest_update
+
+ Agrega al resumen d los n bytes de buf.
+ */
+
+void digest_update(struct digest *d, const void *buf, size_t n) {
+    if (d->alg == HASH_CRC32) d->crc = crc32(d->crc, buf, n);
+    else if (d->alg == HASH_CRC32C) d->crc = crc32c(d->crc, buf, n);
+    else EVP_DigestUpdate(d->md, buf, n);
+}
+
+
+/*
+ Función: digest_final
+
+ Escribe en hex el resultado del resumen d (DIGEST_HEX bytes como máximo).
+ */
+
+void digest_final(struct digest *d, char *hex) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len, i;
+
+    if (d->alg != HASH_SHA256) {
+        sprintf(hex, "%08x", d->crc);
+        return;
+    }
+    EVP_DigestFinal_ex(d->md, md, &len);
+    for (i = 0; i < len; i++) sprintf(hex + 2 * i, "%02x", md[i]);
+}
+
+
+/*
+ Función: digest_load
+
+ Busca en el atributo extendido del archivo fd el último resumen alg que se
+ calculó. Solo vale si el archivo conserva el tamaño y la fecha de
+ modificación de ese momento (st); en ese caso lo copia en hex.
+ */
+
+bool digest_load(int fd, struct stat *st, enum hash_alg alg, char *hex) {
+    char value[128], stored[DIGEST_HEX];
+    long long size, sec, nsec;
+    ssize_t n;
+
+    n = fgetxattr(fd, hash_xattrs[alg], value, sizeof(value) - 1);
+    if (n < 0) return false;
+    value[n] = '\0';
+    if (sscanf(value, "%lld %lld.%lld %64s", &size, &sec, &nsec, stored) != 4) return false;
+    if (size != st->st_size || sec != st->st_mtim.tv_sec || nsec != st->st_mtim.tv_nsec) return false;
+    strcpy(hex, stored);
+    return true;
+}
+
+
+/*
+ Función: digest_save
+
+ Guarda el resumen hex del archivo fd en su atributo extendido, junto con
+ el tamaño y la fecha de modificación (st) a los que corresponde. Si el
+ sistema de archivos no admite atributos extendidos simplemente no se guarda.
+ */
+
+void digest_save(int fd, struct stat *st, enum hash_alg alg, char *hex) {
+    char value[128];
+
+    snprintf(value, sizeof(value), "%lld %lld.%09ld %s", (long long) st->st_size,
+             (long long) st->st_mtim.tv_sec, st->st_mtim.tv_nsec, hex);
+    fsetxattr(fd, hash_xattrs[alg], value, strlen(value), 0);
+}
+
+
+/*
+ Función: digest_xfer
+
+ Al terminar bien una transferencia con resumen (OPTS HASH ... INLINE), lo
+ guarda como el del archivo completo, así un HASH posterior no vuelve a
+ leerlo. En RETR no se guarda si el archivo cambió durante el envío.
+ */
+
+void digest_xfer(struct xfer *x) {
+    char hex[DIGEST_HEX], saved[DIGEST_HEX];
+    struct stat st;
+
+    if (x->digest == NULL || fstat(x->fd, &st) < 0) return;
+    if (x->kind == XFER_RETR && (st.st_size != x->digest->st.st_size ||
+        st.st_mtim.tv_sec != x->digest->st.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != x->digest->st.st_mtim.tv_nsec)) return;
+    digest_final(x->digest, hex);
+    // Reescribir el atributo notificaría a inotify y sacaría el archivo de la caché
+    if (digest_load(x->fd, &st, x->digest->alg, saved) && strcmp(saved, hex) == 0) return;
+    digest_save(x->fd, &st, x->digest->alg, hex);
+}
+
+
+/*
+ Función: now_us
+
+ Devuelve el instante actual en microsegundos (reloj monotónico).
+ */
+
+uint64_t now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/*
+ Función: parse_rate
+
+ Interpreta un límite "tasa[:ráfaga]" en bytes por segundo, con sufijo
+ opcional k, m o g (potencias de 1024). Sin ráfaga se admite un segundo
+ de tasa. Una tasa 0 significa sin límite.
+ Devuelve false si el texto no es válido.
+ */
+
+bool parse_rate(const char *text, int64_t *rate, int64_t *burst) {
+    int64_t value[2] = { 0, 0 };
+    char *end;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (!isdigit((unsigned char) *text)) return false;
+        value[i] = strtoll(text, &end, 10);
+        if (*end == 'k' || *end == 'K') value[i] <<= 10, end++;
+        else if (*end == 'm' || *end == 'M') value[i] <<= 20, end++;
+        else if (*end == 'g' || *end == 'G') value[i] <<= 30, end++;
+        if (*end == '\0') break;
+        if (*end != ':' || i == 1) return false;
+        text = end + 1;
+    }
+    *rate = value[0];
+    *burst = value[1] > 0 ? value[1] : value[0];
+    return true;
+}
+
+
+/*
+ Función: parse_pair
+
+ Interpreta "valor[:segundo]" con enteros no negativos (-T y -C). Sin el
+ segundo valor, *second conserva el que tenía.
+ Devuelve false si el texto no es válido.
+ */
+
+bool parse_pair(const char *text, int *first, int *second) {
+    long value[2] = { 0, *second };
+    char *end;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (!isdigit((unsigned char) *text)) return false;
+        value[i] = strtol(text, &end, 10);
+        if (value[i] > INT_MAX) return false;
+        if (*end == '\0') break;
+        if (*end != ':' || i == 1) return false;
+        text = end + 1;
+    }
+    *first = value[0];
+    *second = value[1];
+    return true;
+}
+
+
+/*
+ Función: bucket_set
+
+ Fija la tasa y la ráfaga del balde b; si cambian, empieza lleno.
+ */
+
+void bucket_set(struct bucket *b, int64_t rate, int64_t burst) {
+    if (__atomic_load_n(&b->rate, __ATOMIC_RELAXED) == rate &&
+        __atomic_load_n(&b->burst, __ATOMIC_RELAXED) == burst) return;
+    __atomic_store_n(&b->last, now_us(), __ATOMIC_RELAXED);
+    __atomic_store_n(&b->tokens, burst, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->burst, burst, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->rate, rate, __ATOMIC_RELEASE);
+}
+
+
+/*
+ Función: bucket_wait
+
+ Llena el balde b con el crédito acumulado hasta now. Solo el proceso que
+ logra avanzar last agrega el crédito, así nadie lo cuenta dos veces.
+ Devuelve los microsegundos que faltan para tener crédito (0: ya hay).
+ */
+
+uint64_t bucket_wait(struct bucket *b, uint64_t now) {
+    int64_t rate = __atomic_load_n(&b->rate, __ATOMIC_ACQUIRE);
+    int64_t burst = __atomic_load_n(&b->burst, __ATOMIC_RELAXED);
+    uint64_t last = __atomic_load_n(&b->last, __ATOMIC_RELAXED);
+    int64_t add, tokens;
+
+    if (rate <= 0) return 0;
+    if (now > last) {
+        // Pasado un tiempo sin uso el balde ya estaría lleno
+        add = now - last > 60000000 ? burst : (int64_t) ((double) (now - last) * rate / 1000000);
+        if (add > 0 && __atomic_compare_exchange_n(&b->last, &last, now, false,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            tokens = __atomic_add_fetch(&b->tokens, add, __ATOMIC_RELAXED);
+            while (tokens > burst && !__atomic_compare_exchange_n(&b->tokens, &tokens, burst, false,
+                                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        }
+    }
+    tokens = __atomic_load_n(&b->tokens, __ATOMIC_RELAXED);
+    if (tokens > 0) return 0;
+    return (uint64_t) (1 - tokens) * 1000000 / rate + 1;
+}
+
+
+/*
+ Función: user_bucket
+
+ Devuelve el balde del usuario name, compartido por todas sus sesiones
+ (también las de otros procesos), con la tasa y la ráfaga indicadas.
+ Devuelve NULL si el usuario no tiene límite o la tabla está llena.
+ */
+
+struct bucket *user_bucket(char *name, int64_t rate, int64_t burst) {
+    struct user_bucket *u;
+    unsigned int h = user_hash(name), i;
+    int state;
+
+    if (rate <= 0) return NULL;
+    for (i = 0; i < USER_BUCKETS; i++) {
+        u = &rates->users[(h + i) & (USER_BUCKETS - 1)];
+        state = 0;
+        // Ocupar un lugar libre; si otro proceso lo está ocupando, esperar su nombre
+        if (__atomic_compare_exchange_n(&u->state, &state, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            snprintf(u->name, PARSIZE, "%s", name);
+            bucket_set(&u->b, rate, burst);
+            __atomic_store_n(&u->state, 2, __ATOMIC_RELEASE);
+            return &u->b;
+        }
+        while (state == 1) state = __atomic_load_n(&u->state, __ATOMIC_ACQUIRE);
+        if (strcmp(u->name, name) == 0) {
+            bucket_set(&u->b, rate, burst);
+            return &u->b;
+        }
+    }
+    warnx("Too many rate-limited users, %s is not limited", name);
+    return NULL;
+}
+
+
+/*
+ Función: rate_start
+
+ Activa los límites de ancho de banda para la transferencia que la sesión s
+ está por empezar: cada paso mueve como mucho lo que el límite más bajo
+ permite en RATE_TICK, para que el crédito se reparta entre transferencias.
+ */
+
+void rate_start(struct session *s) {
+    int64_t rate = __atomic_load_n(&rates->global.rate, __ATOMIC_RELAXED);
+
+    if (s->ubucket && (rate <= 0 || s->ubucket->rate < rate)) rate = s->ubucket->rate;
+    if (rate <= 0) return;
+    s->xfer.quantum = rate / (1000 / RATE_TICK);
+    if (s->xfer.quantum < RATE_QUANTUM) s->xfer.quantum = RATE_QUANTUM;
+    if (s->xfer.quantum > XFER_CHUNK) s->xfer.quantum = XFER_CHUNK;
+}
+
+
+/*
+ Función: rate_wait
+
+ Devuelve los microsegundos que la transferencia de la sesión s debe esperar
+ hasta tener crédito en el balde global y en el de su usuario (0: ninguno).
+ */
+
+uint64_t rate_wait(struct session *s) {
+    uint64_t now = now_us(), wait, user;
+
+    wait = bucket_wait(&rates->global, now);
+    if (s->ubucket && (user = bucket_wait(s->ubucket, now)) > wait) wait = user;
+    return wait;
+}
+
+
+/*
+ Función: rate_charge
+
+ Descuenta n bytes transferidos por la sesión s de los baldes que la limitan.
+ El crédito puede quedar negativo: la deuda se paga esperando.
+ */
+
+void rate_charge(struct session *s, long n) {
+    if (n <= 0) return;
+    if (__atomic_load_n(&rates->global.rate, __ATOMIC_RELAXED) > 0)
+        __atomic_sub_fetch(&rates->global.tokens, n, __ATOMIC_RELAXED);
+    if (s->ubucket) __atomic_sub_fetch(&s->ubucket->tokens, n, __ATOMIC_RELAXED);
+}
+
+
+/*
+ Función: rate_throttle
+
+ Detiene la transferencia de la sesión s hasta que rate_wake la retome,
+ y arma el temporizador si es la primera en espera.
+ */
+
+void rate_throttle(struct session *s) {
+    struct itimerspec its = { .it_interval = { 0, RATE_TICK * 1000000L }, .it_value = { 0, RATE_TICK * 1000000L } };
+
+    if (s->xfer.throttled) return;
+    s->xfer.throttled = true;
+    metric_add(&stats->rate_waits, 1);
+    if (throttled++ == 0 && timerfd_settime(rate_fd, 0, &its, NULL) < 0) warn("Error arming rate timer");
+}
+
+
+/*
+ Función: session_yield
+
+ La transferencia de la sesión s agotó su turno sin esperar a ningún
+ descriptor (XFER_DIGEST): queda para que work_resume la retome en la
+ próxima vuelta del bucle, después de atender a las demás sesiones.
+ */
+
+void session_yield(struct session *s) {
+    uint64_t one = 1;
+
+    if (s->xfer.yielded) return;
+    s->xfer.yielded = true;
+    if (yielded++ == 0 && write(work_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        warn("Error signaling pending work");
+}
+
+
+/*
+ Función: rate_init
+
+ Reserva los baldes de los límites de ancho de banda en memoria compartida,
+ antes de crear procesos, y fija el límite global (global_rate bytes/s con
+ ráfaga global_burst; 0: sin límite).
+ */
+
+void rate_init(int64_t global_rate, int64_t global_burst) {
+    rates = mmap(NULL, sizeof(*rates), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (rates == MAP_FAILED) err(1, "Error allocating rate limits");
+    bucket_set(&rates->global, global_rate, global_burst);
+}
+
+
+/*
+ Función: xfer_end
+
+ Libera los recursos de la transferencia en curso de la sesión s
+ y vuelve la sesión al bucle de comandos.
+ */
+
+void xfer_end(struct session *s) {
+    struct xfer *x = &s->xfer;
+
+    // El cliente nunca se conectó al socket pasivo: el PASV queda consumido
+    if (x->accepting) {
+        pasv_release(s);
+        s->data_ready = false;
+    }
+    // Liberar lo reservado de más si STOR recibió menos de lo anunciado
+    if (x->prealloc) {
+        struct stat st;
+        if (fstat(x->fd, &st) == 0 && st.st_size < x->prealloc &&
+            ftruncate(x->fd, st.st_size) < 0) warn("Error trimming file");
+    }
+    if (x->list) {
+        if (x->list->fd >= 0) close(x->list->fd);
+        dir_put(x->list->dir);
+    }
+    if (x->throttled) throttled--;
+    if (x->yielded) yielded--;
+    if (x->cached) {
+        file_release(x->cached);
+    } else if (x->fd >= 0) {
+        watch(x->fd, 0, &x->fd_events);
+        if (fdmap) fdmap[x->fd] = NULL;
+        close(x->fd);
+    }
+    if (x->dsd >= 0) {
+        watch(x->dsd, 0, &x->events);
+        if (fdmap) fdmap[x->dsd] = NULL;
+        // MODE B: tras el bloque final la conexión queda para la próxima transferencia
+        if (x->bdone) s->bdsd = x->dsd;
+        else close(x->dsd);
+    }
+    if (x->pipe[0] >= 0) {
+        close(x->pipe[0]);
+        close(x->pipe[1]);
+    }
+    if (x->ubuf) iou.free_bufs[iou.nfree++] = x->ubuf;
+    // Los buffers y el estado de zlib son de la arena: se liberan con el próximo comando
+    if (x->zs) {
+        if (x->kind == XFER_RETR) deflateEnd(x->zs);
+        else inflateEnd(x->zs);
+    }
+    memset(x, 0, sizeof(*x));
+    x->fd = x->dsd = x->pipe[0] = x->pipe[1] = -1;
+    x->arena = &s->arena;
+    x->kind = XFER_NONE;
+    if (s->state == ST_XFER) s->state = ST_CMD;
+}
+
+
+/*
+ Función: xfer_chunk
+
+ Cantidad de bytes a mover en el próximo paso de la transferencia x,
+ limitada a max, a lo que reste del archivo y al paso del límite de ancho de banda.
+ */
+
+size_t xfer_chunk(struct xfer *x, size_t max) {
+    if (x->quantum && (size_t) x->quantum < max) max = x->quantum;
+    if (x->remaining >= 0 && (size_t) x->remaining < max) return x->remaining;
+    return max;
+}
+
+
+/*
+ Función: would_block
+
+ Indica si el último error corresponde a un socket no bloqueante que no está listo.
+ */
+
+bool would_block(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+
+/*
+ Función: xfer_pipe
+
+ Crea el pipe intermedio de splice de la transferencia x, con capacidad para
+ XFER_CHUNK bytes si el sistema lo permite (por defecto admite solo 64 KB).
+ */
+
+bool xfer_pipe(struct xfer *x) {
+    if (x->pipe[0] >= 0) return true;
+    if (pipe2(x->pipe, O_NONBLOCK | O_CLOEXEC) < 0) return false;
+    fcntl(x->pipe[1], F_SETPIPE_SZ, XFER_CHUNK);
+    return true;
+}
+
+
+/*
+ Función: xfer_readahead
+
+ Mantiene pedida al kernel (posix_fadvise WILLNEED) la lectura de hasta
+ READAHEAD_WINDOW bytes por delante de la posición de RETR en un archivo
+ regular: el disco los va cargando en la caché de páginas mientras se
+ envían los anteriores, en lugar de leer cada tramo recién al enviarlo.
+ La ventana se renueva cuando se consumió la mitad.
+ */
+
+void xfer_readahead(struct xfer *x) {
+    off_t start, end;
+
+    if (x->ra_end < 0 || x->ra_end - x->offset > READAHEAD_WINDOW / 2) return;
+    start = x->ra_end > x->offset ? x->ra_end : x->offset;
+    end = x->offset + (x->remaining < READAHEAD_WINDOW ? x->remaining : READAHEAD_WINDOW);
+    if (start < end) posix_fadvise(x->fd, start, end - start, POSIX_FADV_WILLNEED);
+    x->ra_end = end;
+}
+
+
+/*
+ Función: retr_eof
+
+ Se llegó al fin del archivo de RETR: la transferencia terminó bien si es
+ un pipe o dispositivo (se envía hasta su fin) o si ya se leyó todo el
+ rango. Si el archivo se acortó durante el envío falla (426), así el
+ cliente no toma por completo un archivo truncado.
+ */
+
+enum xfer_status retr_eof(struct xfer *x) {
+    if (x->remaining <= 0) return XFER_DONE;
+    warnx("File ended %ld bytes before the announced size", x->remaining);
+    return XFER_FAIL;
+}
+
+
+/*
+ Función: retr_step
+
+ Envía el siguiente tramo del archivo de RETR por el socket de datos.
+ Con sendfile los datos pasan de la caché de páginas al socket sin copiarse
+ en el espacio de usuario; con splice viajan por un pipe dentro del kernel.
+ Si el sistema o el archivo no admiten ninguna de las dos se recurre a
+ read + write con un buffer grande.
+ */
+
+enum xfer_status retr_step(struct xfer *x) {
+    ssize_t n;
+
+    if (x->remaining == 0 && x->piped == 0 && x->pos == x->len) return XFER_DONE;
+
+    if (x->method == COPY_SENDFILE) {
+        n = sendfile(x->dsd, x->fd, &x->offset, xfer_chunk(x, XFER_CHUNK));
+        if (n < 0) {
+            if (would_block()) return XFER_WAIT;
+            if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+                x->method = COPY_BUFFER;
+                return XFER_MORE;
+            }
+            warn("Error sending file");
+            return XFER_FAIL;
+        }
+        // El archivo se acortó durante la transferencia
+        if (n == 0) return retr_eof(x);
+        if (x->remaining > 0) x->remaining -= n;
+        x->bytes += n;
+        return XFER_MORE;
+    }
+
+    if (x->method == COPY_SPLICE) {
+        if (!xfer_pipe(x)) {
+            x->method = COPY_BUFFER;
+            return XFER_MORE;
+        }
+
+        // Cargar el pipe desde el archivo, sin esperar a que tenga datos
+        x->src_wait = false;
+        if (x->piped == 0) {
+            n = splice(x->fd, NULL, x->pipe[1], NULL, xfer_chunk(x, XFER_CHUNK), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (would_block()) {
+                    x->src_wait = true;
+                    return XFER_WAIT;
+                }
+                if (errno == EINVAL) {
+                    x->method = COPY_BUFFER;
+                    return XFER_MORE;
+                }
+                warn("Error reading file");
+                return XFER_FAIL;
+            }
+            if (n == 0) return retr_eof(x);
+            x->piped = n;
+            if (x->remaining > 0) x->remaining -= n;
+        }
+
+        // Vaciar el pipe en el socket
+        n = splice(x->pipe[0], NULL, x->dsd, NULL, x->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (would_block()) return XFER_WAIT;
+            warn("Error sending file");
+            return XFER_FAIL;
+        }
+        x->piped -= n;
+        x->bytes += n;
+        return XFER_MORE;
+    }
+
+    // Copia tradicional: se lee el archivo en bloques de tamaño XFER_BUFSIZE
+    if (x->buffer == NULL && (x->buffer = arena_alloc(x->arena, XFER_BUFSIZE)) == NULL) {
+        warn("Error allocating buffer");
+        return XFER_FAIL;
+    }
+    if (x->pos == x->len) {
+        x->pos = 0;
+        if (x->seekable) n = pread(x->fd, x->buffer, xfer_chunk(x, XFER_BUFSIZE), x->offset);
+        else n = read(x->fd, x->buffer, xfer_chunk(x, XFER_BUFSIZE));
+        if (n < 0) {
+            x->len = 0;
+            warn("Error reading file");
+            return XFER_FAIL;
+        }
+        if (n == 0) return retr_eof(x);
+        if (x->digest) digest_update(x->digest, x->buffer, n);
+        x->len = n;
+        x->offset += n;
+        if (x->remaining > 0) x->remaining -= n;
+    }
+
+    // y se envía cada bloque leído al cliente utilizando la función write
+    n = write(x->dsd, x->buffer + x->pos, x->len - x->pos);
+    if (n < 0) {
+        if (would_block()) return XFER_WAIT;
+        warn("Error sending file");
+        return XFER_FAIL;
+    }
+    x->pos += n;
+    x->bytes += n;
+    return XFER_MORE;
+}
+
+
+/*
+ Función: write_at
+
+ Escribe los n bytes de buf en el archivo fd a partir de offset.
+ */
+
+bool write_at(int fd, char *buf, size_t n, off_t offset) {
+    size_t done;
+    ssize_t w;
+
+    for (done = 0; done < n; done += w) {
+        w = pwrite(fd, buf + done, n - done, offset + done);
+        if (w < 0) {
+            if (errno == EINTR) {
+                w = 0;
+                continue;
+            }
+            warn("Error writing file");
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ Función: compressed_type
+
+ Indica si el nombre de path corresponde a un formato que ya viene
+ comprimido, que MODE Z envía sin volver a comprimir.
+ */
+
+bool compressed_type(char *path) {
+    char *types[] = { "gz", "tgz", "bz2", "xz", "zst", "lz4", "zip", "7z", "rar", "jpg", "jpeg",
+                      "png", "gif", "webp", "mp3", "mp4", "mkv", "avi", "mov", "ogg", "flac", NULL };
+    char *ext = strrchr(path, '.');
+    int i;
+
+    if (ext == NULL || strchr(ext, '/')) return false;
+    for (i = 0; types[i]; i++) {
+        if (strcasecmp(ext + 1, types[i]) == 0) return true;
+    }
+    return false;
+}
+
+
+/*
+ Función: zlib_init
+
+ Prepara el flujo de zlib y los buffers de una transferencia COPY_ZLIB.
+ */
+
+bool zlib_init(struct xfer *x) {
+    int r;
+
+    x->zs = arena_alloc(x->arena, sizeof(*x->zs));
+    x->buffer = arena_alloc(x->arena, XFER_BUFSIZE);
+    x->zbuf = arena_alloc(x->arena, XFER_BUFSIZE);
+    if (x->zs == NULL || x->buffer == NULL || x->zbuf == NULL) {
+        warn("Error allocating buffer");
+        x->zs = NULL;
+        return false;
+    }
+    memset(x->zs, 0, sizeof(*x->zs));
+    x->zs->zalloc = arena_zalloc;
+    x->zs->zfree = arena_zfree;
+    x->zs->opaque = x->arena;
+    r = x->kind == XFER_RETR ? deflateInit(x->zs, x->zlevel) : inflateInit(x->zs);
+    if (r != Z_OK) {
+        warnx("Error initializing zlib: %s", x->zs->msg ? x->zs->msg : "unknown");
+        x->zs = NULL;
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ Función: deflate_step
+
+ Paso de RETR en MODE Z: envía lo ya comprimido o comprime el siguiente
+ bloque del archivo. Si tras ZCHECK bytes la compresión no ahorra al menos
+ un 10%, el resto se envía en bloques sin comprimir (nivel 0), que el
+ cliente descomprime igual pero no gastan CPU.
+ */
+
+enum xfer_status deflate_step(struct xfer *x) {
+    z_stream *zs = x->zs;
+    ssize_t n;
+
+    if (zs == NULL && !zlib_init(x)) return XFER_FAIL;
+    zs = x->zs;
+
+    // Enviar lo que quedó comprimido
+    if (x->pos < x->len) {
+        n = write(x->dsd, x->zbuf + x->pos, x->len - x->pos);
+        if (n < 0) {
+            if (would_block()) return XFER_WAIT;
+            warn("Error sending file");
+            return XFER_FAIL;
+        }
+        x->pos += n;
+        x->bytes += n;
+        return XFER_MORE;
+    }
+    if (x->zdone) return XFER_DONE;
+
+    // Leer el siguiente bloque del archivo
+    x->src_wait = false;
+    if (zs->avail_in == 0 && !x->zeof) {
+        if (x->remaining == 0) n = 0;
+        else if (x->seekable) n = pread(x->fd, x->buffer, xfer_chunk(x, XFER_BUFSIZE), x->offset);
+        else n = read(x->fd, x->buffer, xfer_chunk(x, XFER_BUFSIZE));
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                x->src_wait = true;
+                return XFER_WAIT;
+            }
+            warn("Error reading file");
+            return XFER_FAIL;
+        }
+        if (n == 0 && retr_eof(x) == XFER_FAIL) return XFER_FAIL;
+        if (n == 0) x->zeof = true;
+        if (x->digest) digest_update(x->digest, x->buffer, n);
+        x->offset += n;
+        if (x->remaining > 0) x->remaining -= n;
+        zs->next_in = (Bytef *) x->buffer;
+        zs->avail_in = n;
+    }
+
+    zs->next_out = (Bytef *) x->zbuf;
+    zs->avail_out = XFER_BUFSIZE;
+
+    // Datos poco compresibles: seguir sin comprimir
+    if (x->zlevel > 0 && zs->total_in >= ZCHECK && zs->total_out * 10 > zs->total_in * 9 &&
+        deflateParams(zs, 0, Z_DEFAULT_STRATEGY) == Z_OK) {
+        x->zlevel = 0;
+    }
+
+    if (deflate(zs, x->zeof ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_END) x->zdone = true;
+    x->pos = 0;
+    x->len = XFER_BUFSIZE - zs->avail_out;
+    return XFER_MORE;
+}
+
+
+/*
+ Función: inflate_step
+
+ Paso de STOR en MODE Z: recibe datos comprimidos, los descomprime y los
+ escribe en el archivo. La transferencia termina con el fin del flujo
+ comprimido; si la conexión se cierra antes, el archivo llegó incompleto.
+ */
+
+enum xfer_status inflate_step(struct xfer *x) {
+    z_stream *zs = x->zs;
+    size_t out;
+    ssize_t n;
+    int r;
+
+    if (zs == NULL && !zlib_init(x)) return XFER_FAIL;
+    zs = x->zs;
+    if (x->zdone) return XFER_DONE;
+
+    if (zs->avail_in == 0) {
+        n = read(x->dsd, x->buffer, x->quantum && x->quantum < XFER_BUFSIZE ? x->quantum : XFER_BUFSIZE);
+        if (n < 0) {
+            if (would_block()) return XFER_WAIT;
+            warn("receive error");
+            return XFER_FAIL;
+        }
+        if (n == 0) {
+            warnx("Compressed stream truncated");
+            return XFER_FAIL;
+        }
+        x->bytes += n;
+        zs->next_in = (Bytef *) x->buffer;
+        zs->avail_in = n;
+    }
+
+    zs->next_out = (Bytef *) x->zbuf;
+    zs->avail_out = XFER_BUFSIZE;
+    r = inflate(zs, Z_NO_FLUSH);
+    if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
+        warnx("Invalid compressed stream: %s", zs->msg ? zs->msg : "unknown");
+        return XFER_FAIL;
+    }
+    out = XFER_BUFSIZE - zs->avail_out;
+    if (x->digest) digest_update(x->digest, x->zbuf, out);
+    if (!write_at(x->fd, x->zbuf, out, x->offset)) return XFER_FAIL;
+    x->offset += out;
+    if (r == Z_STREAM_END) x->zdone = true;
+    return XFER_MORE;
+}
+
+
+/*
+ Función: block_send_step
+
+ Paso de RETR en MODE B: envía lo pendiente del bloque actual o lee el
+ siguiente, precedido por su cabecera. El último bloque lleva BLOCK_EOF
+ (si el tamaño se conoce, junto con los últimos datos; si no, vacío).
+ */
+
+enum xfer_status block_send_step(struct xfer *x) {
+    ssize_t n;
+
+    if (x->pos < x->len) {
+        n = write(x->dsd, x->buffer + x->pos, x->len - x->pos);
+        if (n < 0) {
+            if (would_block()) return XFER_WAIT;
+            warn("Error sending file");
+            return XFER_FAIL;
+        }
+        x->pos += n;
+        x->bytes += n;
+        return XFER_MORE;
+    }
+    // Recién enviado por completo el bloque final, la conexión puede reutilizarse
+    if (x->zeof) {
+        x->bdone = true;
+        return XFER_DONE;
+    }
+    if (x->buffer == NULL && (x->buffer = arena_alloc(x->arena, XFER_BUFSIZE)) == NULL) {
+        warn("Error allocating buffer");
+        return XFER_FAIL;
+    }
+
+    // La cantidad de bytes de un bloque ocupa 16 bits
+    x->src_wait = false;
+    if (x->remaining == 0) n = 0;
+    else if (x->seekable) n = pread(x->fd, x->buffer + BLOCK_HDR, xfer_chunk(x, 65535), x->offset);
+    else n = read(x->fd, x->buffer + BLOCK_HDR, xfer_chunk(x, 65535));
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            x->src_wait = true;
+            return XFER_WAIT;
+        }
+        warn("Error reading file");
+        return XFER_FAIL;
+    }
+    if (n == 0 && retr_eof(x) == XFER_FAIL) return XFER_FAIL;
+    if (x->digest) digest_update(x->digest, x->buffer + BLOCK_HDR, n);
+    x->offset += n;
+    if (x->remaining > 0) x->remaining -= n;
+    x->zeof = n == 0 || x->remaining == 0;
+
+    x->buffer[0] = x->zeof ? BLOCK_EOF : 0;
+    x->buffer[1] = n >> 8;
+    x->buffer[2] = n & 0xff;
+    x->pos = 0;
+    x->len = n + BLOCK_HDR;
+    return XFER_MORE;
+}
+
+
+/*
+ Función: block_recv_step
+
+ Paso de STOR en MODE B: recibe la cabecera del bloque siguiente o sus
+ datos, que se escriben en el archivo. Nunca se lee más allá del bloque
+ final, porque lo que sigue en la conexión es la próxima transferencia.
+ */
+
+enum xfer_status block_recv_step(struct xfer *x) {
+    size_t chunk;
+    ssize_t n;
+
+    if (x->bdone) return XFER_DONE;
+    if (x->buffer == NULL && (x->buffer = arena_alloc(x->arena, XFER_BUFSIZE)) == NULL) {
+        warn("Error allocating buffer");
+        return XFER_FAIL;
+    }
+
+    if (x->hdr_pos < BLOCK_HDR) {
+        n = read(x->dsd, x->hdr + x->hdr_pos, BLOCK_HDR - x->hdr_pos);
+    } else {
+        chunk = x->block_left < XFER_BUFSIZE ? x->block_left : XFER_BUFSIZE;
+        if (x->quantum && chunk > (size_t) x->quantum) chunk = x->quantum;
+        n = chunk ? read(x->dsd, x->buffer, chunk) : 0;
+    }
+    if (n < 0) {
+        if (would_block()) return XFER_WAIT;
+        warn("receive error");
+        return XFER_FAIL;
+    }
+    if (n == 0 && (x->hdr_pos < BLOCK_HDR || x->block_left > 0)) {
+        warnx("Block stream truncated");
+        return XFER_FAIL;
+    }
+    x->bytes += n;
+
+    if (x->hdr_pos < BLOCK_HDR) {
+        x->hdr_pos += n;
+        if (x->hdr_pos < BLOCK_HDR) return XFER_MORE;
+        x->block_left = x->hdr[1] << 8 | x->hdr[2];
+    } else {
+        // Los marcadores de reinicio no forman parte del archivo
+        if (!(x->hdr[0] & BLOCK_MARK)) {
+            if (x->digest) digest_update(x->digest, x->buffer, n);
+            if (!write_at(x->fd, x->buffer, n, x->offset)) return XFER_FAIL;
+            x->offset += n;
+        }
+        x->block_left -= n;
+    }
+
+    // Bloque completo: el siguiente empieza con su cabecera
+    if (x->block_left == 0) {
+        x->hdr_pos = 0;
+        if (x->hdr[0] & BLOCK_EOF) x->bdone = true;
+    }
+    return XFER_MORE;
+}
+
+
+/*
+ Función: stor_eof
+
+ El cliente cerró la conexión de datos de STOR: la transferencia terminó
+ bien solo si ya llegó todo el tamaño anunciado. Si no, falla (426) y el
+ archivo queda con lo recibido, para retomarlo con REST.
+ */
+
+enum xfer_status stor_eof(struct xfer *x) {
+    if (x->remaining == 0) return XFER_DONE;
+    warnx("Data connection closed %ld bytes before the end of the file", x->remaining);
+    return XFER_FAIL;
+}
+
+
+/*
+ Función: stor_step
+
+ Recibe el siguiente tramo de STOR desde el socket de datos y lo escribe en
+ el archivo a partir de offset. Con splice los datos pasan del socket a un
+ pipe y del pipe al archivo sin copiarse al espacio de usuario; si el
+ sistema de archivos no lo admite se usa read + pwrite con un buffer grande.
+ Se escribe exactamente lo recibido, aunque sea menos de lo pedido; si la
+ conexión se cierra antes del tamaño anunciado, ver stor_eof.
+ */
+
+enum xfer_status stor_step(struct xfer *x) {
+    ssize_t n;
+
+    if (x->remaining == 0 && x->piped == 0) return XFER_DONE;
+
+    if (x->method == COPY_SPLICE) {
+        if (!xfer_pipe(x)) {
+            x->method = COPY_BUFFER;
+            return XFER_MORE;
+        }
+
+        // Cargar el pipe desde el socket
+        if (x->piped == 0) {
+            n = splice(x->dsd, NULL, x->pipe[1], NULL, xfer_chunk(x, XFER_CHUNK), SPLICE_F_MOVE);
+            if (n < 0) {
+                if (would_block()) return XFER_WAIT;
+                if (errno == EINVAL) {
+                    x->method = COPY_BUFFER;
+                    return XFER_MORE;
+                }
+                warn("receive error");
+                return XFER_FAIL;
+            }
+            if (n == 0) return stor_eof(x);
+            x->piped = n;
+            if (x->remaining > 0) x->remaining -= n;
+            x->bytes += n;
+        }
+
+        // Vaciar el pipe en el archivo; splice avanza offset
+        while (x->piped > 0) {
+            n = splice(x->pipe[0], NULL, x->fd, &x->offset, x->piped, SPLICE_F_MOVE);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EINVAL) {
+                    x->method = COPY_BUFFER;
+                    return XFER_MORE;
+                }
+                warn("Error writing file");
+                return XFER_FAIL;
+            }
+            x->piped -= n;
+        }
+        return XFER_MORE;
+    }
+
+    if (x->buffer == NULL && (x->buffer = arena_alloc(x->arena, XFER_BUFSIZE)) == NULL) {
+        warn("Error allocating buffer");
+        return XFER_FAIL;
+    }
+
+    // Lo que splice dejó en el pipe antes de descartarse va primero
+    if (x->piped > 0) {
+        n = read(x->pipe[0], x->buffer, x->piped < XFER_BUFSIZE ? x->piped : XFER_BUFSIZE);
+        if (n <= 0) {
+            warn("Error reading pipe");
+            return XFER_FAIL;
+        }
+        if (!write_at(x->fd, x->buffer, n, x->offset)) return XFER_FAIL;
+        x->piped -= n;
+        x->offset += n;
+        return XFER_MORE;
+    }
+
+    // Lee los datos del socket de datos
+    n = read(x->dsd, x->buffer, xfer_chunk(x, XFER_BUFSIZE));
+    if (n < 0) {
+        if (would_block()) return XFER_WAIT;
+        warn("receive error");
+        return XFER_FAIL;
+    }
+    if (n == 0) return stor_eof(x);
+
+    // Escribe exactamente los datos recibidos en el archivo, a partir de offset
+    if (x->digest) digest_update(x->digest, x->buffer, n);
+    if (!write_at(x->fd, x->buffer, n, x->offset)) return XFER_FAIL;
+    x->offset += n;
+    if (x->remaining > 0) x->remaining -= n;
+    x->bytes += n;
+    return XFER_MORE;
+}
+
+
+/*
+ Función: data_accept
+
+ Acepta la conexión de datos del cliente en el socket pasivo de la sesión s.
+ Una conexión que no viene de la misma dirección que el canal de control se
+ rechaza, para que un tercero no pueda apropiarse de la transferencia.
+ En modo fork espera bloqueado a que el cliente se conecte.
+ Tras aceptarla, el socket pasivo vuelve al pool.
+ */
+
+enum xfer_status data_accept(struct session *s) {
+    struct pasv_slot *p = s->pasv;
+    struct pollfd pfd = { .fd = p->lsd, .events = POLLIN };
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+    int dsd;
+
+    while (true) {
+        if (s->blocking && poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            warn("Error waiting for data connection");
+            return XFER_FAIL;
+        }
+        addr_len = sizeof(addr);
+        dsd = accept4(p->lsd, (struct sockaddr *) &addr, &addr_len,
+                      SOCK_CLOEXEC | (s->blocking ? 0 : SOCK_NONBLOCK));
+        if (dsd < 0) {
+            if (would_block() || errno == ECONNABORTED) {
+                if (s->blocking) continue;
+                return XFER_WAIT;
+            }
+            warn("Error accepting data connection");
+            return XFER_FAIL;
+        }
+        if (addr.sin_addr.s_addr == s->peer.sin_addr.s_addr) break;
+        warnx("Data connection from unexpected address %s", inet_ntoa(addr.sin_addr));
+        close(dsd);
+    }
+
+    s->xfer.dsd = dsd;
+    s->xfer.accepting = false;
+    pasv_release(s);
+    s->data_ready = false;
+    return XFER_MORE;
+}
+
+
+/*
+ Función: digest_step
+
+ Lee el siguiente tramo del rango de XFER_DIGEST y lo agrega al resumen.
+ Falla si el archivo se acortó mientras se leía.
+ */
+
+enum xfer_status digest_step(struct xfer *x) {
+    ssize_t n;
+
+    if (x->remaining == 0) return XFER_DONE;
+    n = pread(x->fd, x->buffer, xfer_chunk(x, XFER_BUFSIZE), x->offset);
+    if (n < 0 && errno == EINTR) return XFER_MORE;
+    if (n <= 0) {
+        if (n < 0) warn("Error reading file");
+        return XFER_FAIL;
+    }
+    digest_update(x->digest, x->buffer, n);
+    x->offset += n;
+    x->remaining -= n;
+    x->bytes += n;
+    return XFER_MORE;
+}
+
+
+/*
+ Función: list_line
+
+ Escribe en line la línea de la entrada it para el formato fmt: el nombre
+ (NLST, con el prefijo del directorio pedido), una línea al estilo de
+ "ls -l" (LIST) o los datos de MLSD (RFC 3659). Devuelve su longitud, o 0
+ si la entrada no corresponde al formato o no cabe.
+ */
+
+int list_line(char *line, size_t size, enum list_format fmt, struct dir_item *it, char *prefix, time_t now) {
+    char perms[11] = "?rwxrwxrwx", date[32], *type;
+    struct tm tm;
+    int i, n;
+
+    if (fmt == LIST_NAMES) {
+        // Los subdirectorios no se incluyen, así cada nombre se puede pedir con RETR
+        if (S_ISDIR(it->mode)) return 0;
+        n = snprintf(line, size, "%s%s\r\n", prefix, it->name);
+    } else if (fmt == LIST_LONG) {
+        perms[0] = S_ISDIR(it->mode) ? 'd' : S_ISLNK(it->mode) ? 'l' : S_ISREG(it->mode) ? '-' :
+                   S_ISFIFO(it->mode) ? 'p' : S_ISSOCK(it->mode) ? 's' : S_ISCHR(it->mode) ? 'c' : 'b';
+        for (i = 0; i < 9; i++) {
+            if (!(it->mode & (0400 >> i))) perms[i + 1] = '-';
+        }
+        // Como ls: la hora para lo modificado en los últimos 6 meses, el año para lo anterior
+        localtime_r(&it->mtime.tv_sec, &tm);
+        strftime(date, sizeof(date), now - it->mtime.tv_sec < 15552000 && it->mtime.tv_sec <= now
+                 ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+        n = snprintf(line, size, "%s %3lu ftp ftp %12lld %s %s\r\n", perms, (unsigned long) it->nlink,
+                     (long long) it->size, date, it->name);
+    } else {
+        type = S_ISDIR(it->mode) ? "dir" : S_ISREG(it->mode) ? "file" :
+               S_ISLNK(it->mode) ? "OS.unix=symlink" : "OS.unix=special";
+        gmtime_r(&it->mtime.tv_sec, &tm);
+        strftime(date, sizeof(date), "%Y%m%d%H%M%S", &tm);
+        n = snprintf(line, size, "type=%s;size=%lld;modify=%s;UNIX.mode=%04o; %s\r\n", type,
+                     (long long) it->size, date, (unsigned) (it->mode & 07777), it->name);
+    }
+    return n < (int) size ? n : 0;
+}
+
+
+/*
+ Función: list_step
+
+ Avanza el listado de LIST, NLST o MLSD de la transferencia x: escribe en
+ el pipe las líneas pendientes o, si no queda ninguna, arma las de las
+ entradas siguientes del índice; cuando ya se listaron todas y el
+ directorio todavía se está leyendo, lee el bloque siguiente (ver
+ dir_scan). Cada paso arma a lo sumo LIST_BATCH líneas o lee un bloque
+ de DIRENT_BUFSIZE bytes, así ninguno demora a las demás sesiones. Al
+ terminar cierra el pipe, cuyo fin es el del listado.
+ Devuelve XFER_WAIT si el pipe está lleno.
+ */
+
+enum xfer_status list_step(struct xfer *x) {
+    char line[PATH_MAX + 128];
+    struct listing *l = x->list;
+    struct dir_index *d = l->dir;
+    ssize_t n;
+    int len, lines = 0;
+
+    if (l->pos < l->len) {
+        n = write(l->fd, l->buf + l->pos, l->len - l->pos);
+        if (n < 0) {
+            if (would_block()) return XFER_WAIT;
+            warn("Error writing file list");
+            return XFER_FAIL;
+        }
+        l->pos += n;
+        return XFER_MORE;
+    }
+    l->pos = l->len = 0;
+    if (l->next < d->count) {
+        for (; l->next < d->count && lines < LIST_BATCH; l->next++) {
+            if (d->items[l->next].gone) continue;
+            len = list_line(line, sizeof(line), l->fmt, &d->items[l->next], l->prefix, l->now);
+            if (l->len + len > (int) sizeof(l->buf)) break;
+            memcpy(l->buf + l->len, line, len);
+            l->len += len;
+            lines++;
+        }
+        return XFER_MORE;
+    }
+    if (d->dfd >= 0) return dir_scan(d, l->dirents, DIRENT_BUFSIZE) ? XFER_MORE : XFER_FAIL;
+    close(l->fd);
+    l->fd = -1;
+    return XFER_DONE;
+}
+
+
+/*
+ Función: xfer_step
+
+ Avanza un bloque la transferencia en curso de la sesión s.
+ Devuelve XFER_MORE si queda trabajo, XFER_WAIT si el socket no está listo
+ (solo en modo epoll), XFER_DONE al terminar y XFER_FAIL ante un error.
+ */
+
+enum xfer_status xfer_step(struct session *s) {
+    struct xfer *x = &s->xfer;
+    enum xfer_status r = XFER_DONE;
+    uint64_t wait;
+    long bytes = x->bytes;
+
+    // Esperar la conexión del cliente al socket pasivo
+    if (x->accepting && (r = data_accept(s)) != XFER_MORE) return r;
+
+    // Completar la conexión no bloqueante al canal de datos del cliente
+    if (x->connecting) {
+        if (connect(x->dsd, (struct sockaddr *) &s->data_addr, sizeof(s->data_addr)) < 0 &&
+            errno != EISCONN) {
+            if (errno == EALREADY || errno == EINPROGRESS || errno == EINTR) return XFER_WAIT;
+            warn("Error on connect to data channel");
+            return XFER_FAIL;
+        }
+        x->connecting = false;
+    }
+
+    // Las transferencias por io_uring avanzan con sus completions
+    if (x->method == COPY_URING) return x->ubusy ? XFER_WAIT : x->ustatus;
+
+    // Sin crédito de ancho de banda: en modo fork se duerme; si no, la retoma rate_wake
+    if (x->quantum && (wait = rate_wait(s)) > 0) {
+        if (s->blocking) {
+            usleep(wait < RATE_SLEEP ? wait : RATE_SLEEP);
+            return XFER_MORE;
+        }
+        rate_throttle(s);
+        return XFER_WAIT;
+    }
+
+    if (x->kind == XFER_STOR) {
+        if (x->method == COPY_ZLIB) r = inflate_step(x);
+        else if (x->method == COPY_BLOCK) r = block_recv_step(x);
+        else r = stor_step(x);
+    } else if (x->kind == XFER_RETR) {
+        // LIST, NLST y MLSD: el listado se arma a medida que se envía
+        if (x->list && x->list->fd >= 0 && list_step(x) == XFER_FAIL) return XFER_FAIL;
+        xfer_readahead(x);
+        if (x->method == COPY_ZLIB) r = deflate_step(x);
+        else if (x->method == COPY_BLOCK) r = block_send_step(x);
+        else r = retr_step(x);
+        // El listado todavía no escribió nada en el pipe: seguir armándolo
+        if (r == XFER_WAIT && x->src_wait && x->list && x->list->fd >= 0) {
+            x->src_wait = false;
+            r = XFER_MORE;
+        }
+        // En modo fork se espera bloqueado a que el pipe o dispositivo tenga datos
+        if (r == XFER_WAIT && x->src_wait && s->blocking) {
+            struct pollfd pfd = { .fd = x->fd, .events = POLLIN };
+            poll(&pfd, 1, -1);
+            r = XFER_MORE;
+        }
+    } else if (x->kind == XFER_DIGEST) {
+        xfer_readahead(x);
+        r = digest_step(x);
+    }
+    if (x->quantum) rate_charge(s, x->bytes - bytes);
+    return r;
+}
+
+
+/*
+ Función: xfer_events
+
+ Actualiza el interés de epoll sobre el socket de datos de la sesión s
+ según la etapa en que se encuentra la transferencia.
+ */
+
+void xfer_events(struct session *s) {
+    struct xfer *x = &s->xfer;
+    uint32_t ev;
+
+    if (s->blocking) return;
+    if (x->accepting) {
+        fdmap[s->pasv->lsd] = s;
+        watch(s->pasv->lsd, EPOLLIN, &s->pasv->events);
+        return;
+    }
+    if (x->dsd < 0) return;
+
+    // Frenada por el límite de ancho de banda: no hay nada que esperar del socket
+    if (x->throttled) {
+        watch(x->dsd, 0, &x->events);
+        if (x->fd_events) watch(x->fd, 0, &x->fd_events);
+        return;
+    }
+
+    // Sin datos en el archivo de origen: esperarlos en lugar del socket
+    if (x->src_wait) {
+        watch(x->dsd, 0, &x->events);
+        fdmap[x->fd] = s;
+        watch(x->fd, EPOLLIN, &x->fd_events);
+        return;
+    }
+    if (x->fd_events) watch(x->fd, 0, &x->fd_events);
+
+    ev = (x->connecting || x->kind == XFER_RETR) ? EPOLLOUT : EPOLLIN;
+    fdmap[x->dsd] = s;
+    watch(x->dsd, ev, &x->events);
+}
+
+
+/*
+ Función: data_connect
+
+ Abre la conexión de datos hacia la dirección que el cliente indicó con PORT.
+ En modo epoll el connect no bloquea y lo completa xfer_step.
+ Devuelve el socket de datos, o -1 si no pudo abrirse (ya informado al cliente).
+ */
+
+int data_connect(struct session *s) {
+    int dsd;
+
+    dsd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (dsd < 0) {
+        warn("Cannot create socket");
+        send_ans(s, MSG_425);
+        return -1;
+    }
+    if (!s->blocking) set_nonblocking(dsd);
+
+    if (connect(dsd, (struct sockaddr *) &s->data_addr, sizeof(s->data_addr)) < 0 &&
+        errno != EINPROGRESS) {
+        warn("Error on connect to data channel");
+        send_ans(s, MSG_425);
+        close(dsd);
+        return -1;
+    }
+    s->xfer.connecting = !s->blocking;
+    return dsd;
+}
+
+
+/*
+ Función: data_open
+
+ Prepara el canal de datos de la próxima transferencia de la sesión s:
+ tras PASV espera la conexión del cliente en el socket pasivo reservado
+ (la acepta xfer_step); tras PORT se conecta a la dirección indicada. En MODE B reutiliza la
+ conexión de la transferencia anterior, si la hay.
+ Devuelve false si no pudo abrirse (ya informado al cliente).
+ */
+
+bool data_open(struct session *s) {
+    if (s->bdsd >= 0) {
+        s->xfer.dsd = s->bdsd;
+        s->bdsd = -1;
+        return true;
+    }
+    if (s->pasv) {
+        s->xfer.accepting = true;
+        return true;
+    }
+    return (s->xfer.dsd = data_connect(s)) >= 0;
+}
+
+
+/*
+ Función: uring_xfer_init
+
+ En modo uring, reserva un buffer registrado para la transferencia de la
+ sesión s, que desde entonces realiza el kernel por io_uring. Solo se usa
+ para archivos regulares, que se leen o escriben en posiciones conocidas;
+ el resto (y cualquier transferencia si no quedan buffers, o con límite
+ de ancho de banda) sigue el camino de epoll.
+ */
+
+void uring_xfer_init(struct session *s) {
+    struct xfer *x = &s->xfer;
+
+    if (!s->uring || !x->seekable || x->quantum || x->method == COPY_ZLIB || x->method == COPY_BLOCK || iou.nfree == 0) return;
+    x->ubuf = iou.free_bufs[--iou.nfree];
+    x->method = COPY_URING;
+    x->ustatus = XFER_WAIT;
+}
+
+
+/*
+ Función: uring_xfer_next
+
+ Envía al kernel la siguiente operación de la transferencia de la sesión s.
+ RETR encadena (IOSQE_IO_LINK) la lectura del archivo con el envío por el
+ socket de datos, así cada bloque cuesta una sola entrada en la cola;
+ STOR recibe un bloque y, cuando llega, lo escribe en el archivo.
+ Los envíos o escrituras parciales se completan antes de seguir.
+ */
+
+void uring_xfer_next(struct session *s) {
+    struct xfer *x = &s->xfer;
+    struct io_uring_sqe *sqe;
+    unsigned idx = (x->ubuf - iou.bufs) / URING_BUFSIZE;
+    size_t n;
+
+    // Terminar de enviar o escribir el bloque actual
+    if (x->pos < x->len) {
+        if (x->kind == XFER_RETR) {
+            sqe = uring_sqe(s, U_DSEND);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = x->dsd;
+        } else {
+            sqe = uring_sqe(s, U_FWRITE);
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->fd = x->fd;
+            sqe->off = x->offset + x->pos;
+            sqe->buf_index = idx;
+        }
+        sqe->addr = (uintptr_t) (x->ubuf + x->pos);
+        sqe->len = x->len - x->pos;
+        x->ubusy = 1;
+        return;
+    }
+
+    // Bloque completo: avanzar al siguiente
+    if (x->digest && x->len > 0) digest_update(x->digest, x->ubuf, x->len);
+    x->offset += x->len;
+    if (x->remaining > 0) x->remaining -= x->len;
+    x->pos = x->len = 0;
+    if (x->remaining == 0) {
+        x->ustatus = XFER_DONE;
+        return;
+    }
+    n = xfer_chunk(x, URING_BUFSIZE);
+
+    if (x->kind == XFER_RETR) {
+        xfer_readahead(x);
+        sqe = uring_sqe(s, U_READ);
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = x->fd;
+        sqe->off = x->offset;
+        sqe->addr = (uintptr_t) x->ubuf;
+        sqe->len = n;
+        sqe->buf_index = idx;
+        sqe->flags = IOSQE_IO_LINK;
+
+        sqe = uring_sqe(s, U_DSEND);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = x->dsd;
+        sqe->addr = (uintptr_t) x->ubuf;
+        sqe->len = n;
+        x->len = n;
+        x->ubusy = 2;
+    } else {
+        sqe = uring_sqe(s, U_DRECV);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = x->dsd;
+        sqe->addr = (uintptr_t) x->ubuf;
+        sqe->len = n;
+        x->ubusy = 1;
+    }
+}
+
+
+/*
+ Función: uring_xfer_complete
+
+ Registra el resultado res de una operación op de la transferencia de la
+ sesión s y, cuando no quedan operaciones en curso, envía la siguiente.
+ */
+
+void uring_xfer_complete(struct session *s, enum uring_op op, int res) {
+    struct xfer *x = &s->xfer;
+
+    x->ubusy--;
+    if (res < 0 && res != -ECANCELED) {
+        errno = -res;
+        warn(op == U_READ || op == U_FWRITE ? "Error on file" : "Error on data channel");
+        x->ustatus = XFER_FAIL;
+    } else if (op == U_READ) {
+        // Lectura corta: el kernel cancela el envío encadenado y se envía lo leído
+        if (res < x->len) x->len = res;
+        if (res == 0) x->ustatus = retr_eof(x);
+    } else if (op == U_DRECV) {
+        x->len = res;
+        if (res == 0) x->ustatus = stor_eof(x);
+    } else if (res > 0) {
+        x->pos += res;
+        x->bytes += res;
+    }
+
+    if (x->ubusy == 0 && x->ustatus == XFER_WAIT) uring_xfer_next(s);
+}
+
+
+/*
+ Función: users_free
+
+ Libera una tabla de usuarios.
+ */
+
+void users_free(struct user_table *t) {
+    if (t == NULL) return;
+    free(t->buckets);
+    free(t->entries);
+    free(t->blob);
+    free(t);
+}
+
+
+/*
+ Función: users_load
+
+ Lee el archivo de usuarios de una sola vez y construye una tabla nueva.
+ Si el archivo no existe o no puede leerse la tabla queda vacía: nadie puede
+ iniciar sesión, como ocurría antes al no poder abrirlo.
+ Devuelve NULL solo si no hay memoria.
+ */
+
+struct user_table *users_load(void) {
+    struct user_table *t;
+    char *line, *end, *sep;
+    unsigned int n = 0, i, size = 1;
+    struct stat st;
+    ssize_t r;
+    off_t done;
+    int fd;
+
+    if ((t = mem_calloc(1, sizeof(*t))) == NULL) return NULL;
+    memset(&st, 0, sizeof(st));
+
+    // Leer el archivo completo en blob
+    fd = open(USERS_DIR "/" USERS_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        warn("Error opening %s", USERS_DIR "/" USERS_FILE);
+    } else if ((t->blob = mem_alloc(st.st_size + 1)) != NULL) {
+        for (done = 0; done < st.st_size; done += r) {
+            r = read(fd, t->blob + done, st.st_size - done);
+            if (r <= 0) break;
+        }
+        st.st_size = done;
+        t->blob[done] = '\0';
+        for (i = 0; i < done; i++) {
+            if (t->blob[i] == '\n') n++;
+        }
+        n++;
+    }
+    if (fd >= 0) close(fd);
+    users_st = st;
+
+    // Dimensionar la tabla para mantener los baldes casi vacíos
+    while (size < 2 * n) size <<= 1;
+    t->mask = size - 1;
+    t->buckets = mem_calloc(size, sizeof(*t->buckets));
+    t->entries = mem_calloc(n ? n : 1, sizeof(*t->entries));
+    if (t->buckets == NULL || t->entries == NULL) {
+        users_free(t);
+        return NULL;
+    }
+
+    // Cada línea "usuario:contraseña" se separa en el primer ':'; lo que
+    // sigue a un segundo ':' es el límite de ancho de banda del usuario
+    for (i = 0, line = t->blob; line && *line; line = end ? end + 1 : NULL) {
+        end = strchr(line, '\n');
+        if (end) *end = '\0';
+        if (end && end > line && end[-1] == '\r') end[-1] = '\0';
+        if ((sep = strchr(line, ':')) == NULL) continue;
+        *sep = '\0';
+
+        struct user_entry *e = &t->entries[i++];
+        unsigned int h = user_hash(line) & t->mask;
+        e->name = line;
+        e->pass = sep + 1;
+        e->rate = e->burst = -1;
+        if ((sep = strchr(e->pass, ':')) != NULL) {
+            *sep = '\0';
+            if (!parse_rate(sep + 1, &e->rate, &e->burst)) {
+                warnx("Invalid rate for user %s in %s", e->name, USERS_FILE);
+                e->rate = e->burst = -1;
+            }
+        }
+        e->next = t->buckets[h];
+        t->buckets[h] = e;
+    }
+
+    return t;
+}
+
+
+/*
+ Función: users_reload
+
+ Reemplaza la tabla vigente por una recién leída. La nueva se construye
+ completa antes del cambio, de modo que ninguna verificación ve una tabla a medias.
+ */
+
+void users_reload(void) {
+    struct user_table *t = users_load(), *old = users;
+
+    if (t == NULL) {
+        warnx("Cannot reload %s, keeping previous users", USERS_FILE);
+        return;
+    }
+    users = t;
+    users_free(old);
+}
+
+
+/*
+ Función: users_init
+
+ Carga los usuarios al iniciar el servidor y vigila su directorio con inotify
+ para recargarlos cuando el archivo se modifica, se reemplaza o se borra.
+ */
+
+void users_init(void) {
+    users_reload();
+    if (users == NULL) errx(1, "Cannot load %s", USERS_FILE);
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd >= 0) {
+        users_wd = inotify_add_watch(inotify_fd, USERS_DIR, USERS_EVENTS);
+    }
+    if (users_wd < 0) warn("inotify unavailable, checking %s modification time", USERS_FILE);
+}
+
+
+/*
+ Función: notify_poll
+
+ Atiende, sin bloquear, los avisos pendientes de inotify: recarga los
+ usuarios o invalida archivos de la caché de RETR. Si inotify no está
+ disponible compara la fecha de modificación del archivo de usuarios con la cargada.
+ */
+
+void notify_poll(void) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    bool changed = false;
+    struct stat st;
+    ssize_t n;
+    char *p;
+
+    if (users_wd < 0) {
+        if (stat(USERS_DIR "/" USERS_FILE, &st) < 0) memset(&st, 0, sizeof(st));
+        if (st.st_ino != users_st.st_ino || st.st_size != users_st.st_size ||
+            st.st_mtim.tv_sec != users_st.st_mtim.tv_sec || st.st_mtim.tv_nsec != users_st.st_mtim.tv_nsec)
+            users_reload();
+        return;
+    }
+
+    while ((n = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (p = buffer; p < buffer + n; p += sizeof(*ev) + ev->len) {
+            ev = (struct inotify_event *) p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                changed = true;
+                file_notify(-1);
+                dir_notify(-1, 0, "");
+                continue;
+            }
+            if (ev->wd == users_wd && ev->len && strcmp(ev->name, USERS_FILE) == 0) changed = true;
+            else if (ev->wd != users_wd) file_notify(ev->wd);
+            dir_notify(ev->wd, ev->mask, ev->len ? ev->name : "");
+        }
+    }
+    if (changed) users_reload();
+}
+
+
+/*
+ Función: user_find
+
+ Busca el usuario user en la tabla vigente. Devuelve NULL si no existe.
+ */
+
+struct user_entry *user_find(char *user) {
+    struct user_entry *e;
+
+    if (users == NULL) return NULL;
+    for (e = users->buckets[user_hash(user) & users->mask]; e; e = e->next) {
+        if (strcmp(e->name, user) == 0) return e;
+    }
+    return NULL;
+}
+
+
+/*
+Función: check_credentials
+
+Esta función verifica las credenciales de usuario y contraseña proporcionadas.
+Busca el usuario en la tabla en memoria cargada desde el archivo "ftpusers"
+(sin acceder al disco) y compara la contraseña.
+Toma las cadenas de caracteres user y pass que representan el nombre de usuario
+y la contraseña a verificar.
+Devuelve true si las credenciales son válidas, y false en caso contrario.
+ */
+
+bool check_credentials(char *user, char *pass) {
+    struct user_entry *e;
+
+    // Sin inotify se verifica en cada inicio de sesión si el archivo cambió
+    if (users_wd < 0) notify_poll();
+    e = user_find(user);
+    return e && strcmp(e->pass, pass) == 0;
+}
+
+
+/*
+ Función: metrics_init
+
+ Reserva los contadores de todos los procesos en memoria compartida. Se llama
+ antes de crear procesos para que todos vean la misma región.
+ */
+
+void metrics_init(void) {
+    metrics = mmap(NULL, MAX_WORKERS * sizeof(*metrics), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) err(1, "Error allocating metrics");
+    stats = &metrics[0];
+}
+
+
+/*
+ Función: conn_init
+
+ Reserva en memoria compartida los contadores de sesiones abiertas de cada
+ proceso, antes de crearlos. rows es la cantidad de procesos que aceptan
+ conexiones (los workers de prefork, o solo este).
+ */
+
+void conn_init(int rows) {
+    conn_table = mmap(NULL, MAX_WORKERS * sizeof(*conn_table), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (conn_table == MAP_FAILED) err(1, "Error allocating session counters");
+    conn_rows = rows;
+    conns = &conn_table[0];
+}
+
+
+/*
+ Función: peer_find
+
+ Busca la dirección del cliente peer en la tabla de sesiones por dirección
+ de c (hash multiplicativo y sondeo lineal). Si no está y spare no es NULL,
+ deja en *spare la primera entrada sin sesiones del recorrido (NULL si la
+ tabla está llena). Devuelve la entrada de peer, o NULL.
+ */
+
+struct peer_count *peer_find(struct conn_counts *c, struct sockaddr_in *peer, struct peer_count **spare) {
+    in_addr_t addr = peer->sin_addr.s_addr;
+    unsigned int slot = (ntohl(addr) * 2654435761u) >> (32 - __builtin_ctz(PEER_SLOTS));
+    struct peer_count *p;
+    in_addr_t seen;
+    int i;
+
+    if (spare) *spare = NULL;
+    for (i = 0; i < PEER_SLOTS; i++) {
+        p = &c->peers[(slot + i) & (PEER_SLOTS - 1)];
+        seen = __atomic_load_n(&p->addr, __ATOMIC_RELAXED);
+        if (seen == addr) return p;
+        if (spare && *spare == NULL && __atomic_load_n(&p->count, __ATOMIC_RELAXED) == 0) *spare = p;
+        if (seen == 0) break;
+    }
+    return NULL;
+}
+
+
+/*
+ Función: conn_admit
+
+ Decide si se admite una conexión nueva de peer según los límites de -C,
+ sumando las sesiones abiertas por todos los procesos, y si se admite la
+ cuenta en los contadores de este proceso. Dos procesos pueden admitir a la
+ vez la última conexión permitida: el límite es aproximado en uno por
+ proceso, a cambio de no bloquear.
+ */
+
+bool conn_admit(struct sockaddr_in *peer) {
+    struct peer_count *own = NULL, *p;
+    int total = 0, same = 0, i;
+
+    if (max_sessions == 0 && max_per_ip == 0) return true;
+    for (i = 0; i < conn_rows; i++) {
+        total += __atomic_load_n(&conn_table[i].total, __ATOMIC_RELAXED);
+        if (max_per_ip && &conn_table[i] != conns && (p = peer_find(&conn_table[i], peer, NULL)) != NULL)
+            same += __atomic_load_n(&p->count, __ATOMIC_RELAXED);
+    }
+    if (max_sessions && total >= max_sessions) return false;
+    if (max_per_ip) {
+        // Sin lugar en la tabla no se puede contar la dirección: se la trata como excedida
+        if ((p = peer_find(conns, peer, &own)) == NULL && (p = own) == NULL) return false;
+        if (same + __atomic_load_n(&p->count, __ATOMIC_RELAXED) >= max_per_ip) return false;
+        // Solo este proceso cambia las direcciones de su tabla
+        __atomic_store_n(&p->addr, peer->sin_addr.s_addr, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&p->count, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&conns->total, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+
+/*
+ Función: conn_release
+
+ Descuenta una sesión de peer admitida con conn_admit. Puede llamarse desde
+ un manejador de señales.
+ */
+
+void conn_release(struct sockaddr_in *peer) {
+    struct peer_count *p;
+
+    if (max_sessions == 0 && max_per_ip == 0) return;
+    __atomic_fetch_sub(&conns->total, 1, __ATOMIC_RELAXED);
+    if (max_per_ip && (p = peer_find(conns, peer, NULL)) != NULL) __atomic_fetch_sub(&p->count, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ Función: conn_reject
+
+ Rechaza la conexión sd recién aceptada sin crear su sesión: responde 421 si
+ el socket lo admite sin esperar y la cierra.
+ */
+
+void conn_reject(int sd) {
+    send(sd, MSG_421_BUSY, sizeof(MSG_421_BUSY) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(sd);
+    metric_add(&stats->sessions_rejected, 1);
+}
+
+
+/*
+ Función: metrics_cmd
+
+ Registra que el comando cmd tardó us microsegundos.
+ */
+
+void metrics_cmd(enum cmd_id cmd, uint64_t us) {
+    struct cmd_metrics *c = &stats->cmds[cmd];
+    int b = us ? 64 - __builtin_clzll(us) : 0;
+    uint64_t max = __atomic_load_n(&c->max_us, __ATOMIC_RELAXED);
+
+    if (b >= HIST_BUCKETS) b = HIST_BUCKETS - 1;
+    metric_add(&c->count, 1);
+    metric_add(&c->total_us, us);
+    metric_add(&c->hist[b], 1);
+    while (us > max && !__atomic_compare_exchange_n(&c->max_us, &max, us, true,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+/*
+ Función: cmd_index
+
+ Devuelve el identificador de métricas del comando op.
+ */
+
+enum cmd_id cmd_index(char *op) {
+    int i;
+
+    for (i = 0; i < CMD_OTHER; i++) {
+        if (strcmp(op, cmd_names[i]) == 0) return i;
+    }
+    return CMD_OTHER;
+}
+
+
+/*
+ Función: metrics_xfer
+
+ Registra el fin de la transferencia de la sesión s: su duración desde que
+ se recibió el comando, los bytes transferidos y si se completó (ok).
+ */
+
+void metrics_xfer(struct session *s, bool ok) {
+    struct xfer *x = &s->xfer;
+
+    metrics_cmd(x->cmd, now_us() - x->start);
+    metric_add(ok ? &stats->xfers_ok : &stats->xfers_failed, 1);
+    metric_add(x->kind == XFER_RETR ? &stats->bytes_sent : &stats->bytes_received, x->bytes);
+}
+
+
+/*
+ Función: metrics_sum
+
+ Suma en total los contadores de todos los procesos (los máximos se combinan
+ tomando el mayor).
+ */
+
+void metrics_sum(struct metrics *total) {
+    struct metrics *m;
+    struct cmd_metrics *c, *t;
+    uint64_t max;
+    int w, i, b;
+
+    memset(total, 0, sizeof(*total));
+    for (w = 0; w < MAX_WORKERS; w++) {
+        m = &metrics[w];
+        total->sessions_active += __atomic_load_n(&m->sessions_active, __ATOMIC_RELAXED);
+        total->sessions_total += __atomic_load_n(&m->sessions_total, __ATOMIC_RELAXED);
+        total->logins_ok += __atomic_load_n(&m->logins_ok, __ATOMIC_RELAXED);
+        total->logins_failed += __atomic_load_n(&m->logins_failed, __ATOMIC_RELAXED);
+        total->xfers_ok += __atomic_load_n(&m->xfers_ok, __ATOMIC_RELAXED);
+        total->xfers_failed += __atomic_load_n(&m->xfers_failed, __ATOMIC_RELAXED);
+        total->bytes_sent += __atomic_load_n(&m->bytes_sent, __ATOMIC_RELAXED);
+        total->bytes_received += __atomic_load_n(&m->bytes_received, __ATOMIC_RELAXED);
+        total->fcache_hits += __atomic_load_n(&m->fcache_hits, __ATOMIC_RELAXED);
+        total->fcache_misses += __atomic_load_n(&m->fcache_misses, __ATOMIC_RELAXED);
+        total->digest_hits += __atomic_load_n(&m->digest_hits, __ATOMIC_RELAXED);
+        total->digest_misses += __atomic_load_n(&m->digest_misses, __ATOMIC_RELAXED);
+        total->dcache_hits += __atomic_load_n(&m->dcache_hits, __ATOMIC_RELAXED);
+        total->dcache_misses += __atomic_load_n(&m->dcache_misses, __ATOMIC_RELAXED);
+        total->rate_waits += __atomic_load_n(&m->rate_waits, __ATOMIC_RELAXED);
+        total->heap_allocs += __atomic_load_n(&m->heap_allocs, __ATOMIC_RELAXED);
+        total->arena_allocs += __atomic_load_n(&m->arena_allocs, __ATOMIC_RELAXED);
+        total->sessions_rejected += __atomic_load_n(&m->sessions_rejected, __ATOMIC_RELAXED);
+        total->sessions_timeout += __atomic_load_n(&m->sessions_timeout, __ATOMIC_RELAXED);
+        for (i = 0; i < CMD_COUNT; i++) {
+            c = &m->cmds[i];
+            t = &total->cmds[i];
+            t->count += __atomic_load_n(&c->count, __ATOMIC_RELAXED);
+            t->total_us += __atomic_load_n(&c->total_us, __ATOMIC_RELAXED);
+            max = __atomic_load_n(&c->max_us, __ATOMIC_RELAXED);
+            if (max > t->max_us) t->max_us = max;
+            for (b = 0; b < HIST_BUCKETS; b++) t->hist[b] += __atomic_load_n(&c->hist[b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+/*
+ Función: hist_quantile
+
+ Estima el cuantil q (entre 0 y 1) de las latencias de c con el límite
+ superior de la franja del histograma en que cae, acotado por el máximo.
+ */
+
+uint64_t hist_quantile(struct cmd_metrics *c, double q) {
+    uint64_t target = q * c->count, seen = 0;
+    int b;
+
+    // Redondear hacia arriba: el cuantil 0.99 de dos muestras es la mayor
+    if (target < q * c->count || target == 0) target++;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        seen += c->hist[b];
+        if (seen >= target) break;
+    }
+    if (b >= HIST_BUCKETS - 1 || (1ULL << b) > c->max_us) return c->max_us;
+    return 1ULL << b;
+}
+
+
+/*
+ Función: metrics_format
+
+ Escribe en buf (de tamaño size) las métricas como líneas de texto separadas
+ por '\n': totales de sesiones, inicios de sesión y transferencias, y la
+ latencia de cada comando recibido al menos una vez. Con detail agrega las
+ franjas no vacías de cada histograma y los contadores de cada proceso.
+ Devuelve la longitud del texto.
+ */
+
+size_t metrics_format(char *buf, size_t size, bool detail) {
+    struct metrics total, *m;
+    struct cmd_metrics *c;
+    size_t len = 0;
+    int i, b;
+
+// Agregar texto a buf sin pasarse de size
+#define APPEND(...) do { \
+        if (len < size) len += snprintf(buf + len, size - len, __VA_ARGS__); \
+        if (len > size) len = size; \
+    } while (0)
+
+    metrics_sum(&total);
+    APPEND("sessions active=%ld total=%lu\n", (long) total.sessions_active, total.sessions_total);
+    APPEND("logins ok=%lu failed=%lu\n", total.logins_ok, total.logins_failed);
+    APPEND("transfers ok=%lu failed=%lu sent=%lu received=%lu\n",
+           total.xfers_ok, total.xfers_failed, total.bytes_sent, total.bytes_received);
+    APPEND("file cache hits=%lu misses=%lu\n", total.fcache_hits, total.fcache_misses);
+    APPEND("digest cache hits=%lu misses=%lu\n", total.digest_hits, total.digest_misses);
+    APPEND("directory index hits=%lu misses=%lu\n", total.dcache_hits, total.dcache_misses);
+    APPEND("rate limit waits=%lu\n", total.rate_waits);
+    APPEND("memory heap allocs=%lu arena allocs=%lu\n", total.heap_allocs, total.arena_allocs);
+    APPEND("admission rejected=%lu timeouts=%lu\n", total.sessions_rejected, total.sessions_timeout);
+
+    for (i = 0; i < CMD_COUNT; i++) {
+        c = &total.cmds[i];
+        if (c->count == 0) continue;
+        APPEND("%s count=%lu avg=%luus p50=%luus p99=%luus max=%luus\n", cmd_names[i], c->count,
+               c->total_us / c->count, hist_quantile(c, 0.5), hist_quantile(c, 0.99), c->max_us);
+        if (!detail) continue;
+        APPEND("%s hist", cmd_names[i]);
+        for (b = 0; b < HIST_BUCKETS; b++) {
+            if (c->hist[b]) APPEND(" <%luus:%lu", 1UL << b, c->hist[b]);
+        }
+        APPEND("\n");
+    }
+
+    for (i = 0; detail && i < MAX_WORKERS; i++) {
+        m = &metrics[i];
+        if (m->sessions_total == 0) continue;
+        APPEND("worker %d active=%ld total=%lu sent=%lu received=%lu\n", i, (long) m->sessions_active,
+               m->sessions_total, m->bytes_sent, m->bytes_received);
+    }
+#undef APPEND
+    return len;
+}
+
+
+/*
+ Función: authenticate
+
+Esta función se encarga de autenticar al cliente verificando las credenciales proporcionadas.
+Atiende los estados ST_USER y ST_PASS de la sesión s: espera recibir los comandos USER y
+PASS del cliente (en ese orden) y los verifica.
+Si el flujo no es el esperado o las credenciales no son válidas, la sesión pasa a cerrarse.
+*/
+
+void authenticate(struct session *s, char *op, char *param) {
+    struct user_entry *e;
+    char *expected = (s->state == ST_USER) ? "USER" : "PASS";
+
+    if (strcmp(op, expected)) {
+        warnx("abnormal client flow: did not send %s command", expected);
+        s->state = ST_CLOSE;
+        return;
+    }
+
+    // Recibido USER: solicitar contraseña
+    if (s->state == ST_USER) {
+        snprintf(s->user, PARSIZE, "%s", param);
+        send_ans(s, MSG_331, s->user);
+        s->state = ST_PASS;
+        return;
+    }
+
+    // Si las credenciales no son válidas, denegar el inicio de sesión
+    if (!check_credentials(s->user, param)) {
+        metric_add(&stats->logins_failed, 1);
+        send_ans(s, MSG_530);
+        s->state = ST_CLOSE;
+        return;
+    }
+
+    // Límite de ancho de banda: el del usuario en ftpusers o, si no tiene, el de -U
+    e = user_find(s->user);
+    if (e && e->rate >= 0) s->ubucket = user_bucket(s->user, e->rate, e->burst);
+    else s->ubucket = user_bucket(s->user, user_rate, user_burst);
+
+    // Confirmar inicio de sesión
+    metric_add(&stats->logins_ok, 1);
+    send_ans(s, MSG_230, s->user);
+    s->state = ST_CMD;
+}
+
+
+/*
+ Función: port_valid
+
+ Indica si text tiene exactamente seis números separados por comas, cada
+ uno entre 0 y 255: los cuatro bytes de la dirección y los dos del puerto.
+ */
+
+bool port_valid(const char *text) {
+    int fields, digits, value;
+
+    for (fields = 0; fields < 6; fields++) {
+        if (fields > 0 && *text++ != ',') return false;
+        for (digits = value = 0; digits < 3 && isdigit((unsigned char) *text); digits++) value = 10 * value + (*text++ - '0');
+        if (digits == 0 || value > 255) return false;
+    }
+    return *text == '\0';
+}
+
+
+/*
+Funcion: port
+
+Se encarga de extraer la dirección IP y el puerto de los datos del socket enviados
+por el cliente durante el comando PORT y construye una estructura sockaddr_in
+que representa esa dirección y puerto. Esta estructura se guarda en la sesión s y
+se utilizará más adelante para establecer la conexión de datos entre el cliente y el servidor FTP.
+*/
+
+// addr de tipo struct sockaddr_in se utilizará para almacenar la dirección IP y el puerto extraídos.
+// Las variables ip, aux1 y aux2 se toman de la arena de la sesión, del tamaño de
+// socketdata (a lo sumo PARSIZE), así ninguna parte puede desbordarlas, y empiezan
+// vacías. Si socketdata no tiene la forma h1,h2,h3,h4,p1,p2 se responde 501.
+
+void port(struct session *s, char *socketdata){
+    struct sockaddr_in addr;
+    int puerto, i, j, count;
+    char *ip, *aux1, *aux2;
+    ip = arena_alloc(&s->arena, PARSIZE);
+    aux1 = arena_alloc(&s->arena, PARSIZE);
+    aux2 = arena_alloc(&s->arena, PARSIZE);
+    if (ip == NULL || aux1 == NULL || aux2 == NULL || !port_valid(socketdata)) {
+        send_ans(s, MSG_501);
+        return;
+    }
+    memset(ip, 0, PARSIZE);
+    memset(aux1, 0, PARSIZE);
+    memset(aux2, 0, PARSIZE);
+
+    i = j = 0;
+    count=0;
+
+    // Se inicia un bucle para extraer la dirección IP y el puerto de los datos
+    // del socket enviados por el cliente que verificará si el carácter actual es una coma (',').
+    // Si es así, se incrementa el contador count.
+    while(true){
+        if (*(socketdata+i) == ',') count++;
+
+        if (count<=3){
+            *(ip+j) = *(socketdata+i);
+            if (*(ip+j) == ',') *(ip+j) = '.';
+            j++;
+        }
+        if (*(socketdata+i) == ',' && count==4){
+            *(ip+j) = '\0';
+            j=0;
+            i++;
+            continue;
+        }
+
+        if(count==4){
+            *(aux1+j) = *(socketdata+i);
+            j++;
+        }
+
+        if (*(socketdata+i) == ',' && count==5){
+            *(aux1+j) = '\0';
+            j=0;
+            i++;
+            continue;
+        }
+
+        if(count==5){
+            *(aux2+j) = *(socketdata+i);
+            j++;
+        }
+
+        // Si el carácter actual es el carácter nulo ('\0'), se agrega al final del arreglo aux2
+        // para finalizar la cadena y se rompe el bucle while.
+        if (*(socketdata+i) == '\0'){
+            *(aux2+j) = '\0';
+            break;
+        }
+        i++;
+    }
+    puerto = 256 * atoi(aux1) + atoi(aux2);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(ip);
+    addr.sin_port = htons(puerto);
+
+    // PORT reemplaza a un PASV anterior y a la conexión de MODE B
+    pasv_release(s);
+    block_close(s);
+    s->data_addr = addr;
+    s->data_ready = true;
+
+    send_ans(s, MSG_200);
+}
+
+
+/*
+ Función: pasv
+
+ Maneja el comando PASV: reserva un socket pasivo del pool, ya creado y
+ escuchando, e informa al cliente la dirección y el puerto a los que debe
+ conectarse. Así la transferencia no depende de que el servidor pueda
+ conectarse al cliente (NAT, firewalls) ni de que el cliente abra un puerto.
+ */
+
+void pasv(struct session *s) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    struct pasv_slot *p;
+    unsigned char *ip;
+
+    // La dirección anunciada es la del servidor en el canal de control
+    if (getsockname(s->sd, (struct sockaddr *) &addr, &addr_len) < 0 || (p = pasv_lease(s)) == NULL) {
+        send_ans(s, MSG_425);
+        return;
+    }
+    s->data_ready = true;
+    block_close(s);
+
+    ip = (unsigned char *) &addr.sin_addr.s_addr;
+    send_ans(s, MSG_227, ip[0], ip[1], ip[2], ip[3], p->port >> 8, p->port & 0xff);
+}
+
+
+/*
+ Función: file_open
+
+ Abre path para lectura y guarda en st sus metadatos. Los archivos regulares
+ se conservan abiertos en una caché LRU compartida por todas las sesiones del
+ proceso, de modo que los RETR repetidos de un mismo archivo no abren ni
+ consultan el archivo. Antes de usar una entrada se atienden los avisos de
+ inotify pendientes: un cambio terminado antes del comando nunca se pasa por
+ alto. Sin inotify, o con use_cache en false, siempre se abre el archivo.
+ Devuelve el descriptor (o -1 con errno) y en entry la entrada de la caché
+ o NULL; el descriptor se suelta con file_close.
+ */
+
+int file_open(char *path, struct stat *st, struct file_entry **entry, bool use_cache) {
+    struct file_entry *e = NULL, **bucket = &fcache[user_hash(path) & (FCACHE_BUCKETS - 1)];
+    struct stat cur;
+    int fd, wd;
+
+    *entry = NULL;
+    use_cache = use_cache && users_wd >= 0;
+    if (use_cache) {
+        notify_poll();
+        for (e = *bucket; e && strcmp(e->path, path); e = e->hnext);
+    }
+
+    if (e) {
+        // Pasar la entrada al frente de la lista LRU
+        if (e != fcache_head) {
+            e->prev->next = e->next;
+            if (e->next) e->next->prev = e->prev;
+            else fcache_tail = e->prev;
+            e->prev = NULL;
+            e->next = fcache_head;
+            fcache_head->prev = e;
+            fcache_head = e;
+        }
+        metric_add(&stats->fcache_hits, 1);
+        e->refs++;
+        *st = e->st;
+        *entry = e;
+        return e->fd;
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fstat(fd, st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (!use_cache || !S_ISREG(st->st_mode)) return fd;
+    metric_add(&stats->fcache_misses, 1);
+
+    // Vigilar la ruta y comprobar que sigue siendo el archivo abierto: los
+    // cambios anteriores a la vigilancia se ven en el nuevo fstat
+    wd = inotify_add_watch(inotify_fd, path, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (wd < 0) return fd;
+    if (stat(path, &cur) < 0 || fstat(fd, st) < 0 || cur.st_ino != st->st_ino || cur.st_dev != st->st_dev ||
+        (e = mem_calloc(1, sizeof(*e))) == NULL || (e->path = mem_strdup(path)) == NULL) {
+        free(e);
+        for (e = fcache_head; e && e->wd != wd; e = e->next);
+        if (e == NULL) inotify_rm_watch(inotify_fd, wd);
+        return fd;
+    }
+
+    // Hacer lugar descartando la entrada usada hace más tiempo
+    if (fcache_count >= FCACHE_SIZE) file_detach(fcache_tail);
+
+    e->fd = fd;
+    e->wd = wd;
+    e->refs = 1;
+    e->cached = true;
+    e->st = *st;
+    e->hnext = *bucket;
+    *bucket = e;
+    e->next = fcache_head;
+    if (fcache_head) fcache_head->prev = e;
+    else fcache_tail = e;
+    fcache_head = e;
+    fcache_count++;
+    *entry = e;
+    return fd;
+}
+
+
+/*
+ Función: file_close
+
+ Suelta el descriptor fd obtenido con file_open.
+ */
+
+void file_close(int fd, struct file_entry *entry) {
+    if (entry) file_release(entry);
+    else close(fd);
+}
+
+
+/*
+ Función: retr_start
+
+ Comienza a enviar por el canal de datos ya abierto de la sesión s el
+ archivo fd (de nombre name, y de la caché si entry no es NULL), desde
+ offset y hasta remaining bytes si es un archivo regular (seekable), o
+ hasta su fin si no lo es. El modo de la sesión decide cómo se copia.
+ */
+
+void retr_start(struct session *s, int fd, struct file_entry *entry, char *name,
+                bool seekable, off_t offset, long remaining) {
+    struct xfer *x = &s->xfer;
+
+    // Los archivos regulares se envían con sendfile; pipes y dispositivos, con splice
+    x->kind = XFER_RETR;
+    x->fd = fd;
+    x->cached = entry;
+    x->seekable = seekable;
+    x->method = x->seekable ? COPY_SENDFILE : COPY_SPLICE;
+    if (s->mode == 'Z') {
+        // Lo que ya viene comprimido se envía en bloques sin comprimir
+        x->method = COPY_ZLIB;
+        x->zlevel = compressed_type(name) ? 0 : s->zlevel;
+    } else if (s->mode == 'B') {
+        x->method = COPY_BLOCK;
+    } else if (x->digest) {
+        // El resumen se calcula sobre los datos, que deben pasar por el buffer
+        x->method = COPY_BUFFER;
+    }
+    // Sin splice, la lectura de un pipe vacío no debe bloquear al proceso
+    if (s->mode != 'S' && !x->seekable && !s->blocking) set_nonblocking(fd);
+    x->offset = offset;
+    x->remaining = x->seekable ? remaining : -1;
+    // Solo los archivos que no se envían en un par de pasos justifican leer por adelantado
+    x->ra_end = -1;
+    if (x->seekable && remaining > XFER_CHUNK) {
+        posix_fadvise(fd, offset, remaining, POSIX_FADV_SEQUENTIAL);
+        x->ra_end = offset;
+        xfer_readahead(x);
+    }
+    rate_start(s);
+    uring_xfer_init(s);
+    s->state = ST_XFER;
+}
+
+
+/*
+ Función: retr
+
+ Esta función maneja el comando RETR (retrieve) para enviar un archivo al cliente.
+ Abre el archivo (file_path), informa su tamaño con la respuesta 299 y se conecta
+ al canal de datos negociado con PORT o PASV, igual que stor. Si antes se recibió REST,
+ el envío comienza en ese desplazamiento; con RANG se envía solo ese rango de bytes. En MODE Z se
+ comprimen con deflate (el tamaño informado es el del archivo). Los datos viajan por esa
+ conexión (ver retr_step); al cerrarla se envía 226, así el cliente sabe dónde
+ termina el archivo sin depender de demoras.
+Se declaran:
+    - fd, el descriptor del archivo que se enviará al cliente.
+    - st, con el tipo y el tamaño del archivo.
+    - entry, la entrada de la caché de archivos abiertos (ver file_open).
+ */
+
+void retr(struct session *s, char *file_path) {
+    struct file_entry *entry;
+    struct stat st;
+    off_t rest = s->rest, end = s->rest_end;
+    int fd;
+
+    // REST y RANG solo valen para la transferencia que les sigue
+    s->rest = 0;
+    s->rest_end = -1;
+
+    if (!s->data_ready && s->bdsd < 0) {
+        send_ans(s, MSG_503);
+        return;
+    }
+
+    // Verificar si el archivo existe abriéndolo en modo lectura; si no, informar error al cliente.
+    // El modo fork no usa la caché: cada proceso atiende una sola sesión
+    fd = file_open(file_path, &st, &entry, !s->blocking);
+    if (fd < 0) {
+        warn("Error opening file");
+        send_ans(s, MSG_550, file_path);
+        return;
+    }
+
+    // Un directorio no se puede enviar
+    if (S_ISDIR(st.st_mode)) {
+        file_close(fd, entry);
+        send_ans(s, MSG_550, file_path);
+        return;
+    }
+
+    // Solo se puede retomar dentro de un archivo regular
+    if ((rest > 0 || end >= 0) && (!S_ISREG(st.st_mode) || rest > st.st_size)) {
+        file_close(fd, entry);
+        send_ans(s, MSG_554);
+        return;
+    }
+    if (end < 0 || end >= st.st_size) end = st.st_size - 1;
+
+    // Abre el canal de datos negociado con PORT o PASV
+    if (!data_open(s)) {
+        file_close(fd, entry);
+        return;
+    }
+
+    // Enviar un mensaje de éxito con el tamaño del archivo
+    send_ans(s, MSG_299, file_path, S_ISREG(st.st_mode) ? (long) st.st_size : 0L);
+    // Con OPTS HASH ... INLINE se calcula el resumen del archivo completo al enviarlo
+    if (s->hash_inline && S_ISREG(st.st_mode) && rest == 0 && end + 1 == st.st_size &&
+        (s->xfer.digest = digest_new(s, s->hash_alg)) != NULL) {
+        s->xfer.digest->st = st;
+    }
+    retr_start(s, fd, entry, file_path, S_ISREG(st.st_mode), rest, end + 1 - rest);
+}
+
+
+/*
+ Función: dir_get
+
+ Devuelve el índice del directorio path: el de la caché, puesto al día con
+ los avisos pendientes, o uno nuevo, que se arma con dir_scan a medida que
+ se lista. Sin inotify, o con use_cache en false (modo fork), el índice es
+ para un solo listado. Se devuelve con dir_put.
+ */
+
+struct dir_index *dir_get(char *path, bool use_cache) {
+    struct dir_index **pp, *d;
+
+    use_cache = use_cache && users_wd >= 0;
+    if (!use_cache) return dir_open(path, false);
+
+    notify_poll();
+    // Un índice que otro listado todavía está armando no sirve
+    for (pp = &dcache; *pp && ((*pp)->dfd >= 0 || strcmp((*pp)->path, path)); pp = &(*pp)->next);
+    if ((d = *pp) != NULL) {
+        // Pasar el índice al frente de la lista
+        *pp = d->next;
+        d->next = dcache;
+        dcache = d;
+        metric_add(&stats->dcache_hits, 1);
+        dir_refresh(d);
+        d->refs++;
+        return d;
+    }
+    metric_add(&stats->dcache_misses, 1);
+
+    // El índice nuevo entra a la caché desde ya, así recibe los avisos mientras se arma
+    if ((d = dir_open(path, true)) == NULL || d->wd < 0) return d;
+    // Hacer lugar descartando el índice usado hace más tiempo
+    if (dcache_count >= DCACHE_SIZE) {
+        for (pp = &dcache; (*pp)->next; pp = &(*pp)->next);
+        dir_drop(pp);
+    }
+    d->next = dcache;
+    dcache = d;
+    dcache_count++;
+    return d;
+}
+
+
+/*
+ Función: list
+
+ Atiende LIST, NLST y MLSD: envía por el canal de datos el contenido del
+ directorio param (o del actual), en el formato fmt. Los datos salen del
+ índice del directorio (ver dir_get), sin volver a leerlo ni consultar cada
+ archivo; si todavía no hay índice, se arma mientras se envía. Las líneas
+ llegan por un pipe (ver list_step) a una transferencia como la de RETR,
+ de modo que vale para todos los modos de transferencia.
+ */
+
+void list(struct session *s, char *param, enum list_format fmt) {
+    char path[PATH_MAX];
+    struct listing *l;
+    struct dir_index *d;
+    int fds[2], n;
+
+    // LIST acepta opciones al estilo de ls ("-l", "-a"), que no cambian nada
+    while (fmt == LIST_LONG && param[0] == '-') {
+        param += strcspn(param, " ");
+        param += strspn(param, " ");
+    }
+    if (!s->data_ready && s->bdsd < 0) {
+        send_ans(s, MSG_503);
+        return;
+    }
+
+    // Una sola forma para cada directorio, que es la clave del índice
+    snprintf(path, sizeof(path), "%s", param[0] ? param : ".");
+    for (n = strlen(path); n > 1 && path[n - 1] == '/'; n--) path[n - 1] = '\0';
+
+    if ((d = dir_get(path, !s->blocking)) == NULL) {
+        send_ans(s, MSG_550, param);
+        return;
+    }
+    if ((l = arena_alloc(&s->arena, sizeof(*l))) == NULL ||
+        (l->dirents = arena_alloc(&s->arena, DIRENT_BUFSIZE)) == NULL ||
+        pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        warn("Error creating file list");
+        dir_put(d);
+        send_ans(s, MSG_550, param);
+        return;
+    }
+    l->dir = d;
+    l->fd = fds[1];
+    l->next = 0;
+    l->fmt = fmt;
+    l->now = time(NULL);
+    l->pos = l->len = 0;
+    snprintf(l->prefix, sizeof(l->prefix), "%s%s", param[0] ? path : "", param[0] && strcmp(path, "/") ? "/" : "");
+
+    if (!data_open(s)) {
+        close(fds[0]);
+        close(fds[1]);
+        dir_put(d);
+        return;
+    }
+    send_ans(s, MSG_150_LIST);
+    retr_start(s, fds[0], NULL, "", false, 0, -1);
+    s->xfer.list = l;
+}
+
+
+/*
+ Función: stor
+
+ Se encarga de preparar la recepción de un archivo enviado por el cliente a través de una conexión de datos.
+ s: sesión del cliente; el canal de datos es el negociado con PORT o PASV.
+ file_data: Los datos del archivo que se van a recibir ("nombre//tamaño", con el tamaño total).
+ Si antes se recibió REST, el archivo se conserva hasta ese desplazamiento y
+ solo se reciben los bytes restantes, que se escriben a partir de él.
+ El espacio del tamaño anunciado se reserva de antemano con fallocate.
+ En MODE Z los datos llegan comprimidos y el tamaño es el del archivo sin
+ comprimir; la transferencia termina con el fin del flujo comprimido.
+ */
+
+void stor(struct session *s, char *file_data) {
+    long f_size;
+    off_t rest = s->rest;
+    int fd;
+    char *file_path, *file_size, *aux;
+
+    // REST solo vale para la transferencia que le sigue; RANG no se aplica a STOR
+    s->rest = 0;
+    s->rest_end = -1;
+
+    if (!s->data_ready && s->bdsd < 0) {
+        send_ans(s, MSG_503);
+        return;
+    }
+
+    // Toma de la arena de la sesión las variables auxiliares que contienen nombre de archivo y su tamaño
+    file_path = arena_alloc(&s->arena, PARSIZE);
+    file_size = arena_alloc(&s->arena, PARSIZE);
+    if (file_path == NULL || file_size == NULL) {
+        send_ans(s, MSG_501);
+        return;
+    }
+
+    // Extrae el nombre del archivo y su tamaño de los datos del archivo
+    aux = strtok(file_data, "//");
+    snprintf(file_path, PARSIZE, "%s", aux ? aux : "");
+    aux = strtok(NULL, "//");
+    snprintf(file_size, PARSIZE, "%s", aux ? aux : "0");
+    f_size = atol(file_size);
+
+    if (rest > f_size) {
+        send_ans(s, MSG_554);
+        return;
+    }
+
+    // Abre el archivo en modo escritura; al retomar se descarta lo posterior a rest
+    fd = open(file_path, O_WRONLY | O_CREAT | O_CLOEXEC | (rest ? 0 : O_TRUNC), 0644);
+    if (fd < 0 || (rest && ftruncate(fd, rest) < 0)) {
+        warn("Error opening file");
+        if (fd >= 0) close(fd);
+        send_ans(s, MSG_550, file_path);
+        return;
+    }
+
+    // Reservar de una vez el tamaño anunciado (sin cambiar el del archivo),
+    // para que no se fragmente ni se asignen bloques en cada escritura
+    if (f_size > rest && fallocate(fd, FALLOC_FL_KEEP_SIZE, rest, f_size - rest) == 0)
+        s->xfer.prealloc = f_size;
+
+    // Abre el canal de datos negociado con PORT o PASV
+    if (!data_open(s)) {
+        s->xfer.prealloc = 0;
+        close(fd);
+        return;
+    }
+
+    // Envía una respuesta al cliente indicando que el servidor está listo para recibir el archivo
+    send_ans(s, MSG_150, file_path, f_size);
+
+    // La recepción en bloques la realiza xfer_step
+    s->xfer.kind = XFER_STOR;
+    s->xfer.fd = fd;
+    s->xfer.offset = rest;
+    s->xfer.remaining = f_size - rest;
+    s->xfer.seekable = true;  // stor_step escribe con pwrite o splice desde offset
+    s->xfer.method = COPY_SPLICE;
+    // Con OPTS HASH ... INLINE se calcula el resumen de lo recibido, sin splice
+    if (s->hash_inline && rest == 0 && (s->xfer.digest = digest_new(s, s->hash_alg)) != NULL)
+        s->xfer.method = COPY_BUFFER;
+    if (s->mode == 'Z') s->xfer.method = COPY_ZLIB;
+    else if (s->mode == 'B') s->xfer.method = COPY_BLOCK;
+    rate_start(s);
+    uring_xfer_init(s);
+    s->state = ST_XFER;
+}
+
+
+/*
+ Función: rest
+
+ Maneja el comando REST: guarda el desplazamiento (en bytes) desde el que
+ la próxima transferencia RETR o STOR debe retomar el archivo.
+ */
+
+void rest(struct session *s, char *offset) {
+    char *end;
+    long value;
+
+    errno = 0;
+    value = strtol(offset, &end, 10);
+    if (offset[0] == '\0' || *end != '\0' || value < 0 || errno) {
+        send_ans(s, MSG_501);
+        return;
+    }
+
+    s->rest = value;
+    s->rest_end = -1;
+    send_ans(s, MSG_350, value);
+}
+
+
+/*
+ Función: rang
+
+ Maneja el comando RANG <inicio> <fin>: como REST, pero la próxima RETR envía
+ solo los bytes del rango [inicio, fin] (ambos incluidos). Permite que un
+ cliente descargue un archivo en segmentos por varias conexiones a la vez.
+ */
+
+void rang(struct session *s, char *range) {
+    long start, end;
+    char extra;
+
+    if (sscanf(range, "%ld %ld %c", &start, &end, &extra) != 2 || start < 0 || end < start) {
+        send_ans(s, MSG_501);
+        return;
+    }
+
+    s->rest = start;
+    s->rest_end = end;
+    send_ans(s, MSG_350_RANG, start, end);
+}
+
+
+/*
+ Función: size
+
+ Maneja el comando SIZE: informa el tamaño de un archivo regular, lo que
+ permite al cliente decidir si retoma una transferencia interrumpida.
+ */
+
+void size(struct session *s, char *file_path) {
+    struct stat st;
+
+    if (stat(file_path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        send_ans(s, MSG_550, file_path);
+        return;
+    }
+    send_ans(s, MSG_213, (long) st.st_size);
+}
+
+
+/*
+ Función: mode
+
+ Atiende MODE: S (stream, sin transformar), Z (comprimido con deflate) o
+ B (bloques, con una conexión de datos que se conserva entre archivos).
+ */
+
+void mode(struct session *s, char *param) {
+    char m = toupper((unsigned char) param[0]);
+
+    if ((m != 'S' && m != 'Z' && m != 'B') || param[1] != '\0') {
+        send_ans(s, MSG_504);
+        return;
+    }
+    // Al dejar MODE B se cierra la conexión de datos que conservaba
+    if (m != 'B') block_close(s);
+    s->mode = m;
+    send_ans(s, MSG_200_MODE, m);
+}
+
+
+/*
+ Función: opts
+
+ Atiende OPTS MODE Z LEVEL n, que fija el nivel de compresión (0 a 9) de
+ las próximas transferencias en MODE Z. Con nivel 0 los datos viajan en
+ bloques de deflate sin comprimir.
+ También OPTS HASH [algoritmo] [INLINE], que elige el algoritmo de HASH
+ (CRC32, CRC32C o SHA-256); con INLINE el resumen de cada archivo completo
+ que se envía o recibe se calcula durante la transferencia. Sin parámetros
+ informa el algoritmo vigente.
+ */
+
+void opts(struct session *s, char *param) {
+    char *end, *word;
+    long level;
+    int alg;
+
+    if (strncasecmp(param, "HASH", 4) == 0 && (param[4] == '\0' || param[4] == ' ')) {
+        word = strtok(param + 4, " ");
+        if (word && strcasecmp(word, "INLINE") != 0) {
+            for (alg = 0; alg < HASH_COUNT && strcasecmp(word, hash_names[alg]) != 0; alg++);
+            if (alg == HASH_COUNT) {
+                send_ans(s, MSG_504);
+                return;
+            }
+            s->hash_alg = alg;
+            s->hash_inline = false;
+            word = strtok(NULL, " ");
+        }
+        if (word && strcasecmp(word, "INLINE") == 0) {
+            s->hash_inline = true;
+            word = strtok(NULL, " ");
+        }
+        if (word) {
+            send_ans(s, MSG_501);
+            return;
+        }
+        send_ans(s, MSG_200_HASH, hash_names[s->hash_alg], s->hash_inline ? " INLINE" : "");
+        return;
+    }
+
+    if (strncasecmp(param, "MODE Z LEVEL ", 13) != 0) {
+        send_ans(s, MSG_501);
+        return;
+    }
+    level = strtol(param + 13, &end, 10);
+    if (end == param + 13 || *end != '\0' || level < 0 || level > 9) {
+        send_ans(s, MSG_501);
+        return;
+    }
+    s->zlevel = level;
+    send_ans(s, MSG_200_LEVEL, s->zlevel);
+}
+
+
+/*
+ Función: digest_start
+
+ Empieza a calcular el resumen alg de los bytes [start, end] del archivo fd
+ (st es su estado actual) para HASH o XCRC (xcrc) de name. El del archivo
+ completo se toma del atributo extendido si sigue vigente y se responde
+ enseguida; si no, el archivo se lee por tramos como una transferencia
+ (XFER_DIGEST, ver digest_step), así un archivo de varios GB no detiene a
+ las demás sesiones, y digest_end responde al terminar.
+ */
+
+void digest_start(struct session *s, int fd, struct stat *st, enum hash_alg alg, off_t start, off_t end,
+                  char *name, bool xcrc) {
+    struct xfer *x = &s->xfer;
+    char hex[DIGEST_HEX];
+
+    if (start == 0 && end + 1 >= st->st_size && digest_load(fd, st, alg, hex)) {
+        metric_add(&stats->digest_hits, 1);
+        if (xcrc) send_ans(s, MSG_250_XCRC, hex);
+        else send_ans(s, MSG_213_HASH, hash_names[alg], (long) start, (long) (end < start ? start : end), hex, name);
+        close(fd);
+        return;
+    }
+    metric_add(&stats->digest_misses, 1);
+
+    x->digest = digest_new(s, alg);
+    x->buffer = arena_alloc(&s->arena, XFER_BUFSIZE);
+    x->name = arena_alloc(&s->arena, strlen(name) + 1);
+    if (x->digest == NULL || x->buffer == NULL || x->name == NULL) {
+        warn("Error allocating buffer");
+        x->fd = fd;
+        xfer_end(s);
+        send_ans(s, MSG_550, name);
+        return;
+    }
+    strcpy(x->name, name);
+    x->digest->st = *st;
+    x->kind = XFER_DIGEST;
+    x->fd = fd;
+    x->seekable = true;
+    x->offset = x->first = start;
+    x->remaining = end + 1 - start;
+    x->xcrc = xcrc;
+    x->ra_end = -1;
+    if (x->remaining > XFER_CHUNK) {
+        posix_fadvise(fd, start, x->remaining, POSIX_FADV_SEQUENTIAL);
+        x->ra_end = start;
+    }
+    s->state = ST_XFER;
+}
+
+
+/*
+ Función: digest_end
+
+ Termina el cálculo de XFER_DIGEST de la sesión s: si se leyó todo el rango
+ (ok) responde con el resumen y, si es el del archivo completo, lo guarda
+ en el atributo extendido; si no, responde 550.
+ */
+
+void digest_end(struct session *s, bool ok) {
+    struct xfer *x = &s->xfer;
+    char hex[DIGEST_HEX];
+
+    metrics_cmd(x->cmd, now_us() - x->start);
+    if (!ok) {
+        send_ans(s, MSG_550, x->name);
+        xfer_end(s);
+        return;
+    }
+    digest_final(x->digest, hex);
+    if (x->first == 0 && x->offset >= x->digest->st.st_size) digest_save(x->fd, &x->digest->st, x->digest->alg, hex);
+    if (x->xcrc) send_ans(s, MSG_250_XCRC, hex);
+    else send_ans(s, MSG_213_HASH, hash_names[x->digest->alg], (long) x->first,
+                  (long) (x->offset > x->first ? x->offset - 1 : x->first), hex, x->name);
+    xfer_end(s);
+}
+
+
+/*
+ Función: hash
+
+ Atiende HASH <archivo>: responde 213 con el algoritmo elegido con OPTS
+ HASH, el rango de bytes, el resumen y el nombre. Como RETR, respeta el
+ rango pedido antes con REST o RANG. Permite verificar una transferencia
+ sin volver a descargar el archivo.
+ */
+
+void hash(struct session *s, char *file_path) {
+    off_t start = s->rest, end = s->rest_end;
+    struct stat st;
+    int fd;
+
+    s->rest = 0;
+    s->rest_end = -1;
+
+    fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        send_ans(s, MSG_550, file_path);
+        return;
+    }
+    if (start > 0 && start >= st.st_size) {
+        close(fd);
+        send_ans(s, MSG_554);
+        return;
+    }
+    if (end < 0 || end >= st.st_size) end = st.st_size - 1;
+
+    digest_start(s, fd, &st, s->hash_alg, start, end, file_path, false);
+}
+
+
+/*
+ Función: parse_offset
+
+ Interpreta text como una posición de archivo: un número decimal no
+ negativo, sin nada más. Devuelve false si no es válido.
+ */
+
+bool parse_offset(const char *text, long *value) {
+    char *end;
+
+    errno = 0;
+    *value = strtol(text, &end, 10);
+    return isdigit((unsigned char) text[0]) && *end == '\0' && errno == 0;
+}
+
+
+/*
+ Función: xcrc
+
+ Atiende XCRC <archivo> [inicio [fin]]: responde 250 con el CRC-32 de los
+ bytes [inicio, fin] del archivo (por defecto, el archivo completo). Los
+ límites deben ser números no negativos; si no, responde 501.
+ */
+
+void xcrc(struct session *s, char *param) {
+    char *file_path, *arg;
+    long start = 0, end = -1;
+    struct stat st;
+    int fd;
+
+    file_path = strtok(param, " ");
+    if (file_path == NULL ||
+        ((arg = strtok(NULL, " ")) != NULL && !parse_offset(arg, &start)) ||
+        (arg != NULL && (arg = strtok(NULL, " ")) != NULL && !parse_offset(arg, &end)) ||
+        (arg != NULL && strtok(NULL, " ") != NULL)) {
+        send_ans(s, MSG_501);
+        return;
+    }
+
+    fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        send_ans(s, MSG_550, file_path);
+        return;
+    }
+    if (start < 0 || (start > 0 && start >= st.st_size) || (end >= 0 && end < start)) {
+        close(fd);
+        send_ans(s, MSG_554);
+        return;
+    }
+    if (end < 0 || end >= st.st_size) end = st.st_size - 1;
+
+    digest_start(s, fd, &st, HASH_CRC32, start, end, file_path, true);
+}
+
+
+/*
+ Función: status
+
+ Responde a STAT (sin argumentos) y SITE METRICS con un resumen de las
+ métricas del servidor, una línea de respuesta 211 por cada línea de texto.
+ La respuesta completa cabe en la cola de salida (ver OUTSIZE), que
+ session_run deja con a lo sumo BUFSIZE bytes antes de cada comando.
+ */
+
+void status(struct session *s) {
+    char text[STAT_LINES * STAT_LINE], *line, *save;
+
+    metrics_format(text, sizeof(text), false);
+    send_ans(s, MSG_211, '-', "srvFtp metrics");
+    for (line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        send_ans(s, MSG_211, '-', line);
+    }
+    send_ans(s, MSG_211, ' ', "End of status");
+}
+
+
+/*
+ Función: dispatch
+
+ Procesa un comando de una sesión ya autenticada.
+ Soporta los comandos RETR (recuperar archivo), STOR (almacenar archivo),
+ NLST, LIST y MLSD (listados de directorio), HASH y XCRC (resumen de un archivo),
+ PORT y PASV (canal de datos), REST y RANG (retomar o acotar la transferencia),
+ SIZE (tamaño de archivo), MODE y OPTS (modo del canal de datos),
+ STAT y SITE METRICS (métricas del servidor) y QUIT (cerrar conexión).
+ */
+
+void dispatch(struct session *s, char *op, char *param) {
+    //Si el comando recibido es "RETR", se llama a la función retr para manejar
+    // la operación de recuperar un archivo
+    if (strcmp(op, "RETR") == 0) {
+        retr(s, param);
+    } else if (strcmp(op, "STOR") == 0) {
+        stor(s, param);
+    } else if (strcmp(op, "PORT") == 0) {
+        port(s, param);
+    } else if (strcmp(op, "PASV") == 0) {
+        pasv(s);
+    } else if (strcmp(op, "REST") == 0) {
+        rest(s, param);
+    } else if (strcmp(op, "RANG") == 0) {
+        rang(s, param);
+    } else if (strcmp(op, "SIZE") == 0) {
+        size(s, param);
+    } else if (strcmp(op, "NLST") == 0) {
+        list(s, param, LIST_NAMES);
+    } else if (strcmp(op, "LIST") == 0) {
+        list(s, param, LIST_LONG);
+    } else if (strcmp(op, "MLSD") == 0) {
+        list(s, param, LIST_MLSD);
+    } else if (strcmp(op, "MODE") == 0) {
+        mode(s, param);
+    } else if (strcmp(op, "OPTS") == 0) {
+        opts(s, param);
+    } else if (strcmp(op, "HASH") == 0) {
+        hash(s, param);
+    } else if (strcmp(op, "XCRC") == 0) {
+        xcrc(s, param);
+    } else if ((strcmp(op, "STAT") == 0 && param[0] == '\0') ||
+               (strcmp(op, "SITE") == 0 && strcasecmp(param, "METRICS") == 0)) {
+        status(s);
+    } else if (strcmp(op, "QUIT") == 0) {
+        // Enviar mensaje de despedida y cerrar la conexión
+        send_ans(s, MSG_221);
+        s->state = ST_CLOSE;
+    } else {
+        send_ans(s, MSG_502);
+    }
+}
+
+
+/*
+ Función: session_new
+
+ Crea la sesión para el socket de control sd, conectado con el cliente peer
+ (ya admitido con conn_admit), y envía el saludo al cliente. blocking indica
+ si la sesión se atiende con E/S bloqueante (modo fork).
+ */
+
+struct session *session_new(int sd, struct sockaddr_in *peer, bool blocking) {
+    struct session *s = mem_calloc(1, sizeof(*s));
+    int optval = 1;
+
+    if (s == NULL) return NULL;
+
+    // Las respuestas son cortas y no deben esperar al ACK de la anterior (Nagle)
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    s->peer = *peer;
+    s->sd = sd;
+    s->blocking = blocking;
+    s->state = ST_USER;
+    s->rest_end = -1;
+    s->zlevel = zlevel_default;
+    s->hash_alg = HASH_SHA256;
+    s->mode = 'S';
+    s->bdsd = -1;
+    s->xfer.fd = s->xfer.dsd = -1;
+    s->xfer.pipe[0] = s->xfer.pipe[1] = -1;
+    s->xfer.arena = &s->arena;
+    s->created = s->active = now_us();
+    __atomic_fetch_add(&stats->sessions_active, 1, __ATOMIC_RELAXED);
+    metric_add(&stats->sessions_total, 1);
+
+    if (!blocking) {
+        s->next = sessions;
+        if (sessions) sessions->prev = s;
+        sessions = s;
+        fdmap[sd] = s;
+    }
+
+    // Enviar saludo al cliente
+    send_ans(s, MSG_220);
+    return s;
+}
+
+
+/*
+ Función: session_free
+
+ Cierra el socket de control y libera la sesión s junto con su transferencia.
+ */
+
+void session_free(struct session *s) {
+    // Una transferencia interrumpida por el cierre de la sesión cuenta como fallida
+    if (s->xfer.kind == XFER_RETR || s->xfer.kind == XFER_STOR) metrics_xfer(s, false);
+    xfer_end(s);
+    block_close(s);
+    pasv_release(s);
+    if (!s->blocking) {
+        if (s->prev) s->prev->next = s->next;
+        else sessions = s->next;
+        if (s->next) s->next->prev = s->prev;
+        watch(s->sd, 0, &s->events);
+        fdmap[s->sd] = NULL;
+    }
+    close(s->sd);
+    conn_release(&s->peer);
+    arena_free(&s->arena);
+    EVP_MD_CTX_free(s->md);
+    free(s);
+    __atomic_fetch_sub(&stats->sessions_active, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ Función: session_check
+
+ Libera la sesión s si terminó y ya envió todas sus respuestas. En modo uring
+ hay que esperar antes a que el kernel complete sus operaciones en curso,
+ que se interrumpen cerrando la conexión.
+ */
+
+void session_check(struct session *s) {
+    if (s->state != ST_CLOSE || s->out_len > 0) return;
+    if (s->uring_ops > 0) {
+        shutdown(s->sd, SHUT_RDWR);
+        if (s->xfer.dsd >= 0) shutdown(s->xfer.dsd, SHUT_RDWR);
+        return;
+    }
+    session_free(s);
+}
+
+
+/*
+ Función: session_eof
+
+ El cliente cerró la conexión o ocurrió un error al leer de ella.
+ */
+
+void session_eof(struct session *s, bool error) {
+    if (error) warnx("Error reading buffer");
+    else warnx("Empty buffer");
+
+    // Si la sesión estaba en el bucle de comandos, se despide como antes
+    if (s->state == ST_CMD) send_ans(s, MSG_221);
+    s->state = ST_CLOSE;
+}
+
+
+/*
+ Función: session_deadline
+
+ Devuelve el instante (us) en que vence la sesión s según los límites de -T,
+ o 0 si no tiene límite: el de inicio de sesión corre desde la conexión
+ hasta completar PASS y el de inactividad desde el último avance.
+ */
+
+uint64_t session_deadline(struct session *s) {
+    uint64_t idle = idle_timeout ? s->active + idle_timeout * 1000000ULL : 0, login;
+
+    if ((s->state != ST_USER && s->state != ST_PASS) || login_timeout == 0) return idle;
+    login = s->created + login_timeout * 1000000ULL;
+    return idle && idle < login ? idle : login;
+}
+
+
+/*
+ Función: timeout_handler
+
+ Manejador de SIGALRM del modo fork: la sesión del proceso hijo venció. Se
+ despide con 421 sin esperar (el cliente puede no estar leyendo), descuenta
+ la sesión y termina el proceso; el kernel cierra sus archivos y sockets.
+ */
+
+void timeout_handler(int sig) {
+    struct session *s = alarm_session;
+
+    (void) sig;
+    send(s->sd, MSG_421_TIMEOUT, sizeof(MSG_421_TIMEOUT) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    metric_add(&stats->sessions_timeout, 1);
+    if (s->xfer.kind == XFER_RETR || s->xfer.kind == XFER_STOR) metric_add(&stats->xfers_failed, 1);
+    __atomic_fetch_sub(&stats->sessions_active, 1, __ATOMIC_RELAXED);
+    conn_release(&s->peer);
+    _exit(0);
+}
+
+
+/*
+ Función: session_alarm
+
+ Modo fork: la sesión s acaba de avanzar; programa SIGALRM para cuando
+ venza si no vuelve a hacerlo (ver timeout_handler).
+ */
+
+void session_alarm(struct session *s) {
+    uint64_t deadline, now;
+
+    if (idle_timeout == 0 && login_timeout == 0) return;
+    now = s->active = now_us();
+    deadline = session_deadline(s);
+    if (deadline == 0) alarm(0);
+    else alarm(deadline > now ? (deadline - now + 999999) / 1000000 : 1);
+}
+
+
+/*
+ Función: uring_session
+
+ Modo uring: envía al kernel las operaciones que necesita la sesión s según
+ su estado. Las respuestas pendientes se envían con SEND y los comandos se
+ reciben con RECV directamente en el espacio libre del buffer circular; como
+ en modo epoll, durante una transferencia no se leen comandos nuevos.
+ */
+
+void uring_session(struct session *s) {
+    struct xfer *x = &s->xfer;
+    struct io_uring_sqe *sqe;
+    unsigned int space, tail;
+
+    if (s->out_len > 0 && s->uring_send == 0) {
+        sqe = uring_sqe(s, U_SEND);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = s->sd;
+        sqe->addr = (uintptr_t) s->out;
+        sqe->len = s->out_len;
+        s->uring_send = s->out_len;
+    }
+
+    space = INSIZE - (s->in.tail - s->in.head);
+    if (!s->uring_recv && s->state != ST_CLOSE && s->state != ST_XFER && space > 0) {
+        tail = s->in.tail & (INSIZE - 1);
+        sqe = uring_sqe(s, U_RECV);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = s->sd;
+        sqe->addr = (uintptr_t) (s->in.data + tail);
+        sqe->len = INSIZE - tail < space ? INSIZE - tail : space;
+        s->uring_recv = true;
+    }
+
+    if (s->state != ST_XFER) return;
+    if (x->method != COPY_URING || x->connecting || x->accepting) {
+        xfer_events(s);
+        return;
+    }
+    // Conexión de datos establecida: desde aquí la transferencia no usa epoll
+    if (x->events) {
+        watch(x->dsd, 0, &x->events);
+        fdmap[x->dsd] = NULL;
+    }
+    if (x->ubusy == 0 && x->ustatus == XFER_WAIT) uring_xfer_next(s);
+}
+
+
+/*
+ Función: session_run
+
+ Hace avanzar la máquina de estados de la sesión s: procesa los comandos
+ completos que haya en el buffer de entrada y las transferencias en curso,
+ hasta que necesite más datos del cliente o que un socket esté listo.
+ */
+
+void session_run(struct session *s) {
+    char op[CMDSIZE], param[PARSIZE];
+    int burst = 0, r;
+    enum cmd_id cmd;
+    uint64_t start;
+
+    while (s->state != ST_CLOSE) {
+        if (s->state == ST_XFER) {
+            r = xfer_step(s);
+            if (r == XFER_MORE) {
+                // En modo fork cada bloque transferido aleja el vencimiento
+                if (s->blocking) {
+                    session_alarm(s);
+                } else if (++burst >= XFER_BURST) {
+                    // En modo epoll se cede el turno a las demás sesiones periódicamente
+                    if (s->xfer.kind == XFER_DIGEST || (s->xfer.list && s->xfer.list->fd >= 0)) session_yield(s);
+                    break;
+                }
+                continue;
+            }
+            if (r == XFER_WAIT) break;
+            if (s->xfer.kind == XFER_DIGEST) {
+                digest_end(s, r == XFER_DONE);
+                continue;
+            }
+            metrics_xfer(s, r == XFER_DONE);
+            if (r == XFER_DONE) {
+                digest_xfer(&s->xfer);
+                xfer_end(s);
+                // Enviar un mensaje de transferencia completada
+                send_ans(s, MSG_226);
+            } else {
+                xfer_end(s);
+                send_ans(s, MSG_426);
+            }
+            continue;
+        }
+
+        // No procesar más comandos mientras haya muchas respuestas sin enviar
+        if (s->out_len > BUFSIZE) break;
+
+        r = recv_cmd(s, op, param);
+        if (r == 0) break;
+        if (r < 0) {
+            // Comando inválido: se informa y se sale
+            if (s->state == ST_CMD) send_ans(s, MSG_221);
+            s->state = ST_CLOSE;
+            break;
+        }
+
+        // Lo que reservó el comando anterior (y su transferencia) ya no se usa
+        arena_reset(&s->arena);
+        start = now_us();
+        cmd = cmd_index(op);
+        if (s->state == ST_USER || s->state == ST_PASS) authenticate(s, op, param);
+        else dispatch(s, op, param);
+
+        // La latencia de RETR y STOR se mide hasta el fin de la transferencia
+        if (s->state == ST_XFER) {
+            s->xfer.cmd = cmd;
+            s->xfer.start = start;
+        } else {
+            metrics_cmd(cmd, now_us() - start);
+        }
+    }
+
+    if (s->blocking) return;
+    if (s->uring) {
+        uring_session(s);
+        return;
+    }
+
+    // Actualizar el interés de epoll según el estado de la sesión
+    uint32_t ev = 0;
+    if (s->state != ST_CLOSE && s->state != ST_XFER && s->in.tail - s->in.head < INSIZE) ev |= EPOLLIN;
+    if (s->out_len > 0) ev |= EPOLLOUT;
+    watch(s->sd, ev, &s->events);
+    if (s->state == ST_XFER) xfer_events(s);
+}
+
+
+/*
+ Función: session_read
+
+ Lee del socket de control de la sesión s todo lo que haya disponible
+ (sin bloquear en modo epoll) y lo agrega al buffer de entrada.
+ */
+
+void session_read(struct session *s) {
+    ssize_t recv_s;
+
+    while (s->in.tail - s->in.head < INSIZE) {
+        recv_s = ring_read(&s->in, s->sd);
+        if (recv_s < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            session_eof(s, true);
+            return;
+        }
+        if (recv_s == 0) {
+            session_eof(s, false);
+            return;
+        }
+        if (s->blocking) return;
+    }
+}
+
+
+/*
+ Función: session_timeout
+
+ Modos epoll y uring: la sesión s venció. Se despide con 421 y se cierra en
+ cuanto se envíe la respuesta; si el cliente no la lee, timeout_check corta
+ la conexión en la revisión siguiente.
+ */
+
+void session_timeout(struct session *s) {
+    if (s->state != ST_CLOSE) {
+        send_ans(s, MSG_421_TIMEOUT);
+        s->state = ST_CLOSE;
+        metric_add(&stats->sessions_timeout, 1);
+    }
+    s->timed_out = true;
+    session_run(s);
+    session_check(s);
+}
+
+
+/*
+ Función: timeout_check
+
+ Cada TIMEOUT_TICK s revisa las sesiones: una sesión avanzó si recibió
+ comandos o movió bytes de su transferencia desde la revisión anterior;
+ las que no lo hacen antes de su vencimiento se cierran con session_timeout.
+ */
+
+void timeout_check(void) {
+    struct session *s, *next;
+    uint64_t now = now_us(), progress, deadline, ticks;
+
+    if (read(timeout_fd, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN) warn("Error reading timeout timer");
+    for (s = sessions; s; s = next) {
+        next = s->next;
+        if (s->timed_out) {
+            // No leyó el 421: se corta sin esperar (en uring, al completar el envío)
+            shutdown(s->sd, SHUT_RDWR);
+            if (!s->uring) s->out_len = 0;
+            session_check(s);
+            continue;
+        }
+        progress = s->in.tail + s->xfer.bytes;
+        if (progress != s->progress) {
+            s->progress = progress;
+            s->active = now;
+            continue;
+        }
+        deadline = session_deadline(s);
+        if (deadline && now >= deadline) session_timeout(s);
+    }
+}
+
+
+/*
+ Función: operate
+
+Maneja una sesión completa en modo fork: el proceso hijo atiende al cliente
+con E/S bloqueante, desde el saludo hasta el cierre de la conexión.
+sd: descriptor de socket para comunicarse con el cliente
+peer: dirección del cliente
+ */
+
+void operate(int sd, struct sockaddr_in *peer) {
+    struct session *s = session_new(sd, peer, true);
+
+    if (s == NULL) {
+        conn_release(peer);
+        close(sd);
+        return;
+    }
+
+    // Los vencimientos de -T se controlan con SIGALRM antes de cada espera
+    alarm_session = s;
+    signal(SIGALRM, timeout_handler);
+    while (true) {
+        session_run(s);
+        if (s->state == ST_CLOSE) break;
+        session_alarm(s);
+        session_read(s);
+    }
+    alarm(0);
+
+    session_free(s);
+}
+
+
+/*
+ Función: accept_all
+
+ Acepta todas las conexiones pendientes en el socket maestro y crea una sesión
+ no bloqueante para cada una.
+ */
+
+void accept_all(int master_sd) {
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+    struct session *s;
+    int slave_sd;
+
+    while (true) {
+        addr_len = sizeof(addr);
+        slave_sd = accept4(master_sd, (struct sockaddr *) &addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (slave_sd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) warn("Error accepting connection");
+            return;
+        }
+        // Rechazar antes de crear la sesión: una avalancha de conexiones no consume memoria
+        if (!conn_admit(&addr)) {
+            conn_reject(slave_sd);
+            continue;
+        }
+        if (slave_sd >= fdmap_size || (s = session_new(slave_sd, &addr, false)) == NULL) {
+            warnx("Too many sessions");
+            conn_release(&addr);
+            conn_reject(slave_sd);
+            continue;
+        }
+        session_run(s);
+        session_check(s);
+    }
+}
+
+
+/*
+ Función: stats_open
+
+ Crea el socket Unix de estadísticas en path, reemplazando uno anterior.
+ */
+
+int stats_open(char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int sd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) errx(1, "Stats socket path too long");
+    strcpy(addr.sun_path, path);
+    if ((sd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        err(1, "Error creating stats socket");
+    }
+    unlink(path);
+    if (bind(sd, (struct sockaddr *) &addr, sizeof(addr)) < 0) err(1, "Error binding stats socket");
+    if (listen(sd, 16) < 0) err(1, "Error listening on stats socket");
+    return sd;
+}
+
+
+/*
+ Función: stats_serve
+
+ Atiende las conexiones pendientes del socket de estadísticas: a cada una le
+ escribe las métricas detalladas y la cierra. Todos los procesos escuchan en
+ el mismo socket y cualquiera puede responder, porque los contadores son
+ compartidos.
+ */
+
+void stats_serve(void) {
+    static char text[STATSIZE];
+    size_t len;
+    int sd;
+
+    while ((sd = accept4(stats_sd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        len = metrics_format(text, sizeof(text), true);
+        if (write(sd, text, len) < 0) warn("Error writing stats");
+        close(sd);
+    }
+}
+
+
+/*
+ Función: rate_order
+
+ Orden de qsort para rate_wake: primero las transferencias que movieron menos bytes.
+ */
+
+int rate_order(const void *a, const void *b) {
+    long x = (*(struct session **) a)->xfer.bytes, y = (*(struct session **) b)->xfer.bytes;
+
+    return (x > y) - (x < y);
+}
+
+
+/*
+ Función: rate_wake
+
+ Cada RATE_TICK ms retoma las transferencias frenadas por el límite de
+ ancho de banda, empezando por las que llevan menos bytes: con poco
+ crédito, un archivo chico termina enseguida en lugar de esperar turno
+ detrás de uno de varios GB. Las que siguen sin crédito vuelven a frenarse.
+ La lista sólo crece, así que en régimen estable no se pide memoria.
+ */
+
+void rate_wake(void) {
+    static struct session **list;
+    static int cap;
+    struct itimerspec off = { { 0, 0 }, { 0, 0 } };
+    struct session *s, **grown;
+    uint64_t ticks;
+    int n = 0, i;
+
+    if (read(rate_fd, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN) warn("Error reading rate timer");
+    if (throttled > cap && (grown = mem_realloc(list, throttled * sizeof(*list))) != NULL) {
+        list = grown;
+        cap = throttled;
+    }
+    if (throttled > 0 && throttled <= cap) {
+        for (s = sessions; s && n < throttled; s = s->next) {
+            if (s->xfer.throttled) list[n++] = s;
+        }
+        qsort(list, n, sizeof(*list), rate_order);
+        for (i = 0; i < n; i++) {
+            list[i]->xfer.throttled = false;
+            throttled--;
+        }
+        for (i = 0; i < n; i++) {
+            session_run(list[i]);
+            session_check(list[i]);
+        }
+    }
+    if (throttled == 0) timerfd_settime(rate_fd, 0, &off, NULL);
+}
+
+
+/*
+ Función: work_resume
 
-    // Cerrar el archivo
-    fclose(file);
+ Retoma las sesiones que cedieron el turno con session_yield, un turno para
+ cada una; las que vuelven a agotarlo quedan para la próxima vuelta. work_fd
+ sigue listo mientras quede alguna.
+ */
+
+void work_resume(void) {
+    struct session *s, *next;
+    uint64_t count;
+    int n = yielded;
 
-    // Enviar un mensaje de transferencia completada
-    send_ans(sd, MSG_226);
+    for (s = sessions; s && n > 0; s = next) {
+        next = s->next;
+        if (!s->xfer.yielded) continue;
+        s->xfer.yielded = false;
+        yielded--;
+        n--;
+        session_run(s);
+        session_check(s);
+    }
+    if (yielded == 0 && read(work_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        warn("Error reading work event");
 }
 
 
 /*
-Función: check_credentials
+ Función: upgrade_handler
 
-Esta función verifica las credenciales de usuario y contraseña proporcionadas. 
-Busca la combinación de usuario y contraseña en un archivo llamado "ftpusers". 
-Toma las cadenas de caracteres user y pass que representan el nombre de usuario 
-y la contraseña a verificar. 
-Devuelve true si las credenciales son válidas, y false en caso contrario.
+ Manejador de SIGUSR2: pide pasar el socket de escucha a un binario nuevo
+ y terminar con las sesiones en curso (ver upgrade_check).
  */
 
-bool check_credentials(char *user, char *pass) {
-    FILE *file;
-    char *path = "./ftpusers", *line = NULL, credentials[100];
-    size_t line_size = 0;
-    bool found = false;
+void upgrade_handler(int sig) {
+    (void) sig;
+    upgrading = 1;
+}
 
-    // Crear la cadena de credenciales
-    sprintf(credentials, "%s:%s", user, pass);
 
-    // Verificar si el archivo "ftpusers" está presente abriéndolo en modo lectura
-    if ((file = fopen(path, "r")) == NULL) {
-        warn("Error opening %s", path);
-        return false;
-    }
+/*
+ Función: upgrade_init
 
-    // Buscar la cadena de credenciales línea por línea. Se lee cada línea y se 
-    // compara con la cadena de credenciales
-    while (getline(&line, &line_size, file) != -1) {
-        strtok(line, "\n");
-        if (strcmp(line, credentials) == 0) {
-            found = true;
-            break;
-        }
-    }
+ Instala el manejador de SIGUSR2 y deja la señal bloqueada salvo durante
+ las esperas (epoll_pwait, ppoll, io_uring_enter), así nunca llega entre
+ la consulta de upgrading y la espera.
+ */
 
-    // Cerrar el archivo y liberar cualquier puntero necesario
-    fclose(file);
-    if (line) free(line);
+void upgrade_init(void) {
+    struct sigaction sa = { .sa_handler = upgrade_handler };
+    sigset_t block;
 
-    // Devolver el estado de búsqueda
-    return found;
+    sigaction(SIGUSR2, &sa, NULL);
+    sigemptyset(&block);
+    sigaddset(&block, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &block, &wait_mask);
+    sigdelset(&wait_mask, SIGUSR2);
 }
 
 
 /*
- Función: authenticate
- 
-Esta función se encarga de autenticar al cliente verificando las credenciales proporcionadas. 
-Espera recibir los comandos USER y PASS del cliente y los verifica. 
-Toma el descriptor de socket sd para comunicarse con el cliente. 
-Devuelve true si la autenticación es exitosa, y false en caso contrario.
-*/
+ Función: upgrade_exec
 
-bool authenticate(int sd) {
-    char user[PARSIZE], pass[PARSIZE];
-
-    // Esperar a recibir el comando USER
-    if (!recv_cmd(sd, "USER", user)) return false;
+ Lanza el binario nuevo (con el mismo camino y argumentos que este) y le
+ pasa abiertos los n sockets de escucha fds, que encuentra en la variable
+ de entorno LISTEN_ENV. Un proceso intermedio evita que el nuevo quede como
+ hijo de este. Devuelve true si el exec tuvo éxito; si no, este proceso
+ sigue atendiendo como antes.
+ */
 
-    // Solicitar contraseña
-    send_ans(sd, MSG_331, user);
+bool upgrade_exec(int *fds, int n) {
+    char list[MAX_WORKERS * 12];
+    int ready[2], error = 0, i;
+    size_t len = 0;
+    sigset_t unblock;
+    ssize_t r;
+    pid_t pid;
 
-    // Esperar a recibir el comando PASS
-    if (!recv_cmd(sd, "PASS", pass)) return false;
+    for (i = 0; i < n && len < sizeof(list); i++) len += snprintf(list + len, sizeof(list) - len, i ? ",%d" : "%d", fds[i]);
 
-    // Si las credenciales no son válidas, denegar el inicio de sesión
-    if (!check_credentials(user, pass)) {
-        send_ans(sd, MSG_530);
+    // El pipe se cierra solo con el exec; si falla, el hijo escribe errno
+    if (pipe2(ready, O_CLOEXEC) < 0) {
+        warn("Error creating pipe");
+        return false;
+    }
+    pid = fork();
+    if (pid == 0) {
+        close(ready[0]);
+        // El proceso intermedio termina enseguida y el nuevo queda huérfano
+        if ((pid = fork()) > 0) _exit(0);
+        if (pid < 0) {
+            error = errno;
+            r = write(ready[1], &error, sizeof(error));
+            _exit(r < 0 ? 2 : 1);
+        }
+        for (i = 0; i < n; i++) fcntl(fds[i], F_SETFD, 0);
+        setenv(LISTEN_ENV, list, 1);
+        // La máscara de señales se hereda en el exec
+        sigemptyset(&unblock);
+        sigaddset(&unblock, SIGUSR2);
+        sigprocmask(SIG_UNBLOCK, &unblock, NULL);
+        execvp(exec_argv[0], exec_argv);
+        error = errno;
+        r = write(ready[1], &error, sizeof(error));
+        _exit(r < 0 ? 126 : 127);
+    }
+    close(ready[1]);
+    if (pid < 0) {
+        warn("Error creating process");
+        close(ready[0]);
+        return false;
+    }
+    waitpid(pid, NULL, 0);
+    while ((r = read(ready[0], &error, sizeof(error))) < 0 && errno == EINTR);
+    close(ready[0]);
+    if (r > 0) {
+        errno = error;
+        warn("Cannot execute %s", exec_argv[0]);
         return false;
     }
-
-    // Confirmar inicio de sesión
-    send_ans(sd, MSG_230);
     return true;
 }
 
 
 /*
- Función: operate
+ Función: upgrade_check
 
-Maneja la operación principal del servidor FTP. 
-Espera recibir comandos del cliente y los procesa en un bucle infinito. 
-Soporta los comandos RETR (recuperar archivo) y QUIT (cerrar conexión).
-sd: descriptor de socket para comunicarse con el cliente
+ Atiende un SIGUSR2 recibido: salvo en los procesos del modo prefork, cuyo
+ padre ya lanzó el binario nuevo, le pasa el socket de escucha master_sd.
+ Devuelve true si desde ahora el proceso debe dejar de aceptar conexiones
+ y terminar cuando se cierre la última sesión (draining).
  */
 
-void operate(int sd) {
-    // Almacenar el comando y los parámetros enviados por el cliente
-    char op[CMDSIZE], param[PARSIZE];
+bool upgrade_check(int master_sd) {
+    if (!upgrading) return false;
+    upgrading = 0;
+    if (draining || master_sd < 0) return false;
+    if (!worker && !upgrade_exec(&master_sd, 1)) return false;
+    draining = true;
+    warnx("Listening socket handed over, exiting after the active sessions");
+    return true;
+}
 
-    while (true) {
-        op[0] = param[0] = '\0';
 
-        // Verificar si se reciben comandos del cliente mediante recv_cmd; 
-        // si no mediante send_ans, se informa y se sale
-        if (!recv_cmd(sd, op, param)) {
-            send_ans(sd, MSG_221);
-            break;
-        }
+/*
+ Función: engine_init
 
-        //Si el comando recibido es "RETR", se llama a la función retr para manejar 
-        // la operación de recuperar un archivo 
-        if (strcmp(op, "RETR") == 0) {
-            retr(sd, param);
-        } else (strcmp(op, "QUIT") == 0); {
-            // Enviar mensaje de despedida y cerrar la conexión
-            send_ans(sd, MSG_221);
-            close(sd);
-            break;
-        } 
+ Prepara el estado común de los motores epoll y uring: la tabla de
+ descriptores, la instancia de epoll y el pool de sockets pasivos.
+ */
+
+void engine_init(void) {
+    struct rlimit rl;
+    uint32_t notify_events = 0, stats_events = 0, rate_events = 0, timeout_events = 0, work_events = 0;
+    struct itimerspec tick = { { TIMEOUT_TICK, 0 }, { TIMEOUT_TICK, 0 } };
+
+    // Aprovechar el máximo de descriptores permitido
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
     }
+    fdmap_size = (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) ? rl.rlim_cur : 65536;
+    if ((fdmap = mem_calloc(fdmap_size, sizeof(*fdmap))) == NULL) err(1, "Error allocating sessions");
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) err(1, "Error creating epoll");
+    upgrade_init();
+    if (inotify_fd >= 0) watch(inotify_fd, EPOLLIN, &notify_events);
+    if (stats_sd >= 0) watch(stats_sd, EPOLLIN, &stats_events);
+    // Temporizador de los límites de ancho de banda, armado solo mientras haya transferencias frenadas
+    if ((rate_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        err(1, "Error creating rate timer");
+    watch(rate_fd, EPOLLIN, &rate_events);
+    // Aviso de las sesiones que cedieron el turno sin un descriptor que esperar
+    if ((work_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) err(1, "Error creating work event");
+    watch(work_fd, EPOLLIN, &work_events);
+    // Revisión periódica de las sesiones inactivas (-T)
+    if (idle_timeout || login_timeout) {
+        if ((timeout_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ||
+            timerfd_settime(timeout_fd, 0, &tick, NULL) < 0)
+            err(1, "Error creating timeout timer");
+        watch(timeout_fd, EPOLLIN, &timeout_events);
+    }
+
+    // Los sockets pasivos se crean una sola vez y se reutilizan entre sesiones
+    if (!pasv_init(true)) exit(1);
 }
 
 
 /*
-Funcion: port
- 
-Se encarga de extraer la dirección IP y el puerto de los datos del socket enviados 
-por el cliente durante el comando PORT y construye una estructura sockaddr_in
-que representa esa dirección y puerto. Esta estructura se utilizará más adelante 
-para establecer la conexión de datos entre el cliente y el servidor FTP.
-*/
-
-// addr de tipo struct sockaddr_in se utilizará para almacenar la dirección IP y el puerto extraídos.
-// Se asigna memoria dinámicamente para las variables ip, aux1 y aux2. 
+ Función: epoll_events
 
-struct sockaddr_in port(int sd, char *socketdata){
-    struct sockaddr_in addr;
-    int puerto, i, j, count;
-    char *ip, *aux1, *aux2;
-    ip = (char*)malloc(30*sizeof(char));
-    aux1 = (char*)malloc(4*sizeof(char));
-    aux2 = (char*)malloc(4*sizeof(char));
+ Espera hasta timeout milisegundos los eventos de epoll y los atiende.
+ master_sd es el socket de escucha (-1 si las conexiones se aceptan de otro modo).
+ */
 
-    i = j = 0;
-    count=0;
+void epoll_events(int master_sd, int timeout) {
+    struct epoll_event events[MAX_EVENTS];
+    struct session *s;
+    int n, i, fd;
 
-    // Se inicia un bucle para extraer la dirección IP y el puerto de los datos 
-    // del socket enviados por el cliente que verificará si el carácter actual es una coma (','). 
-    // Si es así, se incrementa el contador count.
-    while(true){
-        if (*(socketdata+i) == ',') count++;
+    n = epoll_pwait(epfd, events, MAX_EVENTS, timeout, &wait_mask);
+    if (n < 0) {
+        if (errno == EINTR) return;
+        err(1, "Error waiting for events");
+    }
 
-        if (count<=3){
-            *(ip+j) = *(socketdata+i);
-            if (*(ip+j) == ',') *(ip+j) = '.';
-            j++;
+    for (i = 0; i < n; i++) {
+        fd = events[i].data.fd;
+        if (fd == master_sd) {
+            accept_all(master_sd);
+            continue;
         }
-        if (*(socketdata+i) == ',' && count==4){
-            *(ip+j) = '\0';
-            j=0;
-            i++;
+        if (fd == inotify_fd) {
+            notify_poll();
             continue;
         }
-
-        if(count==4){
-            *(aux1+j) = *(socketdata+i);
-            j++;
+        if (fd == stats_sd) {
+            stats_serve();
+            continue;
         }
-
-        if (*(socketdata+i) == ',' && count==5){
-            *(aux1+j) = '\0';
-            j=0;
-            i++;
+        if (fd == rate_fd) {
+            rate_wake();
             continue;
         }
-
-        if(count==5){
-            *(aux2+j) = *(socketdata+i);
-            j++;
+        if (fd == timeout_fd) {
+            timeout_check();
+            continue;
+        }
+        if (fd == work_fd) {
+            work_resume();
+            continue;
         }
 
-        // Si el carácter actual es el carácter nulo ('\0'), se agrega al final del arreglo aux2 
-        // para finalizar la cadena y se rompe el bucle while.
-        if (*(socketdata+i) == '\0'){
-            *(aux2+j) = '\0';
-            break;
+        // Descartar eventos de descriptores ya cerrados en esta misma vuelta
+        if ((s = fdmap[fd]) == NULL) continue;
+
+        if (fd == s->sd) {
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP)) session_read(s);
+            if (events[i].events & EPOLLOUT) flush_ans(s);
         }
-        i++;
+        session_run(s);
+        session_check(s);
     }
-    puerto = 256 * atoi(aux1) + atoi(aux2);
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = inet_addr(ip);
-    addr.sin_port = htons(puerto);
+}
+
 
-    // Se libera memoria asignada dinámicamente
-    free(ip);
-    free(aux1);
-    free(aux2);
+/*
+ Función: event_loop
+
+ Motor epoll: un único proceso atiende todas las sesiones. Cada sesión es una
+ máquina de estados que avanza cuando su socket de control o de datos está listo.
+ */
+
+void event_loop(int master_sd) {
+    uint32_t master_events = 0;
 
-    send_ans(sd, MSG_200);
+    engine_init();
+    set_nonblocking(master_sd);
+    watch(master_sd, EPOLLIN, &master_events);
 
-    return addr;
+    // Bucle principal; tras SIGUSR2, hasta que terminen las sesiones en curso
+    while (!draining || sessions) {
+        if (upgrade_check(master_sd)) {
+            watch(master_sd, 0, &master_events);
+            close(master_sd);
+            master_sd = -1;
+            continue;
+        }
+        epoll_events(master_sd, -1);
+    }
 }
 
 
 /*
- Función: stor
- 
- Se encarga de recibir un archivo enviado por el cliente a través de una conexión de datos. *
- sd: descriptor de socket de la conexión de control.
- addr: la estructura sockaddr_in que contiene la información de la conexión de datos.
- file_data: Los datos del archivo que se van a recibir.
+ Función: uring_accept
+
+ Pide al kernel la próxima conexión del socket de escucha master_sd.
  */
 
-void stor(int sd, struct sockaddr_in addr, char *file_data) {
-    FILE *file;
-    long f_size, recv_s, r_size = BUFSIZE;
-    char buffer[BUFSIZE];
-    int srcsd;
-    char *file_path, *file_size, *aux;
+void uring_accept(int master_sd) {
+    struct io_uring_sqe *sqe = uring_sqe(NULL, U_ACCEPT);
 
-    // Reserva memoria para las variables auxiliares que contienen nombre de archivo y su tamaño
-    file_path = (char*)malloc(50*sizeof(char));
-    file_size = (char*)malloc(25*sizeof(char));
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = master_sd;
+    iou.peer_len = sizeof(iou.peer);
+    sqe->addr = (uintptr_t) &iou.peer;
+    sqe->addr2 = (uintptr_t) &iou.peer_len;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
 
-    // Extrae el nombre del archivo y su tamaño de los datos del archivo
-    aux = strtok(file_data, "//");
-    strcpy(file_path, aux);
-    aux = strtok(NULL, "//");
-    strcpy(file_size, aux);
-    f_size = atoi(file_size);
 
-    // Envía una respuesta al cliente indicando que el servidor está listo para recibir el archivo
-    send_ans(sd, MSG_150, file_path);
+/*
+ Función: uring_poll_epoll
+
+ Pide al kernel un aviso cuando la instancia de epoll tenga eventos. Por epoll
+ siguen pasando las esperas que no son lecturas ni escrituras (connect y accept
+ del canal de datos, inotify) y las transferencias que no usan io_uring.
+ */
 
-    // Abre una conexión al cliente a través del socket de datos
-    srcsd = socket(AF_INET, SOCK_STREAM, 0);
-    if (srcsd < 0) errx(2, "Cannot create socket");
+void uring_poll_epoll(void) {
+    struct io_uring_sqe *sqe = uring_sqe(NULL, U_EPOLL);
 
-    if (connect(srcsd, (struct sockaddr *) &addr, sizeof(addr)) < 0) errx(3, "Error on connect to data channel");
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = epfd;
+    sqe->poll32_events = POLLIN;
+}
 
-    // Abre el archivo en modo escritura para escribir en él
-    file = fopen(file_path, "w");
 
-    // Recibe el archivo en bloques y escribe los datos en el archivo local
-    while (true) {
-        if (f_size < BUFSIZE) r_size = f_size;
+/*
+ Función: uring_complete
+
+ Atiende una completion: data identifica la sesión y la operación, y res es
+ su resultado (como el valor de retorno de la llamada al sistema, con -errno).
+ */
 
-        // Lee los datos del socket de datos
-        recv_s = read(srcsd, buffer, r_size);
-        if (recv_s < 0) warn("receive error");
+void uring_complete(int master_sd, uint64_t data, int res) {
+    struct session *s = (struct session *) (uintptr_t) (data & ~(uint64_t) 7);
+    enum uring_op op = data & 7;
 
-        // Escribe los datos recibidos en el archivo
-        fwrite(buffer, 1, r_size, file);
+    if (op == U_ACCEPT) {
+        if (res >= 0) {
+            if (!conn_admit(&iou.peer)) {
+                conn_reject(res);
+            } else if (res >= fdmap_size || (s = session_new(res, &iou.peer, false)) == NULL) {
+                warnx("Too many sessions");
+                conn_release(&iou.peer);
+                conn_reject(res);
+            } else {
+                s->uring = true;
+                session_run(s);
+                session_check(s);
+            }
+        } else if (res != -EINTR && res != -ECONNABORTED && res != -EAGAIN) {
+            errno = -res;
+            warn("Error accepting connection");
+        }
+        // Tras SIGUSR2 ya no se piden conexiones nuevas
+        if (master_sd >= 0) uring_accept(master_sd);
+        return;
+    }
+    if (op == U_EPOLL) {
+        epoll_events(-1, 0);
+        uring_poll_epoll();
+        return;
+    }
 
-        if (f_size < BUFSIZE) break;
-        f_size = f_size - BUFSIZE;
+    s->uring_ops--;
+    if (op == U_RECV) {
+        s->uring_recv = false;
+        if (res > 0) s->in.tail += res;
+        else if (res != -EINTR && res != -EAGAIN) session_eof(s, res < 0);
+    } else if (op == U_SEND) {
+        s->uring_send = 0;
+        if (res < 0 && res != -EINTR && res != -EAGAIN) {
+            errno = -res;
+            warn("Error sending message");
+            s->out_len = 0;
+            s->state = ST_CLOSE;
+        } else if (res > 0) {
+            s->out_len -= res;
+            memmove(s->out, s->out + res, s->out_len);
+        }
+    } else {
+        uring_xfer_complete(s, op, res);
     }
 
-    // Cierra la conexión al cliente
-    close(srcsd);
+    session_run(s);
+    session_check(s);
+}
+
+
+/*
+ Función: uring_loop
 
-    // Envía un mensaje indicando que la transferencia del archivo se ha completado
-    send_ans(sd, MSG_226);
+ Motor uring: como event_loop, un único proceso atiende todas las sesiones,
+ pero aceptar conexiones, recibir comandos, enviar respuestas y mover los
+ datos de los archivos son operaciones de io_uring. Las de todas las
+ sesiones se entregan juntas al kernel en una sola llamada por vuelta.
+ Si el sistema no admite io_uring se usa event_loop.
+ */
+
+void uring_loop(int master_sd) {
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    uint64_t data;
+    int res;
+
+    if (!uring_init()) {
+        warnx("io_uring unavailable, using epoll");
+        event_loop(master_sd);
+        return;
+    }
+    engine_init();
+    uring_accept(master_sd);
+    uring_poll_epoll();
 
-    // Libera la memoria reservada
-    free(file_path);
-    free(file_size);
+    // Bucle principal; tras SIGUSR2, hasta que terminen las sesiones en curso
+    while (!draining || sessions) {
+        // El ACCEPT pendiente no se cancela: la conexión que llegue a recibir se atiende igual
+        if (upgrade_check(master_sd)) {
+            close(master_sd);
+            master_sd = -1;
+            continue;
+        }
+        uring_enter(true);
 
-    return;
+        head = *iou.cq_head;
+        while (head != __atomic_load_n(iou.cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &iou.cqes[head & *iou.cq_mask];
+            data = cqe->user_data;
+            res = cqe->res;
+            __atomic_store_n(iou.cq_head, ++head, __ATOMIC_RELEASE);
+            uring_complete(master_sd, data, res);
+        }
+    }
 }
 
 
 /*
 Función: direccion_puerto
 
-Verifica si una cadena de caracteres representa un número de puerto 
+Verifica si una cadena de caracteres representa un número de puerto
 válido a través de un valor booleano.
 return true si la cadena representa un número de puerto válido, false de lo contrario.
  */
@@ -453,38 +5631,39 @@ sig El número de la señal recibida.
 
 void sig_handler(int sig){
     if(sig == SIGCHLD){
-        waitpid(-1, NULL, WNOHANG);
+        while (waitpid(-1, NULL, WNOHANG) > 0);
     }
 }
 
 
-int main(int argc, char *argv[]) {
-    // Verificación de argumentos
-    if (argc < 2) {
-        errx(1, "Port expected as argument");
-    } else if (argc > 2) {
-        errx(1, "Too many arguments");
-    }
+/*
+ Función: listen_on
 
-    // Reservar espacio para sockets y variables
-    int master_sd, slave_sd;
-    struct sockaddr_in master_addr, slave_addr;
+ Crea el socket de escucha del servidor en el puerto port.
+ Con reuseport varios procesos pueden escuchar en el mismo puerto, cada uno
+ con su propio socket, y el kernel reparte entre ellos las conexiones nuevas.
+ */
+
+int listen_on(int port, bool reuseport) {
+    struct sockaddr_in master_addr;
+    int master_sd;
 
     // Crear el socket del servidor y comprobar errores
-    if ((master_sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((master_sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
         err(1, "Error creating socket");
     }
 
     // Establecer las opciones del socket maestro
     int optval = 1;
-    if (setsockopt(master_sd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
+    if (setsockopt(master_sd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ||
+        (reuseport && setsockopt(master_sd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0)) {
         err(1, "Error setting socket options");
     }
 
     // Asignar dirección al socket maestro y comprobar errores
     memset(&master_addr, 0, sizeof(master_addr));
     master_addr.sin_family = AF_INET;
-    master_addr.sin_port = htons(atoi(argv[1]));
+    master_addr.sin_port = htons(port);
     master_addr.sin_addr.s_addr = INADDR_ANY;
     if (bind(master_sd, (struct sockaddr *)&master_addr, sizeof(master_addr)) < 0) {
         err(1, "Error binding socket");
@@ -494,40 +5673,334 @@ int main(int argc, char *argv[]) {
     if (listen(master_sd, SOMAXCONN) < 0) {
         err(1, "Error listening on socket");
     }
+    return master_sd;
+}
 
-    // Bucle principal
-    while (true) {
+
+/*
+ Función: inherit_init
+
+ Toma los sockets de escucha que dejó el binario anterior al actualizarse
+ (ver upgrade_exec), listados en la variable de entorno LISTEN_ENV.
+ */
+
+void inherit_init(void) {
+    char *list = getenv(LISTEN_ENV), *end;
+    long fd;
+
+    while (list && *list && ninherited < MAX_WORKERS) {
+        fd = strtol(list, &end, 10);
+        if (end == list || fd < 0 || fd > INT_MAX) break;
+        inherited[ninherited++] = fd;
+        list = *end == ',' ? end + 1 : end;
+    }
+    unsetenv(LISTEN_ENV);
+}
+
+
+/*
+ Función: listen_fd
+
+ Devuelve el socket de escucha número slot: el heredado del binario
+ anterior si lo hay y escucha en el puerto port, o uno nuevo (ver listen_on).
+ */
+
+int listen_fd(int slot, int port, bool reuseport) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd, listening = 0;
+    socklen_t optlen = sizeof(listening);
+
+    if (slot < ninherited && (fd = inherited[slot]) >= 0) {
+        inherited[slot] = -1;
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &optlen) == 0 && listening &&
+            getsockname(fd, (struct sockaddr *) &addr, &len) == 0 && addr.sin_port == htons(port)) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            return fd;
+        }
+        warnx("Inherited descriptor %d is not listening on port %d", fd, port);
+        close(fd);
+    }
+    return listen_on(port, reuseport);
+}
+
+
+/*
+ Función: inherit_close
+
+ Cierra los sockets heredados que no se usaron (el binario anterior
+ tenía más procesos en modo prefork).
+ */
+
+void inherit_close(void) {
+    int i;
+
+    for (i = 0; i < ninherited; i++) {
+        if (inherited[i] >= 0) close(inherited[i]);
+        inherited[i] = -1;
+    }
+}
+
+
+/*
+ Función: worker_run
+
+ Cuerpo de un proceso del modo prefork: fija opcionalmente su CPU y atiende
+ sesiones con event_loop en su socket de escucha SO_REUSEPORT, lsds[id]
+ (de los workers que creó el padre, cierra los ajenos). Cada proceso carga
+ los usuarios y vigila el archivo con su propio inotify (un descriptor
+ compartido repartiría los avisos entre los procesos).
+ */
+
+void worker_run(int id, int *lsds, int workers, bool affinity) {
+    cpu_set_t set;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    worker = true;
+    stats = &metrics[id];
+    // Las sesiones de un worker anterior con este número terminaron con él
+    conns = &conn_table[id];
+    memset(conns, 0, sizeof(*conns));
+    for (i = 0; i < workers; i++) {
+        if (i != id) close(lsds[i]);
+    }
+
+    if (affinity && ncpu > 0) {
+        CPU_ZERO(&set);
+        CPU_SET(id % ncpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) warn("Cannot set affinity of worker %d", id);
+    }
+
+    users_init();
+    event_loop(lsds[id]);
+}
+
+
+/*
+ Función: stop_handler
+
+ Manejador de SIGTERM y SIGINT del proceso padre del modo prefork.
+ */
+
+void stop_handler(int sig) {
+    (void) sig;
+    stopping = 1;
+}
+
+
+/*
+ Función: prefork
+
+ Crea workers procesos que atienden las sesiones durante toda la vida del
+ servidor y reemplaza a los que terminan. Al recibir SIGTERM o SIGINT
+ termina a todos los procesos antes de salir. Los sockets de escucha los
+ crea este proceso, así sobreviven a los workers que se reemplazan sin
+ perder las conexiones en cola; con SIGUSR2 los pasa a un binario nuevo
+ y espera a que cada worker termine sus sesiones.
+ */
+
+void prefork(int port, int workers, bool affinity) {
+    struct sigaction sa = { .sa_handler = stop_handler }, up = { .sa_handler = upgrade_handler };
+    pid_t *pids, pid;
+    time_t *started;
+    int *lsds, i, status;
+
+    pids = mem_calloc(workers, sizeof(*pids));
+    started = mem_calloc(workers, sizeof(*started));
+    lsds = mem_calloc(workers, sizeof(*lsds));
+    if (pids == NULL || started == NULL || lsds == NULL) err(1, "Error allocating workers");
+
+    // Un socket SO_REUSEPORT por worker, heredados del binario anterior si los hay
+    for (i = 0; i < workers; i++) lsds[i] = listen_fd(i, port, true);
+    inherit_close();
+
+    // Sin SA_RESTART, para que waitpid se interrumpa al recibir la señal
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGUSR2, &up, NULL);
+
+    while (!stopping) {
+        if (upgrading) {
+            upgrading = 0;
+            if (upgrade_exec(lsds, workers)) {
+                draining = true;
+                break;
+            }
+        }
+
+
+        // Crear los procesos que falten
+        for (i = 0; i < workers; i++) {
+            if (pids[i] > 0) continue;
+            // Un proceso que termina enseguida no se reemplaza en un bucle sin pausa
+            if (started[i] && time(NULL) - started[i] < 1) sleep(1);
+            started[i] = time(NULL);
+            pid = fork();
+            if (pid == 0) {
+                worker_run(i, lsds, workers, affinity);
+                exit(draining ? 0 : 1);
+            }
+            if (pid < 0) warn("Error creating process");
+            pids[i] = pid > 0 ? pid : 0;
+        }
+
+        pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            err(1, "Error waiting for workers");
+        }
+        for (i = 0; i < workers; i++) {
+            if (pids[i] != pid) continue;
+            warnx("Worker %d (pid %d) terminated, restarting", i, pid);
+            pids[i] = 0;
+        }
+    }
+
+    // Terminar a todos los procesos; tras SIGUSR2, que dejen de aceptar y terminen sus sesiones
+    if (draining) warnx("Listening sockets handed over, exiting after the active sessions");
+    for (i = 0; i < workers; i++) {
+        if (pids[i] > 0) kill(pids[i], draining ? SIGUSR2 : SIGTERM);
+    }
+    for (i = 0; i < workers; i++) {
+        while (pids[i] > 0 && waitpid(pids[i], NULL, 0) < 0 && errno == EINTR);
+        close(lsds[i]);
+    }
+    free(pids);
+    free(started);
+    free(lsds);
+}
+
+
+/**
+ * Run with
+ *         ./servidor [-m fork|epoll|prefork|uring] [-w workers] [-a] [-P pasv_pool] [-S stats_socket] [-z level] [-T idle[:login]] [-C max[:per_ip]] <PORT>
+ **/
+int main(int argc, char *argv[]) {
+    enum srv_mode mode = MODE_EPOLL;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    bool affinity = false;
+    char *stats_path = NULL;
+    int64_t global_rate = 0, global_burst = 0;
+    int opt;
+
+    // Sockets de escucha del binario anterior y argumentos para lanzar el siguiente
+    inherit_init();
+    exec_argv = argv;
+
+    // Verificación de argumentos
+    while ((opt = getopt(argc, argv, "m:w:aP:S:z:L:U:T:C:")) != -1) {
+        if (opt == 'm' && strcmp(optarg, "fork") == 0) mode = MODE_FORK;
+        else if (opt == 'm' && strcmp(optarg, "epoll") == 0) mode = MODE_EPOLL;
+        else if (opt == 'm' && strcmp(optarg, "prefork") == 0) mode = MODE_PREFORK;
+        else if (opt == 'm' && strcmp(optarg, "uring") == 0) mode = MODE_URING;
+        else if (opt == 'w' && atoi(optarg) > 0) workers = atoi(optarg);
+        else if (opt == 'a') affinity = true;
+        else if (opt == 'P' && atoi(optarg) > 0) pasv_max = atoi(optarg);
+        else if (opt == 'S') stats_path = optarg;
+        else if (opt == 'z' && isdigit(optarg[0]) && atoi(optarg) <= 9) zlevel_default = atoi(optarg);
+        else if (opt == 'L' && parse_rate(optarg, &global_rate, &global_burst)) continue;
+        else if (opt == 'U' && parse_rate(optarg, &user_rate, &user_burst)) continue;
+        else if (opt == 'T' && parse_pair(optarg, &idle_timeout, &login_timeout)) continue;
+        else if (opt == 'C' && parse_pair(optarg, &max_sessions, &max_per_ip)) continue;
+        else errx(1, "usage: %s [-m fork|epoll|prefork|uring] [-w workers] [-a] [-P pasv_pool] [-S stats_socket] [-z level] [-L rate[:burst]] [-U rate[:burst]] [-T idle[:login]] [-C max[:per_ip]] port", argv[0]);
+    }
+    if (argc - optind < 1) {
+        errx(1, "Port expected as argument");
+    } else if (argc - optind > 1) {
+        errx(1, "Too many arguments");
+    }
+    if (!direccion_puerto(argv[optind])) errx(1, "Invalid port");
+    if (workers < 1) workers = 1;
+    // Cada worker necesita su propia fila de métricas y de contadores de sesiones
+    if (workers > MAX_WORKERS) {
+        warnx("At most %d workers, using %d", MAX_WORKERS, MAX_WORKERS);
+        workers = MAX_WORKERS;
+    }
+
+    // Reservar espacio para sockets y variables
+    int master_sd, slave_sd;
+    struct sockaddr_in slave_addr;
+
+    // Un cliente que desaparece no debe terminar el servidor: los errores se tratan con EPIPE
+    signal(SIGPIPE, SIG_IGN);
+
+    // Las métricas, su socket y los límites se crean antes que los procesos, que los heredan
+    metrics_init();
+    conn_init(mode == MODE_PREFORK ? workers : 1);
+    rate_init(global_rate, global_burst);
+    if (stats_path) stats_sd = stats_open(stats_path);
+
+    if (mode == MODE_PREFORK) {
+        prefork(atoi(argv[optind]), workers, affinity);
+        return 0;
+    }
+
+    master_sd = listen_fd(0, atoi(argv[optind]), false);
+    inherit_close();
+
+    // Cargar los usuarios una sola vez; los cambios se detectan con inotify
+    users_init();
+
+    if (mode == MODE_EPOLL) {
+        event_loop(master_sd);
+        return 0;
+    }
+    if (mode == MODE_URING) {
+        uring_loop(master_sd);
+        return 0;
+    }
+
+    signal(SIGCHLD, sig_handler);
+    upgrade_init();
+
+    // Bucle principal del modo fork, hasta pasar el socket de escucha con SIGUSR2
+    struct pollfd fds[2] = { { .fd = master_sd, .events = POLLIN }, { .fd = stats_sd, .events = POLLIN } };
+    while (!upgrade_check(master_sd)) {
         pid_t pid;
+
+        // Esperar en el socket de escucha y, si lo hay, en el de estadísticas
+        if (ppoll(fds, stats_sd >= 0 ? 2 : 1, NULL, &wait_mask) < 0) continue;
+        if (stats_sd >= 0 && (fds[1].revents & POLLIN)) stats_serve();
+        if (!(fds[0].revents & POLLIN)) continue;
+
         // Aceptar conexiones secuencialmente y comprobar errores
         socklen_t slave_addr_len = sizeof(slave_addr);
         if ((slave_sd = accept(master_sd, (struct sockaddr *)&slave_addr, &slave_addr_len)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
             err(1, "Error accepting connection");
         }
 
+        // Rechazar sin crear un proceso si se superan los límites de -C
+        if (!conn_admit(&slave_addr)) {
+            conn_reject(slave_sd);
+            continue;
+        }
 
-        signal(SIGCHLD, sig_handler);
+        // Recargar los usuarios si cambiaron: el hijo hereda la tabla ya cargada
+        notify_poll();
 
+        // El hijo atiende la sesión completa; el padre vuelve a aceptar
         pid = fork();
-        if(pid == 0){
+        if (pid == 0) {
             close(master_sd);
-            break;
+            operate(slave_sd, &slave_addr);
+            exit(0);
         }
-
-        // Enviar saludo al cliente
-        send_ans(slave_sd, MSG_220);
-
-        // Autenticar al cliente
-        if (authenticate(slave_sd)) {
-            // Operar solo si la autenticación es exitosa
-            operate(slave_sd);
+        if (pid < 0) {
+            warn("Error creating process");
+            conn_release(&slave_addr);
         }
 
-        // Cerrar el socket del cliente
+        // Cerrar el socket del cliente en el padre
         close(slave_sd);
     }
 
-    // Cerrar el socket del servidor
+    // Cerrar el socket del servidor y esperar a que terminen las sesiones en curso
     close(master_sd);
+    while (wait(NULL) > 0 || errno == EINTR);
 
     return 0;
 }